@@ -1,10 +1,13 @@
 #include "context.h"
+#include <shared/binding.h>
 
 #include <nvvk/commands_vk.hpp>
 #include <nvvk/images_vk.hpp>
 #include <nvvk/structs_vk.hpp>
 #include "nvvk/renderpasses_vk.hpp"
 
+#include <algorithm>
+
 void ContextAware::init(ContextInitSetting cis) {
   LOG_INFO("{}: creating vulkan instance", "Context");
 
@@ -19,9 +22,6 @@ void ContextAware::init(ContextInitSetting cis) {
   // Search path for shaders and other media
   m_root = NVPSystem::exePath();
 
-  // Create offline resources for offline mode
-  if (getOfflineMode()) createOfflineResources();
-
   // Create parallel queues
   createParallelQueues();
 }
@@ -41,22 +41,18 @@ void ContextAware::resizeGlfwWindow() {
 
 string& ContextAware::getRoot() { return m_root; }
 
-nvvk::Texture ContextAware::getOfflineColor() { return m_offlineColor; }
-
-nvvk::Texture ContextAware::getOfflineDepth() { return m_offlineDepth; }
-
 VkFramebuffer ContextAware::getFramebuffer(int onlineCurFrame) {
   if (!getOfflineMode())
     return AppBaseVk::getFramebuffers()[onlineCurFrame];
   else
-    return m_offlineFramebuffer;
+    return VK_NULL_HANDLE;
 }
 
 VkRenderPass ContextAware::getRenderPass() {
   if (!getOfflineMode())
     return AppBaseVk::getRenderPass();
   else
-    return m_offlineRenderPass;
+    return VK_NULL_HANDLE;
 }
 
 vector<nvvk::Context::Queue>& ContextAware::getParallelQueues() {
@@ -80,87 +76,6 @@ void ContextAware::setViewport(const VkCommandBuffer& cmdBuf) {
   }
 }
 
-void ContextAware::createOfflineResources() {
-  m_alloc.destroy(m_offlineColor);
-  m_alloc.destroy(m_offlineDepth);
-  vkDestroyRenderPass(m_device, m_offlineRenderPass, nullptr);
-  vkDestroyFramebuffer(m_device, m_offlineFramebuffer, nullptr);
-  m_offlineRenderPass = VK_NULL_HANDLE;
-  m_offlineFramebuffer = VK_NULL_HANDLE;
-
-  VkFormat colorFormat{VK_FORMAT_R32G32B32A32_SFLOAT};
-  VkFormat depthFormat = nvvk::findDepthFormat(m_physicalDevice);
-
-  // Creating the color image
-  {
-    auto colorCreateInfo = nvvk::makeImage2DCreateInfo(
-        m_size, colorFormat,
-        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
-            VK_IMAGE_USAGE_STORAGE_BIT);
-
-    nvvk::Image image = m_alloc.createImage(colorCreateInfo);
-    NAME2_VK(image.image, "Offline Color");
-
-    VkImageViewCreateInfo ivInfo =
-        nvvk::makeImageViewCreateInfo(image.image, colorCreateInfo);
-    VkSamplerCreateInfo sampler{VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO};
-    m_offlineColor = m_alloc.createTexture(image, ivInfo, sampler);
-    m_offlineColor.descriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-  }
-
-  // Creating the depth buffer
-  auto depthCreateInfo = nvvk::makeImage2DCreateInfo(
-      m_size, depthFormat, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
-  {
-    nvvk::Image image = m_alloc.createImage(depthCreateInfo);
-    NAME2_VK(image.image, "Offline Depth");
-
-    VkImageViewCreateInfo depthStencilView{
-        VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO};
-    depthStencilView.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    depthStencilView.format = depthFormat;
-    depthStencilView.subresourceRange = {VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1};
-    depthStencilView.image = image.image;
-
-    m_offlineDepth = m_alloc.createTexture(image, depthStencilView);
-  }
-
-  // Setting the image layout for both color and depth
-  {
-    nvvk::CommandPool genCmdBuf(m_device, m_graphicsQueueIndex);
-    auto cmdBuf = genCmdBuf.createCommandBuffer();
-    nvvk::cmdBarrierImageLayout(cmdBuf, m_offlineColor.image,
-                                VK_IMAGE_LAYOUT_UNDEFINED,
-                                VK_IMAGE_LAYOUT_GENERAL);
-    nvvk::cmdBarrierImageLayout(
-        cmdBuf, m_offlineDepth.image, VK_IMAGE_LAYOUT_UNDEFINED,
-        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-        VK_IMAGE_ASPECT_DEPTH_BIT);
-
-    genCmdBuf.submitAndWait(cmdBuf);
-  }
-
-  // Creating a renderpass for the offscreen
-  m_offlineRenderPass = nvvk::createRenderPass(
-      m_device, {colorFormat}, depthFormat, 1, true, true,
-      VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL);
-  NAME2_VK(m_offlineRenderPass, "Offline RenderPass");
-
-  // Creating the frame buffer for offscreen
-  std::vector<VkImageView> attachments = {m_offlineColor.descriptor.imageView,
-                                          m_offlineDepth.descriptor.imageView};
-
-  VkFramebufferCreateInfo info{VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO};
-  info.renderPass = m_offlineRenderPass;
-  info.attachmentCount = 2;
-  info.pAttachments = attachments.data();
-  info.width = m_size.width;
-  info.height = m_size.height;
-  info.layers = 1;
-  vkCreateFramebuffer(m_device, &info, nullptr, &m_offlineFramebuffer);
-  NAME2_VK(m_offlineFramebuffer, "Offline Framebuffer");
-}
-
 void ContextAware::createParallelQueues() {
   auto qGCT1 =
       m_vkcontext.createQueue(m_contextInfo.defaultQueueGCT, "GCT1", 1.0f);
@@ -183,6 +98,73 @@ nvvk::DebugUtil& ContextAware::getDebug() { return m_debug; }
 
 bool ContextAware::getOfflineMode() { return m_cis.offline; }
 
+uint32_t ContextAware::getBatchSize() {
+  if (!getOfflineMode()) return 1;
+  return uint32_t(std::min(std::max(m_cis.batchSize, 1), MAX_BATCH_SIZE));
+}
+
+uint32_t ContextAware::getBatchImagesNum() {
+  return getBidirectionalMode() ? 2 : 1;
+}
+
+void ContextAware::setDefaultBatchSize(int batchSize) {
+  if (m_cis.batchSize == 0) m_cis.batchSize = batchSize;
+}
+
+bool ContextAware::getRefCacheMode() {
+  return getOfflineMode() && m_cis.refCache && !m_cis.fanOut &&
+         !m_cis.bidirectional;
+}
+
+bool ContextAware::getFanOutMode() {
+  return getOfflineMode() && m_cis.fanOut && !m_cis.bidirectional;
+}
+
+bool ContextAware::getBidirectionalMode() {
+  return getOfflineMode() && m_cis.bidirectional;
+}
+
+OutputFormat ContextAware::getOutputFormat() {
+  if (!getOfflineMode()) return OutputFormat::Rgba32f;
+  return m_cis.outputFormat;
+}
+
+VkFormat ContextAware::getOutputImageFormat() {
+  switch (getOutputFormat()) {
+    case OutputFormat::Rg32f:
+      return VK_FORMAT_R32G32_SFLOAT;
+    case OutputFormat::Rg16f:
+      return VK_FORMAT_R16G16_SFLOAT;
+    default:
+      return VK_FORMAT_R32G32B32A32_SFLOAT;
+  }
+}
+
+uint32_t ContextAware::getOutputTexelSize() {
+  switch (getOutputFormat()) {
+    case OutputFormat::Rg32f:
+      return 2 * sizeof(float);
+    case OutputFormat::Rg16f:
+      return 2 * sizeof(uint16_t);
+    default:
+      return 4 * sizeof(float);
+  }
+}
+
+bool ContextAware::getCompactOutputMode() {
+  return getOutputFormat() != OutputFormat::Rgba32f;
+}
+
+uint32_t ContextAware::getMaskPlanesNum() {
+  if (!getCompactOutputMode()) return 0;
+  return getBidirectionalMode() ? MaskNum : 1;
+}
+
+VkDeviceSize ContextAware::getMaskLayerSize() {
+  VkDeviceSize pixelsNum = VkDeviceSize(m_size.width) * m_size.height;
+  return (pixelsNum + 31) / 32 * sizeof(uint32_t);
+}
+
 void ContextAware::createGlfwWindow() {
   // Check initialization of glfw library
   if (!glfwInit()) {
@@ -294,6 +276,24 @@ void ContextAware::initializeVulkan() {
               << std::endl;
     exit(1);
   }
+  // Shaders of compact output formats write their images without a format,
+  // and rg32f and rg16f are not storage formats everywhere. nvvk enables
+  // every supported core feature.
+  if (getCompactOutputMode()) {
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(m_vkcontext.m_physicalDevice,
+                                        getOutputImageFormat(),
+                                        &formatProperties);
+    if (m_vkcontext.m_physicalInfo.features10
+                .shaderStorageImageWriteWithoutFormat != VK_TRUE ||
+        !(formatProperties.optimalTilingFeatures &
+          VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+      std::cerr << "[!] Vulkan: device does not support storage images of "
+                   "the compact output format"
+                << std::endl;
+      exit(1);
+    }
+  }
 }
 
 void ContextAware::createAppContext() {
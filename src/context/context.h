@@ -28,10 +28,23 @@ using std::vector;
 
 // We are using this to change the image to display on the fly
 constexpr int FRAMES_IN_FLIGHT = 3;
+// Each pair of a batch takes a layer of every output image, and a slot of
+// the reference view cache when on
+constexpr int MAX_BATCH_SIZE = 64;
+
+// Texel format of the output images. The compact formats keep only the flow
+// and leave visibility and consistency to bits of the visibility mask.
+enum class OutputFormat { Rgba32f, Rg32f, Rg16f };
 
 struct ContextInitSetting {
   bool offline{false};
   int useGpuId{0};
+  int batchSize{0};           // offline: pairs traced per submission, 0 for
+                              // the default
+  bool refCache{false};       // offline: trace each reference view once
+  bool fanOut{false};         // offline: one launch per reference view
+  bool bidirectional{false};  // offline: both flows and their consistency
+  OutputFormat outputFormat{OutputFormat::Rgba32f};  // offline
 };
 
 class ContextAware : public nvvk::AppBaseVk {
@@ -62,19 +75,61 @@ public:
   // If in offline mode, return true
   bool getOfflineMode();
 
-  // Path of exectuable program
-  string& getRoot();
+  // Pairs traced at once, in as many layers of the output images. Always 1
+  // in online mode.
+  uint32_t getBatchSize();
+  // Batch size of a run that did not set one, once the pairs are known
+  void setDefaultBatchSize(int batchSize);
+
+  // Output images read back offline, which get a layer per pair of a batch.
+  // The other output images keep a single layer.
+  uint32_t getBatchImagesNum();
+
+  // Whether primary hits of reference views are cached in a G-buffer and
+  // reused by the following pairs of the same reference. Always false in
+  // online mode, and in fan-out mode, which traces each reference view once
+  // per launch anyway.
+  bool getRefCacheMode();
+
+  // Whether the pairs of a batch share their reference view, which each
+  // pixel traces once before looping over the source views. Always false in
+  // online mode.
+  bool getFanOutMode();
+
+  // Whether each pair gets the flows of both directions and their
+  // forward-backward consistency, in the first two output images. Always
+  // false in online mode, and overrides fan-out and the reference view cache.
+  bool getBidirectionalMode();
+
+  // Texel format of the output images. Always rgba32f in online mode, which
+  // displays them.
+  OutputFormat getOutputFormat();
 
-  // Offline rgba32f buffer(ldr)
-  nvvk::Texture getOfflineColor();
+  // Vulkan format of the output images
+  VkFormat getOutputImageFormat();
 
-  // Offline depth buffer(only used for renderpass)
-  nvvk::Texture getOfflineDepth();
+  // Bytes per texel of the output images
+  uint32_t getOutputTexelSize();
 
-  // Offline framebuffer(attachment: offlineColor and offlineDepth)
+  // Whether flags live in the visibility mask rather than the output images
+  bool getCompactOutputMode();
+
+  // Planes of the visibility mask, none unless the output is compact
+  uint32_t getMaskPlanesNum();
+
+  // Bytes of one layer of a plane of the visibility mask, a bit per pixel
+  // rounded up to whole 32 bit words
+  VkDeviceSize getMaskLayerSize();
+
+  // Path of exectuable program
+  string& getRoot();
+
+  // Online framebuffer of the swap chain. Offline mode reads the hdr output
+  // back as is, without post processing, so it has no framebuffer, render
+  // pass or ldr and depth targets at all.
   VkFramebuffer getFramebuffer(int curFrame = 0);
 
-  // Offline render pass
+  // Online render pass
   VkRenderPass getRenderPass();
 
   vector<nvvk::Context::Queue>& getParallelQueues();
@@ -83,15 +138,8 @@ private:
   void createGlfwWindow();
   void initializeVulkan();
   void createAppContext();
-  void createOfflineResources();
   void createParallelQueues();
 
-private:
-  VkRenderPass m_offlineRenderPass{VK_NULL_HANDLE};
-  VkFramebuffer m_offlineFramebuffer{VK_NULL_HANDLE};
-  nvvk::Texture m_offlineColor;
-  nvvk::Texture m_offlineDepth;
-
 private:
   ContextInitSetting m_cis;
   nvvk::ResourceAllocatorDedicated m_alloc;
@@ -10,10 +10,15 @@ InstancesAlloc::InstancesAlloc(ContextAware* pContext,
   for (auto& instance : instances) {
     GpuInstance desc;
     auto pMeshAlloc = meshAllocs[instance.getMeshIndex()];
-    desc.vertexAddress =
-        nvvk::getBufferDeviceAddress(m_device, pMeshAlloc->getVerticesBuffer());
+    desc.vertexAddress = nvvk::getBufferDeviceAddress(
+        m_device, pMeshAlloc->getPositionsBuffer());
     desc.indexAddress =
         nvvk::getBufferDeviceAddress(m_device, pMeshAlloc->getIndicesBuffer());
+    desc.normalAddress =
+        pMeshAlloc->getNormalsBuffer() == VK_NULL_HANDLE
+            ? 0
+            : nvvk::getBufferDeviceAddress(m_device,
+                                           pMeshAlloc->getNormalsBuffer());
     m_instances.emplace_back(desc);
   }
   m_bInstances = m_alloc.createBuffer(cmdBuf, m_instances,
@@ -0,0 +1,56 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+  if (m_pData) UnmapViewOfFile(m_pData);
+  if (m_hMapping) CloseHandle(m_hMapping);
+  if (m_hFile) CloseHandle(m_hFile);
+#else
+  if (m_pData) munmap(const_cast<char*>(m_pData), m_size);
+#endif
+}
+
+bool MappedFile::open(const std::string& filename) {
+#ifdef _WIN32
+  HANDLE hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                             nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                             nullptr);
+  if (hFile == INVALID_HANDLE_VALUE) return false;
+  m_hFile = hFile;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(hFile, &size) || size.QuadPart == 0) return false;
+  m_hMapping = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!m_hMapping) return false;
+  m_pData = static_cast<const char*>(
+      MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+  if (!m_pData) return false;
+  m_size = size_t(size.QuadPart);
+#else
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+  // The mapping stays valid once the descriptor is closed
+  void* pData =
+      mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (pData == MAP_FAILED) return false;
+  m_pData = static_cast<const char*>(pData);
+  m_size = size_t(st.st_size);
+#endif
+  return true;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Read only memory mapping of a whole file. Pages are only read from disk
+// when touched, and concurrent jobs on one machine share them.
+class MappedFile {
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+
+  bool open(const std::string& filename);
+  const char* getData() const { return m_pData; }
+  size_t getSize() const { return m_size; }
+
+private:
+  const char* m_pData{nullptr};
+  size_t m_size{0};
+#ifdef _WIN32
+  void* m_hFile{nullptr};
+  void* m_hMapping{nullptr};
+#endif
+};
@@ -3,44 +3,42 @@
 #include <nvh/nvprint.hpp>
 #include <nvvk/buffers_vk.hpp>
 #include <nvvk/commands_vk.hpp>
-#define TINYOBJLOADER_IMPLEMENTATION
-#include <tiny_obj_loader.h>
-
-static void updateAabb(const GpuVertex& v, vec3& posMin, vec3& posMax) {
-  posMin.x = std::min(posMin.x, v.pos.x);
-  posMin.y = std::min(posMin.y, v.pos.y);
-  posMin.z = std::min(posMin.z, v.pos.z);
-  posMax.x = std::max(posMax.x, v.pos.x);
-  posMax.y = std::max(posMax.y, v.pos.y);
-  posMax.z = std::max(posMax.z, v.pos.z);
-}
 
-Mesh::Mesh(const std::string& meshPath, bool recomputeNormal, vec2 uvScale) {
-  m_vertices.clear();
-  m_indices.clear();
-  loadMesh(meshPath, m_vertices, m_indices);
-
-  for (size_t i = 0; i < m_indices.size(); i += 3) {
-    GpuVertex& v0 = m_vertices[m_indices[i + 0]];
-    GpuVertex& v1 = m_vertices[m_indices[i + 1]];
-    GpuVertex& v2 = m_vertices[m_indices[i + 2]];
-
-    if (recomputeNormal) {
-      nvmath::vec3f n = nvmath::normalize(
-          nvmath::cross((v1.pos - v0.pos), (v2.pos - v0.pos)));
-      v0.normal = n;
-      v1.normal = n;
-      v2.normal = n;
+Mesh::Mesh(const std::string& meshPath, bool recomputeNormal, vec2 uvScale,
+           uint threadsNum) {
+  if (getMeshFormat(meshPath) == MeshFormat::Binary) {
+    m_pFile = std::make_shared<MappedFile>();
+    if (!m_pFile->open(meshPath) || !viewMeshFile(*m_pFile, m_view)) {
+      LOG_ERROR("{}: load mesh from [{}] --- not a valid mesh file", "Scene",
+                meshPath);
+      exit(1);
+    }
+    if (recomputeNormal) m_view.normals = nullptr;
+    // Scaled uvs are the only stream copied out of the mapping
+    if (m_view.uvs && (uvScale.x != 1.f || uvScale.y != 1.f)) {
+      m_data.uvs.assign(m_view.uvs, m_view.uvs + m_view.verticesNum);
+      for (auto& uv : m_data.uvs) uv = uvScale * uv;
+      m_view.uvs = m_data.uvs.data();
     }
+    return;
+  }
 
-    v0.uv = uvScale * v0.uv;
-    v1.uv = uvScale * v1.uv;
-    v2.uv = uvScale * v2.uv;
+  loadMeshFile(meshPath, m_data, recomputeNormal, threadsNum);
+  for (auto& uv : m_data.uvs) uv = uvScale * uv;
+  viewData();
+}
 
-    updateAabb(v0, m_posMin, m_posMax);
-    updateAabb(v1, m_posMin, m_posMax);
-    updateAabb(v2, m_posMin, m_posMax);
-  }
+Mesh::Mesh(MeshData&& data) : m_data(std::move(data)) { viewData(); }
+
+void Mesh::viewData() {
+  m_view.positions = m_data.positions.data();
+  m_view.normals = m_data.normals.empty() ? nullptr : m_data.normals.data();
+  m_view.uvs = m_data.uvs.empty() ? nullptr : m_data.uvs.data();
+  m_view.indices = m_data.indices.data();
+  m_view.verticesNum = static_cast<uint>(m_data.positions.size());
+  m_view.indicesNum = static_cast<uint>(m_data.indices.size());
+  computeBounds(m_view.positions, m_view.verticesNum, m_view.posMin,
+                m_view.posMax);
 }
 
 MeshAlloc::MeshAlloc(ContextAware* pContext, Mesh* pMesh,
@@ -59,75 +57,54 @@ MeshAlloc::MeshAlloc(ContextAware* pContext, Mesh* pMesh,
       flag |
       VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-  m_bVertices =
-      m_alloc.createBuffer(cmdBuf, pMesh->getVertices(),
-                           VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | rayTracingFlags);
-  m_bIndices =
-      m_alloc.createBuffer(cmdBuf, pMesh->getIndices(),
-                           VK_BUFFER_USAGE_INDEX_BUFFER_BIT | rayTracingFlags);
+  // Only positions and normals are read on device, uvs stay on host.
+  // Positions alone are what the blas build reads. Streams are staged
+  // straight from the mesh, which may be a mapped file.
+  m_bPositions = m_alloc.createBuffer(
+      cmdBuf, m_numVertices * sizeof(vec3), pMesh->getPositions(),
+      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | rayTracingFlags);
+  if (pMesh->hasVertexNormals())
+    m_bNormals = m_alloc.createBuffer(
+        cmdBuf, m_numVertices * sizeof(vec3), pMesh->getNormals(),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | flag);
+  m_bIndices = m_alloc.createBuffer(
+      cmdBuf, m_numIndices * sizeof(uint), pMesh->getIndices(),
+      VK_BUFFER_USAGE_INDEX_BUFFER_BIT | rayTracingFlags);
+}
+
+vector<VkBuffer> MeshAlloc::getBuffers() {
+  vector<VkBuffer> buffers = {m_bPositions.buffer, m_bIndices.buffer};
+  if (m_bNormals.buffer != VK_NULL_HANDLE) buffers.push_back(m_bNormals.buffer);
+  return buffers;
 }
 
 void MeshAlloc::deinit(ContextAware* pContext) {
   auto& m_alloc = pContext->getAlloc();
 
-  m_alloc.destroy(m_bVertices);
+  m_alloc.destroy(m_bPositions);
+  if (m_bNormals.buffer != VK_NULL_HANDLE) m_alloc.destroy(m_bNormals);
   m_alloc.destroy(m_bIndices);
 
   intoReleased();
 }
 
-void loadMesh(const std::string& meshPath, vector<GpuVertex>& vertices,
-              vector<uint>& indices) {
-  tinyobj::ObjReader reader;
-  reader.ParseFromFile(meshPath);
-  if (!reader.Valid()) {
-    LOG_ERROR("{}: load mesh from [{}] --- {}", "Scene", meshPath.c_str(),
-              reader.Error().c_str());
-    exit(1);
-  }
-  const auto& shapes = reader.GetShapes();
-  const auto& attrib = reader.GetAttrib();
-  for (const auto& shape : shapes) {
-    vertices.reserve(vertices.size() + shape.mesh.indices.size());
-    indices.reserve(indices.size() + shape.mesh.indices.size());
-    for (const auto& index : shape.mesh.indices) {
-      GpuVertex vertex = {};
-      const float* vp = &attrib.vertices[3 * index.vertex_index];
-      vertex.pos = {*(vp + 0), *(vp + 1), *(vp + 2)};
-
-      if (!attrib.texcoords.empty() && index.texcoord_index >= 0) {
-        const float* tp = &attrib.texcoords[2 * index.texcoord_index + 0];
-        vertex.uv = {*tp, 1.0f - *(tp + 1)};
-      }
-
-      if (!attrib.normals.empty() && index.normal_index >= 0) {
-        const float* np = &attrib.normals[3 * index.normal_index];
-        vertex.normal = {*(np + 0), *(np + 1), *(np + 2)};
-      }
-
-      vertices.push_back(vertex);
-      indices.push_back(static_cast<int>(indices.size()));
-    }
-  }
-}
-
 nvvk::RaytracingBuilderKHR::BlasInput MeshBufferToBlas(VkDevice device,
                                                        MeshAlloc& meshAlloc) {
   // BLAS builder requires raw device addresses.
   VkDeviceAddress vertexAddress =
-      nvvk::getBufferDeviceAddress(device, meshAlloc.getVerticesBuffer());
+      nvvk::getBufferDeviceAddress(device, meshAlloc.getPositionsBuffer());
   VkDeviceAddress indexAddress =
       nvvk::getBufferDeviceAddress(device, meshAlloc.getIndicesBuffer());
 
   uint maxPrimitiveCount = meshAlloc.getIndicesNum() / 3;
 
-  // Describe buffer as array of Vertex.
+  // Describe buffer as array of packed positions.
   VkAccelerationStructureGeometryTrianglesDataKHR triangles{
       VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR};
   triangles.vertexFormat =
       VK_FORMAT_R32G32B32_SFLOAT;  // vec3 vertex position data.
   triangles.vertexData.deviceAddress = vertexAddress;
-  triangles.vertexStride = sizeof(GpuVertex);
+  triangles.vertexStride = sizeof(vec3);
   // Describe index data (32-bit unsigned int)
   triangles.indexType = VK_INDEX_TYPE_UINT32;
   triangles.indexData.deviceAddress = indexAddress;
@@ -1,34 +1,45 @@
 #pragma once
 
-#include <shared/vertex.h>
 #include <context/context.h>
 #include <nvvk/raytraceKHR_vk.hpp>
 #include "alloc.h"
 #include "bounding_box.h"
+#include "mesh_io.h"
 
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
-void loadMesh(const std::string& meshPath, vector<GpuVertex>& vertices,
-              vector<uint>& indices);
-
+// Host streams of a mesh, either parsed from an obj file or viewed in place
+// from a mapped binary mesh file, see mesh_io.h
 class Mesh {
 public:
+  // threadsNum as in loadMesh()
   Mesh(const std::string& meshPath, bool recomputeNormal = false,
-       vec2 uvScale = {1.f, 1.f});
-  uint getVerticesNum() { return m_vertices.size(); }
-  uint getIndicesNum() { return m_indices.size(); }
-  const vector<GpuVertex>& getVertices() { return m_vertices; }
-  const vector<uint>& getIndices() { return m_indices; }
-  const vec3& getPosMin() { return m_posMin; }
-  const vec3& getPosMax() { return m_posMax; }
+       vec2 uvScale = {1.f, 1.f}, uint threadsNum = 0);
+  // Streams loaded by someone else, like the gltf importer
+  Mesh(MeshData&& data);
+  uint getVerticesNum() { return m_view.verticesNum; }
+  uint getIndicesNum() { return m_view.indicesNum; }
+  const vec3* getPositions() { return m_view.positions; }
+  // nullptr when normals are face normals (recomputed or missing), which
+  // shaders derive from positions, so no normal stream is uploaded
+  const vec3* getNormals() { return m_view.normals; }
+  // nullptr without texture coordinates
+  const vec2* getUvs() { return m_view.uvs; }
+  const uint* getIndices() { return m_view.indices; }
+  const vec3& getPosMin() { return m_view.posMin; }
+  const vec3& getPosMax() { return m_view.posMax; }
+  bool hasVertexNormals() { return m_view.normals != nullptr; }
+
+private:
+  void viewData();
 
 private:
-  vector<GpuVertex> m_vertices{};
-  vector<uint> m_indices{};
-  vec3 m_posMin{BBOX_MAXF};
-  vec3 m_posMax{BBOX_MINF};
+  MeshData m_data{};                      // streams of a parsed mesh
+  std::shared_ptr<MappedFile> m_pFile{};  // or the mapping of a mesh file
+  MeshFileView m_view{};                  // into either of them
 };
 
 class MeshAlloc : public GpuAlloc {
@@ -36,7 +47,10 @@ public:
   MeshAlloc(ContextAware* pContext, Mesh* pMesh, const VkCommandBuffer& cmdBuf);
   void deinit(ContextAware* pContext);
   VkBuffer getIndicesBuffer() { return m_bIndices.buffer; }
-  VkBuffer getVerticesBuffer() { return m_bVertices.buffer; }
+  VkBuffer getPositionsBuffer() { return m_bPositions.buffer; }
+  // VK_NULL_HANDLE when the mesh has no vertex normals
+  VkBuffer getNormalsBuffer() { return m_bNormals.buffer; }
+  vector<VkBuffer> getBuffers();
   uint getIndicesNum() { return m_numIndices; }
   uint getVerticesNum() { return m_numVertices; }
   const vec3& getPosMin() { return m_posMin; }
@@ -47,8 +61,9 @@ private:
   uint m_numVertices{0};
   vec3 m_posMin{0, 0, 0};
   vec3 m_posMax{0, 0, 0};
-  nvvk::Buffer m_bIndices;   // Device buffer of the indices forming triangles
-  nvvk::Buffer m_bVertices;  // Device buffer of all 'Vertex'
+  nvvk::Buffer m_bIndices;    // Device buffer of the indices forming triangles
+  nvvk::Buffer m_bPositions;  // Device buffer of packed vertex positions
+  nvvk::Buffer m_bNormals;    // Device buffer of packed vertex normals
 };
 
 nvvk::RaytracingBuilderKHR::BlasInput MeshBufferToBlas(VkDevice device,
@@ -0,0 +1,604 @@
+#include "mesh_io.h"
+
+#include <shared/vertex.h>
+#include <context/context.h>
+#include "bounding_box.h"
+#include "worker_pool.h"
+#define TINYOBJLOADER_IMPLEMENTATION
+#include <tiny_obj_loader.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+// Bits of the attributes a vertex is welded on: position, uv and normal
+struct WeldKey {
+  uint32_t bits[8];
+  WeldKey(const GpuVertex& v) {
+    memcpy(bits + 0, &v.pos, sizeof(float) * 3);
+    memcpy(bits + 3, &v.uv, sizeof(float) * 2);
+    memcpy(bits + 5, &v.normal, sizeof(float) * 3);
+  }
+  bool operator==(const WeldKey& other) const {
+    return memcmp(bits, other.bits, sizeof(bits)) == 0;
+  }
+  size_t hash() const {
+    // Multiplies only carry bits upward, fold the high bits back down since
+    // the table uses the low ones
+    uint64_t h = 0;
+    for (uint32_t b : bits) {
+      h = (h ^ b) * 0x9e3779b97f4a7c15ull;
+      h ^= h >> 32;
+    }
+    return size_t(h);
+  }
+};
+
+// Merge the vertices with equal attributes and remap the indices to them.
+// Open addressing over a power of two table, far cheaper than a node based
+// map for the millions of corners of a scan.
+static void weldVertices(vector<GpuVertex>& vertices, vector<uint>& indices) {
+  const uint empty = ~0u;
+  size_t capacity = 1;
+  while (capacity < 2 * vertices.size()) capacity <<= 1;
+  vector<uint> table(capacity, empty);
+  vector<uint> remap(vertices.size());
+
+  uint weldedNum = 0;
+  for (size_t i = 0; i < vertices.size(); i++) {
+    GpuVertex v = vertices[i];
+    WeldKey key(v);
+    size_t slot = key.hash() & (capacity - 1);
+    while (table[slot] != empty && !(WeldKey(vertices[table[slot]]) == key))
+      slot = (slot + 1) & (capacity - 1);
+    if (table[slot] == empty) {
+      // Unique vertices are compacted in place, weldedNum <= i
+      table[slot] = weldedNum;
+      vertices[weldedNum++] = v;
+    }
+    remap[i] = table[slot];
+  }
+  vertices.resize(weldedNum);
+  vertices.shrink_to_fit();
+  for (auto& index : indices) index = remap[index];
+}
+
+// One face corner per index, then welded. Normals of the file are skipped
+// when recomputed, shading then takes the face normal and corners of
+// different faces weld on position and uv alone.
+static void loadShape(const tinyobj::attrib_t& attrib,
+                      const tinyobj::shape_t& shape, bool recomputeNormal,
+                      vector<GpuVertex>& vertices, vector<uint>& indices) {
+  vertices.reserve(shape.mesh.indices.size());
+  indices.reserve(shape.mesh.indices.size());
+  for (const auto& index : shape.mesh.indices) {
+    GpuVertex vertex = {};
+    const float* vp = &attrib.vertices[3 * index.vertex_index];
+    vertex.pos = {*(vp + 0), *(vp + 1), *(vp + 2)};
+
+    if (!attrib.texcoords.empty() && index.texcoord_index >= 0) {
+      const float* tp = &attrib.texcoords[2 * index.texcoord_index + 0];
+      vertex.uv = {*tp, 1.0f - *(tp + 1)};
+    }
+
+    if (!recomputeNormal && !attrib.normals.empty() &&
+        index.normal_index >= 0) {
+      const float* np = &attrib.normals[3 * index.normal_index];
+      vertex.normal = {*(np + 0), *(np + 1), *(np + 2)};
+    }
+
+    vertices.push_back(vertex);
+    indices.push_back(static_cast<int>(indices.size()));
+  }
+
+  weldVertices(vertices, indices);
+}
+
+void loadMesh(const std::string& meshPath, MeshData& data,
+              bool recomputeNormal, uint threadsNum) {
+  tinyobj::ObjReader reader;
+  reader.ParseFromFile(meshPath);
+  if (!reader.Valid()) {
+    LOG_ERROR("{}: load mesh from [{}] --- {}", "Scene", meshPath.c_str(),
+              reader.Error().c_str());
+    exit(1);
+  }
+  const auto& shapes = reader.GetShapes();
+  const auto& attrib = reader.GetAttrib();
+
+  // Shapes are welded separately, so they can be loaded in parallel
+  vector<vector<GpuVertex>> shapeVertices(shapes.size());
+  vector<vector<uint>> shapeIndices(shapes.size());
+  auto weldShape = [&](size_t shapeId) {
+    loadShape(attrib, shapes[shapeId], recomputeNormal,
+              shapeVertices[shapeId], shapeIndices[shapeId]);
+  };
+  if (threadsNum == 0)
+    threadsNum = std::max(1u, std::thread::hardware_concurrency());
+  threadsNum = uint(std::min<size_t>(threadsNum, shapes.size()));
+  if (threadsNum <= 1) {
+    for (size_t shapeId = 0; shapeId < shapes.size(); shapeId++)
+      weldShape(shapeId);
+  } else {
+    WorkerPool welders;
+    welders.init(threadsNum);
+    vector<std::future<void>> welds;
+    for (size_t shapeId = 0; shapeId < shapes.size(); shapeId++)
+      welds.push_back(welders.submit([&, shapeId]() { weldShape(shapeId); }));
+    for (auto& weld : welds) weld.get();
+  }
+
+  size_t cornersNum = 0, verticesNum = 0;
+  bool hasNormals = false;
+  for (size_t shapeId = 0; shapeId < shapes.size(); shapeId++) {
+    cornersNum += shapeIndices[shapeId].size();
+    verticesNum += shapeVertices[shapeId].size();
+    for (const auto& v : shapeVertices[shapeId])
+      hasNormals |=
+          v.normal.x != 0.f || v.normal.y != 0.f || v.normal.z != 0.f;
+  }
+  bool hasUvs = !attrib.texcoords.empty();
+
+  // Split into streams, the ones the file does not have are left empty
+  data = MeshData();
+  data.positions.reserve(verticesNum);
+  if (hasNormals) data.normals.reserve(verticesNum);
+  if (hasUvs) data.uvs.reserve(verticesNum);
+  data.indices.reserve(cornersNum);
+  for (size_t shapeId = 0; shapeId < shapes.size(); shapeId++) {
+    uint base = static_cast<uint>(data.positions.size());
+    for (const auto& v : shapeVertices[shapeId]) {
+      data.positions.push_back(v.pos);
+      if (hasNormals) data.normals.push_back(v.normal);
+      if (hasUvs) data.uvs.push_back(v.uv);
+    }
+    for (uint index : shapeIndices[shapeId])
+      data.indices.push_back(base + index);
+    vector<GpuVertex>().swap(shapeVertices[shapeId]);
+    vector<uint>().swap(shapeIndices[shapeId]);
+  }
+  LOG_INFO("{}: welded [{}] from {} to {} vertices", "Scene", meshPath,
+           cornersNum, verticesNum);
+}
+
+enum class PlyType {
+  Int8,
+  Uint8,
+  Int16,
+  Uint16,
+  Int32,
+  Uint32,
+  Float32,
+  Float64,
+  Invalid
+};
+
+static PlyType parsePlyType(const std::string& name) {
+  if (name == "char" || name == "int8") return PlyType::Int8;
+  if (name == "uchar" || name == "uint8") return PlyType::Uint8;
+  if (name == "short" || name == "int16") return PlyType::Int16;
+  if (name == "ushort" || name == "uint16") return PlyType::Uint16;
+  if (name == "int" || name == "int32") return PlyType::Int32;
+  if (name == "uint" || name == "uint32") return PlyType::Uint32;
+  if (name == "float" || name == "float32") return PlyType::Float32;
+  if (name == "double" || name == "float64") return PlyType::Float64;
+  return PlyType::Invalid;
+}
+
+static size_t getPlyTypeSize(PlyType type) {
+  switch (type) {
+    case PlyType::Int8:
+    case PlyType::Uint8:
+      return 1;
+    case PlyType::Int16:
+    case PlyType::Uint16:
+      return 2;
+    case PlyType::Int32:
+    case PlyType::Uint32:
+    case PlyType::Float32:
+      return 4;
+    case PlyType::Float64:
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+struct PlyProperty {
+  std::string name{};
+  PlyType type{PlyType::Invalid};
+  PlyType countType{PlyType::Invalid};  // only for lists
+  bool isList{false};
+};
+
+struct PlyElement {
+  std::string name{};
+  size_t count{0};
+  vector<PlyProperty> properties{};
+};
+
+template <typename T>
+static T readPlyScalar(const char* pData, bool swap) {
+  char bytes[sizeof(T)];
+  memcpy(bytes, pData, sizeof(T));
+  if (swap) std::reverse(bytes, bytes + sizeof(T));
+  T value;
+  memcpy(&value, bytes, sizeof(T));
+  return value;
+}
+
+// Cursor over the body of a mapped ply file, reads fail rather than go past
+// its end
+struct PlyCursor {
+  const char* pCur;
+  const char* pEnd;
+  bool swap;  // file endianness differs from the host one
+
+  bool read(PlyType type, double& value) {
+    size_t size = getPlyTypeSize(type);
+    if (size_t(pEnd - pCur) < size) return false;
+    switch (type) {
+      case PlyType::Int8:
+        value = readPlyScalar<int8_t>(pCur, swap);
+        break;
+      case PlyType::Uint8:
+        value = readPlyScalar<uint8_t>(pCur, swap);
+        break;
+      case PlyType::Int16:
+        value = readPlyScalar<int16_t>(pCur, swap);
+        break;
+      case PlyType::Uint16:
+        value = readPlyScalar<uint16_t>(pCur, swap);
+        break;
+      case PlyType::Int32:
+        value = readPlyScalar<int32_t>(pCur, swap);
+        break;
+      case PlyType::Uint32:
+        value = readPlyScalar<uint32_t>(pCur, swap);
+        break;
+      case PlyType::Float32:
+        value = readPlyScalar<float>(pCur, swap);
+        break;
+      case PlyType::Float64:
+        value = readPlyScalar<double>(pCur, swap);
+        break;
+      default:
+        return false;
+    }
+    pCur += size;
+    return true;
+  }
+  bool skip(const PlyProperty& property) {
+    size_t size = getPlyTypeSize(property.type);
+    if (property.isList) {
+      double count;
+      if (!read(property.countType, count) || count < 0.0) return false;
+      size *= size_t(count);
+    }
+    if (size_t(pEnd - pCur) < size) return false;
+    pCur += size;
+    return true;
+  }
+};
+
+// Header lines up to end_header, the body offset is returned in bodyOffset
+static bool parsePlyHeader(const MappedFile& file, vector<PlyElement>& elements,
+                           bool& bigEndian, size_t& bodyOffset,
+                           std::string& error) {
+  const char* pData = file.getData();
+  const char* pEnd = pData + file.getSize();
+  const char endHeader[] = "end_header";
+  const char* pHeaderEnd = std::search(pData, pEnd, endHeader,
+                                       endHeader + sizeof(endHeader) - 1);
+  const char* pBody =
+      pHeaderEnd == pEnd ? pEnd : std::find(pHeaderEnd, pEnd, '\n');
+  if (file.getSize() < 3 || memcmp(pData, "ply", 3) != 0 || pBody == pEnd) {
+    error = "not a ply file";
+    return false;
+  }
+  bodyOffset = size_t(pBody + 1 - pData);
+
+  std::istringstream header(std::string(pData, pHeaderEnd));
+  std::string line;
+  bool hasFormat = false;
+  while (std::getline(header, line)) {
+    std::istringstream tokens(line);
+    std::string keyword;
+    tokens >> keyword;
+    if (keyword == "format") {
+      std::string format;
+      tokens >> format;
+      if (format != "binary_little_endian" && format != "binary_big_endian") {
+        error = "format " + format + " is not supported, only binary is";
+        return false;
+      }
+      bigEndian = format == "binary_big_endian";
+      hasFormat = true;
+    } else if (keyword == "element") {
+      PlyElement element;
+      tokens >> element.name >> element.count;
+      elements.push_back(element);
+    } else if (keyword == "property") {
+      PlyProperty property;
+      std::string type;
+      tokens >> type;
+      if (type == "list") {
+        std::string countType;
+        property.isList = true;
+        tokens >> countType >> type;
+        property.countType = parsePlyType(countType);
+      }
+      property.type = parsePlyType(type);
+      tokens >> property.name;
+      if (elements.empty() || property.type == PlyType::Invalid ||
+          (property.isList && property.countType == PlyType::Invalid)) {
+        error = "bad property [" + line + "]";
+        return false;
+      }
+      elements.back().properties.push_back(property);
+    }
+  }
+  if (!hasFormat) {
+    error = "missing format";
+    return false;
+  }
+  return true;
+}
+
+// Attribute a vertex property goes to, -1 when it is skipped
+static int getPlyVertexSlot(const std::string& name) {
+  static const char* names[][8] = {
+      {"x", "y", "z", "nx", "ny", "nz", "u", "v"},
+      {"x", "y", "z", "nx", "ny", "nz", "s", "t"},
+      {"x", "y", "z", "nx", "ny", "nz", "texture_u", "texture_v"},
+      {"x", "y", "z", "nx", "ny", "nz", "texture_s", "texture_t"}};
+  for (const auto& slotNames : names)
+    for (int slot = 0; slot < 8; slot++)
+      if (name == slotNames[slot]) return slot;
+  return -1;
+}
+
+static bool readPlyVertices(PlyCursor& cursor, const PlyElement& element,
+                            bool recomputeNormal, MeshData& data) {
+  vector<int> slots;
+  int slotsMask = 0;
+  for (const auto& property : element.properties) {
+    int slot = property.isList ? -1 : getPlyVertexSlot(property.name);
+    slots.push_back(slot);
+    if (slot >= 0) slotsMask |= 1 << slot;
+  }
+  bool hasNormals = !recomputeNormal && (slotsMask & 0x38) == 0x38;
+  bool hasUvs = (slotsMask & 0xc0) == 0xc0;
+
+  size_t base = data.positions.size();
+  data.positions.resize(base + element.count);
+  if (hasNormals) data.normals.resize(base + element.count);
+  if (hasUvs) data.uvs.resize(base + element.count);
+  for (size_t vertexId = base; vertexId < data.positions.size(); vertexId++) {
+    float attribs[8] = {};
+    for (size_t propId = 0; propId < slots.size(); propId++) {
+      double value;
+      if (slots[propId] < 0) {
+        if (!cursor.skip(element.properties[propId])) return false;
+      } else if (cursor.read(element.properties[propId].type, value))
+        attribs[slots[propId]] = float(value);
+      else
+        return false;
+    }
+    data.positions[vertexId] = {attribs[0], attribs[1], attribs[2]};
+    if (hasNormals)
+      data.normals[vertexId] = {attribs[3], attribs[4], attribs[5]};
+    // Same uv convention as obj files
+    if (hasUvs) data.uvs[vertexId] = {attribs[6], 1.0f - attribs[7]};
+  }
+  return true;
+}
+
+static bool readPlyFaces(PlyCursor& cursor, const PlyElement& element,
+                         MeshData& data) {
+  data.indices.reserve(data.indices.size() + 3 * element.count);
+  for (size_t faceId = 0; faceId < element.count; faceId++) {
+    for (const auto& property : element.properties) {
+      if (!property.isList ||
+          (property.name != "vertex_indices" &&
+           property.name != "vertex_index")) {
+        if (!cursor.skip(property)) return false;
+        continue;
+      }
+      // Fan of triangles around the first corner, emitted while reading
+      double count, index;
+      if (!cursor.read(property.countType, count) || count < 0.0) return false;
+      uint first = 0, prev = 0;
+      for (size_t cornerId = 0; cornerId < size_t(count); cornerId++) {
+        if (!cursor.read(property.type, index)) return false;
+        uint cur = uint(index);
+        if (cornerId == 0) first = cur;
+        if (cornerId >= 2) {
+          data.indices.push_back(first);
+          data.indices.push_back(prev);
+          data.indices.push_back(cur);
+        }
+        prev = cur;
+      }
+    }
+  }
+  return true;
+}
+
+void loadPly(const std::string& meshPath, MeshData& data,
+             bool recomputeNormal) {
+  auto fail = [&](const std::string& error) {
+    LOG_ERROR("{}: load mesh from [{}] --- {}", "Scene", meshPath, error);
+    exit(1);
+  };
+  MappedFile file;
+  if (!file.open(meshPath)) fail("cannot open file");
+
+  vector<PlyElement> elements;
+  bool bigEndian = false;
+  size_t bodyOffset = 0;
+  std::string error;
+  if (!parsePlyHeader(file, elements, bigEndian, bodyOffset, error))
+    fail(error);
+  const uint16_t one = 1;
+  bool hostBigEndian = *reinterpret_cast<const uint8_t*>(&one) == 0;
+
+  data = MeshData();
+  PlyCursor cursor = {file.getData() + bodyOffset,
+                      file.getData() + file.getSize(),
+                      bigEndian != hostBigEndian};
+  for (const auto& element : elements) {
+    // A count larger than the file is a corrupt header, not a huge mesh
+    if (element.count > file.getSize()) fail("bad count of " + element.name);
+    bool read = true;
+    if (element.name == "vertex")
+      read = readPlyVertices(cursor, element, recomputeNormal, data);
+    else if (element.name == "face")
+      read = readPlyFaces(cursor, element, data);
+    else
+      for (size_t itemId = 0; itemId < element.count && read; itemId++)
+        for (const auto& property : element.properties)
+          if (!(read = cursor.skip(property))) break;
+    if (!read) fail("file ends within element " + element.name);
+  }
+  for (uint index : data.indices)
+    if (index >= data.positions.size()) fail("face index out of range");
+
+  LOG_INFO("{}: loaded [{}] with {} vertices and {} triangles", "Scene",
+           meshPath, data.positions.size(), data.indices.size() / 3);
+}
+
+void computeBounds(const vec3* positions, size_t num, vec3& posMin,
+                   vec3& posMax) {
+  posMin = vec3(BBOX_MAXF);
+  posMax = vec3(BBOX_MINF);
+  for (size_t i = 0; i < num; i++) {
+    const vec3& p = positions[i];
+    posMin.x = std::min(posMin.x, p.x);
+    posMin.y = std::min(posMin.y, p.y);
+    posMin.z = std::min(posMin.z, p.z);
+    posMax.x = std::max(posMax.x, p.x);
+    posMax.y = std::max(posMax.y, p.y);
+    posMax.z = std::max(posMax.z, p.z);
+  }
+}
+
+static bool hasExtension(const std::string& path, const std::string& ext) {
+  if (path.size() < ext.size()) return false;
+  return std::equal(ext.rbegin(), ext.rend(), path.rbegin(),
+                    [](char a, char b) {
+                      return std::tolower(a) == std::tolower(b);
+                    });
+}
+
+MeshFormat getMeshFormat(const std::string& meshPath) {
+  if (hasExtension(meshPath, ".obj")) return MeshFormat::Obj;
+  if (hasExtension(meshPath, ".ply")) return MeshFormat::Ply;
+  if (hasExtension(meshPath, MESH_FILE_EXTENSION)) return MeshFormat::Binary;
+  return MeshFormat::Unknown;
+}
+
+void loadMeshFile(const std::string& meshPath, MeshData& data,
+                  bool recomputeNormal, uint threadsNum) {
+  if (getMeshFormat(meshPath) == MeshFormat::Ply)
+    loadPly(meshPath, data, recomputeNormal);
+  else
+    loadMesh(meshPath, data, recomputeNormal, threadsNum);
+}
+
+static const char meshFileMagic[8] = "BINMESH";
+
+static uint64_t alignMeshOffset(uint64_t offset) {
+  return (offset + MESH_FILE_ALIGN - 1) / MESH_FILE_ALIGN * MESH_FILE_ALIGN;
+}
+
+bool writeMeshFile(const std::string& filename, const MeshData& data) {
+  size_t verticesNum = data.positions.size();
+  if ((!data.normals.empty() && data.normals.size() != verticesNum) ||
+      (!data.uvs.empty() && data.uvs.size() != verticesNum)) {
+    LOG_ERROR("{}: streams of [{}] differ in length", "MeshFile", filename);
+    return false;
+  }
+
+  MeshFileHeader header = {};
+  memcpy(header.magic, meshFileMagic, sizeof(header.magic));
+  header.version = MESH_FILE_VERSION;
+  header.verticesNum = static_cast<uint32_t>(verticesNum);
+  header.indicesNum = static_cast<uint32_t>(data.indices.size());
+  computeBounds(data.positions.data(), verticesNum, header.posMin,
+                header.posMax);
+
+  uint64_t offset = alignMeshOffset(sizeof(header));
+  auto place = [&](uint64_t& streamOffset, size_t bytes) {
+    streamOffset = offset;
+    offset = alignMeshOffset(offset + bytes);
+  };
+  place(header.positionsOffset, verticesNum * sizeof(vec3));
+  if (!data.normals.empty())
+    place(header.normalsOffset, verticesNum * sizeof(vec3));
+  if (!data.uvs.empty()) place(header.uvsOffset, verticesNum * sizeof(vec2));
+  place(header.indicesOffset, data.indices.size() * sizeof(uint));
+
+  vector<char> bytes(offset, 0);
+  memcpy(bytes.data(), &header, sizeof(header));
+  auto copy = [&](uint64_t streamOffset, const void* pSrc, size_t size) {
+    if (size > 0) memcpy(bytes.data() + streamOffset, pSrc, size);
+  };
+  copy(header.positionsOffset, data.positions.data(),
+       verticesNum * sizeof(vec3));
+  copy(header.normalsOffset, data.normals.data(),
+       data.normals.size() * sizeof(vec3));
+  copy(header.uvsOffset, data.uvs.data(), data.uvs.size() * sizeof(vec2));
+  copy(header.indicesOffset, data.indices.data(),
+       data.indices.size() * sizeof(uint));
+
+  std::ofstream file(filename, std::ios::binary);
+  file.write(bytes.data(), std::streamsize(bytes.size()));
+  if (!file) {
+    LOG_ERROR("{}: cannot write [{}]", "MeshFile", filename);
+    return false;
+  }
+  return true;
+}
+
+bool viewMeshFile(const MappedFile& file, MeshFileView& view) {
+  if (file.getSize() < sizeof(MeshFileHeader)) return false;
+  const char* pData = file.getData();
+  MeshFileHeader header;
+  memcpy(&header, pData, sizeof(header));
+  if (memcmp(header.magic, meshFileMagic, sizeof(header.magic)) != 0 ||
+      header.version != MESH_FILE_VERSION || header.indicesNum % 3 != 0)
+    return false;
+
+  // A truncated file must not be read past its end. Indices are trusted,
+  // checking them would be the very pass over the data this format avoids.
+  auto fits = [&](uint64_t offset, uint64_t num, size_t stride) {
+    return offset % MESH_FILE_ALIGN == 0 && offset <= file.getSize() &&
+           num <= (file.getSize() - offset) / stride;
+  };
+  if (!fits(header.positionsOffset, header.verticesNum, sizeof(vec3)) ||
+      !fits(header.indicesOffset, header.indicesNum, sizeof(uint)) ||
+      (header.normalsOffset &&
+       !fits(header.normalsOffset, header.verticesNum, sizeof(vec3))) ||
+      (header.uvsOffset &&
+       !fits(header.uvsOffset, header.verticesNum, sizeof(vec2))))
+    return false;
+
+  view.positions =
+      reinterpret_cast<const vec3*>(pData + header.positionsOffset);
+  view.normals = header.normalsOffset ? reinterpret_cast<const vec3*>(
+                                            pData + header.normalsOffset)
+                                      : nullptr;
+  view.uvs = header.uvsOffset
+                 ? reinterpret_cast<const vec2*>(pData + header.uvsOffset)
+                 : nullptr;
+  view.indices = reinterpret_cast<const uint*>(pData + header.indicesOffset);
+  view.verticesNum = header.verticesNum;
+  view.indicesNum = header.indicesNum;
+  view.posMin = header.posMin;
+  view.posMax = header.posMax;
+  return true;
+}
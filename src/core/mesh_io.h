@@ -0,0 +1,78 @@
+#pragma once
+
+#include <shared/binding.h>
+#include "mapped_file.h"
+
+#include <string>
+#include <vector>
+
+using std::vector;
+
+// Vertex streams and triangle list of a mesh
+struct MeshData {
+  vector<vec3> positions{};
+  vector<vec3> normals{};  // empty when shading uses face normals
+  vector<vec2> uvs{};      // empty without texture coordinates
+  vector<uint> indices{};
+};
+
+// Load an obj file as an indexed triangle list. Face corners with the same
+// position, uv and normal are welded into one vertex. With recomputeNormal,
+// the normals of the file are dropped and face normals are used instead.
+// Shapes are welded on threadsNum threads, 0 for all hardware threads. Callers
+// already loading meshes in parallel pass 1 to weld on their own thread.
+void loadMesh(const std::string& meshPath, MeshData& data,
+              bool recomputeNormal = false, uint threadsNum = 0);
+// Load a binary (little or big endian) ply file. Its vertices and faces are
+// read straight from the mapped file into the streams, polygons are split
+// into fans of triangles. Vertices of a ply file are already indexed, so
+// nothing is welded.
+void loadPly(const std::string& meshPath, MeshData& data,
+             bool recomputeNormal = false);
+
+enum class MeshFormat { Obj, Ply, Binary, Unknown };
+// Chosen by extension
+MeshFormat getMeshFormat(const std::string& meshPath);
+// Load an obj or ply file, by extension
+void loadMeshFile(const std::string& meshPath, MeshData& data,
+                  bool recomputeNormal = false, uint threadsNum = 0);
+
+void computeBounds(const vec3* positions, size_t num, vec3& posMin,
+                   vec3& posMax);
+
+// Binary mesh container, written by the mesh_convert tool. A header is
+// followed by the streams at MESH_FILE_ALIGN byte aligned offsets, so that
+// a mapped file is used in place, with no parsing at all.
+#define MESH_FILE_EXTENSION ".bmesh"
+#define MESH_FILE_VERSION 1
+#define MESH_FILE_ALIGN 64
+
+struct MeshFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t verticesNum;
+  uint32_t indicesNum;
+  uint32_t padding;
+  uint64_t positionsOffset;
+  uint64_t normalsOffset;  // 0 without normals
+  uint64_t uvsOffset;      // 0 without texture coordinates
+  uint64_t indicesOffset;
+  vec3 posMin;
+  vec3 posMax;
+};
+
+// Streams of a mapped mesh file, pointing into the mapping
+struct MeshFileView {
+  const vec3* positions{nullptr};
+  const vec3* normals{nullptr};
+  const vec2* uvs{nullptr};
+  const uint* indices{nullptr};
+  uint verticesNum{0};
+  uint indicesNum{0};
+  vec3 posMin;
+  vec3 posMax;
+};
+
+bool writeMeshFile(const std::string& filename, const MeshData& data);
+// False when the file is not a valid mesh file of this version
+bool viewMeshFile(const MappedFile& file, MeshFileView& view);
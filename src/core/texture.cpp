@@ -1,7 +1,12 @@
 #include "texture.h"
 
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfHeader.h>
+#include <ImfOutputFile.h>
 #include <ImfRgba.h>
 #include <ImfRgbaFile.h>
+#include <half.h>
 #include <shared/binding.h>
 
 #include <nvh/nvprint.hpp>
@@ -11,6 +16,8 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb_image_write.h>
 
+#include <fstream>
+
 #include <filesystem/path.h>
 using namespace filesystem;
 
@@ -48,31 +55,56 @@ static float* readImageEXR(const std::string& name, int* width, int* height) {
   return NULL;
 }
 
-static void writeImageEXR(const std::string& name, const float* pixels,
-                          int xRes, int yRes, int totalXRes, int totalYRes,
-                          int xOffset, int yOffset) {
-  using namespace Imf;
-  using namespace Imath;
+static Imf::Compression getImfCompression(ExrCompression compression) {
+  switch (compression) {
+    case ExrCompression::None:
+      return Imf::NO_COMPRESSION;
+    case ExrCompression::Piz:
+      return Imf::PIZ_COMPRESSION;
+    case ExrCompression::Zips:
+      return Imf::ZIPS_COMPRESSION;
+    default:
+      return Imf::ZIP_COMPRESSION;
+  }
+}
 
-  Rgba* hrgba = new Rgba[xRes * yRes];
-  for (int i = 0; i < xRes * yRes; ++i)
-    hrgba[i] = Rgba(pixels[4 * i], pixels[4 * i + 1], pixels[4 * i + 2],
-                    pixels[4 * i + 3]);
+void writeImageLayers(const std::string& imagePath, int width, int height,
+                      const vector<const void*>& layers,
+                      const vector<std::string>& channelNames,
+                      int layerChannelsNum, bool halfFloat,
+                      ExrCompression compression) {
+  using namespace Imf;
 
-  // OpenEXR uses inclusive pixel bounds.
-  Box2i displayWindow(V2i(0, 0), V2i(totalXRes - 1, totalYRes - 1));
-  Box2i dataWindow(V2i(xOffset, yOffset),
-                   V2i(xOffset + xRes - 1, yOffset + yRes - 1));
+  // Slices point into the layers with their strides, nothing is copied
+  Header header(width, height);
+  header.compression() = getImfCompression(compression);
+  FrameBuffer frameBuffer;
+  PixelType type = halfFloat ? HALF : FLOAT;
+  size_t channelSize = halfFloat ? sizeof(half) : sizeof(float);
+  size_t xStride = layerChannelsNum * channelSize, yStride = xStride * width;
+  for (size_t channelId = 0; channelId < channelNames.size(); channelId++) {
+    auto layer = static_cast<const char*>(layers[channelId / layerChannelsNum]);
+    const char* pixels = layer + channelId % layerChannelsNum * channelSize;
+    header.channels().insert(channelNames[channelId], Channel(type));
+    frameBuffer.insert(channelNames[channelId],
+                       Slice(type, (char*)pixels, xStride, yStride));
+  }
 
   try {
-    RgbaOutputFile file(name.c_str(), displayWindow, dataWindow, WRITE_RGB);
-    file.setFrameBuffer(hrgba - xOffset - yOffset * xRes, 1, xRes);
-    file.writePixels(yRes);
+    OutputFile file(imagePath.c_str(), header);
+    file.setFrameBuffer(frameBuffer);
+    file.writePixels(height);
   } catch (const std::exception& exc) {
-    printf("Error writing \"%s\": %s", name.c_str(), exc.what());
+    LOG_ERROR("{}: failed to write [{}]: {}", "Image", imagePath, exc.what());
   }
+}
 
-  delete[] hrgba;
+void writeMask(const std::string& maskPath,
+               const vector<const uint32_t*>& planes, size_t planeSize) {
+  std::ofstream file(maskPath, std::ios::binary);
+  for (auto plane : planes)
+    file.write(reinterpret_cast<const char*>(plane), planeSize);
+  if (!file) LOG_ERROR("{}: failed to write [{}]", "Image", maskPath);
 }
 
 float* readImage(const std::string& imagePath, int& width, int& height,
@@ -125,7 +157,7 @@ void writeImage(const std::string& imagePath, int width, int height,
   if (ext == "hdr")
     stbi_write_hdr(imagePath.c_str(), width, height, 4, data);
   else if (ext == "exr")
-    writeImageEXR(imagePath, data, width, height, width, height, 0, 0);
+    writeImageLayers(imagePath, width, height, {data}, {"R", "G", "B"});
   else {
     stbi_hdr_to_ldr_gamma(1.0);
     auto autoDestroyData = reinterpret_cast<float*>(
@@ -3,7 +3,24 @@
 #include <context/context.h>
 #include "alloc.h"
 
+// Lossless compression of the exr images written. Zips packs single
+// scanlines and Zip blocks of 16, Piz is a wavelet codec that is slower to
+// encode but often smaller on noisy float data.
+enum class ExrCompression { None, Zip, Piz, Zips };
+
 float* readImage(const std::string& imagePath, int& width, int& height,
                  float gamma = 1.0);
 void writeImage(const std::string& imagePath, int width, int height,
-                float* data);
\ No newline at end of file
+                float* data);
+// Exr image of float channels. Each layer holds layerChannelsNum
+// interleaved floats, or halfs, per pixel and makes up to as many channels,
+// named in order by channelNames. Channels are written at the precision of
+// the layers.
+void writeImageLayers(const std::string& imagePath, int width, int height,
+                      const vector<const void*>& layers,
+                      const vector<std::string>& channelNames,
+                      int layerChannelsNum = 4, bool halfFloat = false,
+                      ExrCompression compression = ExrCompression::Zip);
+// Planes of a visibility mask, planeSize bytes each, one after the other
+void writeMask(const std::string& maskPath,
+               const vector<const uint32_t*>& planes, size_t planeSize);
\ No newline at end of file
@@ -0,0 +1,47 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+
+void WorkerPool::init(uint32_t threadsNum) {
+  deinit();
+  if (threadsNum == 0)
+    threadsNum = std::max(1u, std::thread::hardware_concurrency());
+  m_stopping = false;
+  for (uint32_t threadId = 0; threadId < threadsNum; threadId++)
+    m_threads.emplace_back(&WorkerPool::work, this);
+}
+
+void WorkerPool::deinit() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopping = true;
+  }
+  m_jobsCv.notify_all();
+  for (auto& thread : m_threads) thread.join();
+  m_threads.clear();
+}
+
+std::future<void> WorkerPool::submit(std::function<void()> job) {
+  std::packaged_task<void()> task(std::move(job));
+  std::future<void> done = task.get_future();
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.push_back(std::move(task));
+  }
+  m_jobsCv.notify_one();
+  return done;
+}
+
+void WorkerPool::work() {
+  while (true) {
+    std::packaged_task<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_jobsCv.wait(lock, [&]() { return m_stopping || !m_jobs.empty(); });
+      if (m_jobs.empty()) return;
+      task = std::move(m_jobs.front());
+      m_jobs.pop_front();
+    }
+    task();
+  }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads running jobs in submission order, so that host work
+// such as image encoding overlaps with the GPU instead of stalling it
+class WorkerPool {
+public:
+  WorkerPool() = default;
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+  ~WorkerPool() { deinit(); }
+
+  // 0 threads means all hardware threads
+  void init(uint32_t threadsNum);
+  // Runs the jobs still queued, then joins the threads
+  void deinit();
+  uint32_t getThreadsNum() const { return uint32_t(m_threads.size()); }
+
+  // The future is ready once the job has run
+  std::future<void> submit(std::function<void()> job);
+
+private:
+  void work();
+
+private:
+  std::vector<std::thread> m_threads{};
+  std::deque<std::packaged_task<void()>> m_jobs{};
+  std::mutex m_mutex;
+  std::condition_variable m_jobsCv;
+  bool m_stopping{false};
+};
@@ -0,0 +1,354 @@
+#include "accel.h"
+
+#include <nvh/timesampler.hpp>
+
+// Bump when the layout of the cache files changes
+#define CPU_BLAS_CACHE_VERSION 1
+// Arrays of a cache file start on cache line boundaries
+#define CPU_BLAS_CACHE_ALIGN 64
+
+// Header of a cached blas, followed by its triangles, wide nodes and
+// primitive indices at the given offsets
+struct CpuBlasCacheHeader {
+  char magic[8];
+  uint64_t key;
+  uint64_t trianglesNum;
+  uint64_t nodesNum;
+  uint64_t primIndicesNum;
+  uint64_t trianglesOffset;
+  uint64_t nodesOffset;
+  uint64_t primIndicesOffset;
+  Aabb bounds;
+  float sahCost;
+};
+
+static const char cpuBlasCacheMagic[8] = "CPUBLAS";
+
+static uint64_t alignCacheOffset(uint64_t offset) {
+  return (offset + CPU_BLAS_CACHE_ALIGN - 1) / CPU_BLAS_CACHE_ALIGN *
+         CPU_BLAS_CACHE_ALIGN;
+}
+
+void CpuBlas::build(Mesh* pMesh, uint threadsNum) {
+  const vec3* positions = pMesh->getPositions();
+  const uint* indices = pMesh->getIndices();
+  size_t primsNum = pMesh->getIndicesNum() / 3;
+
+  vector<Triangle> triangles(primsNum);
+  vector<Aabb> primBounds(primsNum);
+  for (size_t primId = 0; primId < primsNum; primId++) {
+    const vec3& p0 = positions[indices[3 * primId + 0]];
+    const vec3& p1 = positions[indices[3 * primId + 1]];
+    const vec3& p2 = positions[indices[3 * primId + 2]];
+    triangles[primId] = {p0, p1 - p0, p2 - p0};
+    primBounds[primId].grow(p0);
+    primBounds[primId].grow(p1);
+    primBounds[primId].grow(p2);
+  }
+  m_triangles = CpuArray<Triangle>(std::move(triangles));
+  m_pCacheFile.reset();
+
+  // Built binary with sah, then collapsed to the 8-wide traversal layout
+  Bvh binary;
+  binary.build(primBounds, threadsNum);
+  m_sahCost = binary.computeSahCost();
+  m_bvh.build(binary);
+}
+
+uint64_t CpuBlas::computeCacheKey(Mesh* pMesh) {
+  Hasher hasher;
+  hasher.add(CPU_BLAS_CACHE_VERSION);
+  hasher.add(BVH_WIDTH);
+  hasher.add(sizeof(Triangle));
+  hasher.add(sizeof(WideBvhNode));
+  vector<float> settings = Bvh::getBuildSettings();
+  hasher.add(settings.data(), settings.size() * sizeof(float));
+
+  // Only positions and indices go into the blas, other attributes may change
+  // without invalidating it
+  hasher.add(size_t(pMesh->getVerticesNum()));
+  hasher.add(pMesh->getPositions(), pMesh->getVerticesNum() * sizeof(vec3));
+  hasher.add(pMesh->getIndices(), pMesh->getIndicesNum() * sizeof(uint));
+  return hasher.get();
+}
+
+bool CpuBlas::load(std::shared_ptr<MappedFile> pFile, uint64_t key) {
+  if (!pFile || pFile->getSize() < sizeof(CpuBlasCacheHeader)) return false;
+  const char* pData = pFile->getData();
+  CpuBlasCacheHeader header;
+  memcpy(&header, pData, sizeof(header));
+  if (memcmp(header.magic, cpuBlasCacheMagic, sizeof(header.magic)) != 0 ||
+      header.key != key)
+    return false;
+
+  // A truncated or foreign file must not be read past its end
+  auto fits = [&](uint64_t offset, uint64_t num, size_t stride) {
+    return offset % CPU_BLAS_CACHE_ALIGN == 0 && offset <= pFile->getSize() &&
+           num <= (pFile->getSize() - offset) / stride;
+  };
+  if (!fits(header.trianglesOffset, header.trianglesNum, sizeof(Triangle)) ||
+      !fits(header.nodesOffset, header.nodesNum, sizeof(WideBvhNode)) ||
+      !fits(header.primIndicesOffset, header.primIndicesNum, sizeof(uint)))
+    return false;
+
+  auto pTriangles =
+      reinterpret_cast<const Triangle*>(pData + header.trianglesOffset);
+  auto pNodes =
+      reinterpret_cast<const WideBvhNode*>(pData + header.nodesOffset);
+  auto pPrimIndices =
+      reinterpret_cast<const uint*>(pData + header.primIndicesOffset);
+  m_triangles = CpuArray<Triangle>(pTriangles, header.trianglesNum);
+  m_bvh.load(CpuArray<WideBvhNode>(pNodes, header.nodesNum),
+             CpuArray<uint>(pPrimIndices, header.primIndicesNum),
+             header.bounds);
+  m_sahCost = header.sahCost;
+  m_pCacheFile = pFile;
+  return true;
+}
+
+bool CpuBlas::store(const AsCache& cache, uint64_t key) const {
+  const auto& nodes = m_bvh.getNodes();
+  const auto& primIndices = m_bvh.getPrimIndices();
+
+  CpuBlasCacheHeader header;
+  memcpy(header.magic, cpuBlasCacheMagic, sizeof(header.magic));
+  header.key = key;
+  header.trianglesNum = m_triangles.size();
+  header.nodesNum = nodes.size();
+  header.primIndicesNum = primIndices.size();
+  header.trianglesOffset = alignCacheOffset(sizeof(header));
+  header.nodesOffset = alignCacheOffset(
+      header.trianglesOffset + m_triangles.size() * sizeof(Triangle));
+  header.primIndicesOffset =
+      alignCacheOffset(header.nodesOffset + nodes.size() * sizeof(WideBvhNode));
+  header.bounds = m_bvh.getBounds();
+  header.sahCost = m_sahCost;
+
+  vector<char> bytes(header.primIndicesOffset +
+                     primIndices.size() * sizeof(uint));
+  memcpy(bytes.data(), &header, sizeof(header));
+  if (!m_triangles.empty())
+    memcpy(bytes.data() + header.trianglesOffset, m_triangles.data(),
+           m_triangles.size() * sizeof(Triangle));
+  if (!nodes.empty())
+    memcpy(bytes.data() + header.nodesOffset, nodes.data(),
+           nodes.size() * sizeof(WideBvhNode));
+  if (!primIndices.empty())
+    memcpy(bytes.data() + header.primIndicesOffset, primIndices.data(),
+           primIndices.size() * sizeof(uint));
+  return cache.store(key, bytes);
+}
+
+bool CpuBlas::intersect(const CpuRay& ray, float tmin, float tmax,
+                        CpuHit& hit) const {
+  CpuTraceRay traceRay(ray);
+  return m_bvh.intersect(traceRay, tmin, tmax, [&](uint primId, float& tfar) {
+    const Triangle& tri = m_triangles[primId];
+    float t;
+    vec2 bary;
+    if (!intersectTriangle(ray, tri.v0, tri.e1, tri.e2, tmin, tfar, t, bary))
+      return false;
+    tfar = t;
+    hit.t = t;
+    hit.primId = primId;
+    hit.bary = bary;
+    return true;
+  });
+}
+
+bool CpuBlas::occluded(const CpuRay& ray, float tmin, float tmax,
+                       uint& primId) const {
+  CpuTraceRay traceRay(ray);
+  return m_bvh.occluded(traceRay, tmin, tmax, [&](uint id, float tfar) {
+    const Triangle& tri = m_triangles[id];
+    if (!occludesTriangle(ray, tri.v0, tri.e1, tri.e2, tmin, tfar))
+      return false;
+    primId = id;
+    return true;
+  });
+}
+
+bool CpuBlas::occludedBy(uint primId, const CpuRay& ray, float tmin,
+                         float tmax) const {
+  const Triangle& tri = m_triangles[primId];
+  return occludesTriangle(ray, tri.v0, tri.e1, tri.e2, tmin, tmax);
+}
+
+uint64_t CpuBlas::intersectPacket(const CpuRayPacket& packet, float tmin,
+                                  float* tmax, CpuHit* hits) const {
+  CpuTracePacket tracePacket(packet);
+  uint64_t hitMask = 0;
+  auto leafFn = [&](const uint* primIds, uint primsNum, uint64_t mask) {
+    for (uint k = 0; k < primsNum; k++) {
+      uint primId = primIds[k];
+      const Triangle& tri = m_triangles[primId];
+      if (tracePacket.cullsTriangle(tri.v0, tri.v0 + tri.e1, tri.v0 + tri.e2))
+        continue;
+      for (uint64_t m = mask; m; m &= m - 1) {
+        int i = getFirstRay(m);
+        CpuRay ray{packet.o, packet.d[i]};
+        float t;
+        vec2 bary;
+        if (!intersectTriangle(ray, tri.v0, tri.e1, tri.e2, tmin, tmax[i], t,
+                               bary))
+          continue;
+        tmax[i] = t;
+        hits[i].t = t;
+        hits[i].primId = primId;
+        hits[i].bary = bary;
+        hitMask |= 1ull << i;
+      }
+    }
+  };
+  m_bvh.intersectPacket(tracePacket, tmin, tmax, leafFn);
+  return hitMask;
+}
+
+void CpuAccel::build(Scene* pScene, const std::string& cacheDir,
+                     uint threadsNum) {
+  nvh::Stopwatch sw;
+  m_blas.clear();
+  m_instances.clear();
+  m_tlasInstances.clear();
+  AsCache cache;
+  cache.init(cacheDir);
+
+  // BLAS - one per mesh, whatever the number of instances
+  size_t trianglesNum = 0, blasNodesNum = 0;
+  float minSahCost = CPU_INFINITY, maxSahCost = 0.f;
+  uint cacheHits = 0, cacheStores = 0;
+  m_blas.resize(pScene->getMeshesNum());
+  for (int meshId = 0; meshId < pScene->getMeshesNum(); meshId++) {
+    Mesh* pMesh = pScene->getMesh(meshId);
+    if (cache.isEnabled()) {
+      uint64_t key = CpuBlas::computeCacheKey(pMesh);
+      if (m_blas[meshId].load(cache.load(key), key)) {
+        cacheHits++;
+      } else {
+        m_blas[meshId].build(pMesh, threadsNum);
+        cacheStores += m_blas[meshId].store(cache, key);
+      }
+    } else {
+      m_blas[meshId].build(pMesh, threadsNum);
+    }
+    trianglesNum += m_blas[meshId].getTrianglesNum();
+    blasNodesNum += m_blas[meshId].getBvh().getNodes().size();
+    minSahCost = std::min(minSahCost, m_blas[meshId].getSahCost());
+    maxSahCost = std::max(maxSahCost, m_blas[meshId].getSahCost());
+  }
+  auto blasTime = sw.elapsed();
+  if (cache.isEnabled())
+    LOG_INFO("{}: {} / {} blas mapped from cache, {} stored", "CpuAccel",
+             cacheHits, m_blas.size(), cacheStores);
+
+  // TLAS - over world space bounds of the instances. Instances of empty
+  // meshes have no bounds to bin and are left out, so tlas leaves go through
+  // m_tlasInstances to instance ids.
+  auto& instances = pScene->getInstances();
+  vector<Aabb> instBounds;
+  for (uint instId = 0; instId < instances.size(); instId++) {
+    auto& inst = instances[instId];
+    uint meshId = inst.getMeshIndex();
+    const mat4& objectToWorld = inst.getTransform();
+    m_instances.push_back({objectToWorld, nvmath::invert(objectToWorld),
+                           pScene->getMesh(meshId), meshId});
+
+    Aabb local = m_blas[meshId].getBounds();
+    if (local.bmin.x > local.bmax.x) continue;  // empty mesh
+    Aabb world;
+    for (int corner = 0; corner < 8; corner++) {
+      vec3 p((corner & 1) ? local.bmax.x : local.bmin.x,
+             (corner & 2) ? local.bmax.y : local.bmin.y,
+             (corner & 4) ? local.bmax.z : local.bmin.z);
+      world.grow(transformPoint(objectToWorld, p));
+    }
+    m_instances.back().bounds = world;
+    instBounds.push_back(world);
+    m_tlasInstances.push_back(instId);
+  }
+  Bvh tlas;
+  tlas.build(instBounds, threadsNum);
+  m_tlas.build(tlas);
+
+  size_t nodesNum = blasNodesNum + m_tlas.getNodes().size();
+  LOG_INFO(
+      "{}: built {} sah blas over {} triangles in {:.2f} ms, tlas over {} "
+      "instances in {:.2f} ms, {} {}-wide nodes ({:.2f} MB), {} traversal",
+      "CpuAccel", m_blas.size(), trianglesNum, blasTime, m_instances.size(),
+      sw.elapsed() - blasTime, nodesNum, BVH_WIDTH,
+      nodesNum * sizeof(WideBvhNode) / (1024.0 * 1024.0),
+      getSimdLevelName(WideBvh::getSimdLevel()));
+  if (!m_blas.empty())
+    LOG_INFO("{}: blas sah costs from {:.2f} to {:.2f}", "CpuAccel",
+             minSahCost, maxSahCost);
+}
+
+void CpuAccel::deinit() {
+  m_blas.clear();
+  m_instances.clear();
+  m_tlasInstances.clear();
+  m_tlas = WideBvh();
+}
+
+bool CpuAccel::intersect(const CpuRay& ray, float tmin, float tmax,
+                         CpuHit& hit) const {
+  CpuTraceRay traceRay(ray);
+  return m_tlas.intersect(traceRay, tmin, tmax, [&](uint leafId, float& tfar) {
+    uint instId = m_tlasInstances[leafId];
+    const CpuInstance& inst = m_instances[instId];
+    if (!m_blas[inst.meshId].intersect(toObject(inst, ray), tmin, tfar, hit))
+      return false;
+    tfar = hit.t;
+    hit.instanceId = instId;
+    return true;
+  });
+}
+
+bool CpuAccel::occluded(const CpuRay& ray, float tmin, float tmax,
+                        CpuOccluderCache* pCache) const {
+  if (pCache && pCache->instanceId < m_instances.size()) {
+    const CpuInstance& inst = m_instances[pCache->instanceId];
+    if (m_blas[inst.meshId].occludedBy(pCache->primId, toObject(inst, ray),
+                                       tmin, tmax))
+      return true;
+  }
+
+  CpuTraceRay traceRay(ray);
+  return m_tlas.occluded(traceRay, tmin, tmax, [&](uint leafId, float tfar) {
+    uint instId = m_tlasInstances[leafId];
+    const CpuInstance& inst = m_instances[instId];
+    uint primId;
+    if (!m_blas[inst.meshId].occluded(toObject(inst, ray), tmin, tfar, primId))
+      return false;
+    if (pCache) *pCache = {instId, primId};
+    return true;
+  });
+}
+
+uint64_t CpuAccel::intersectPacket(const CpuRayPacket& packet, float tmin,
+                                   float tmax, CpuHit* hits) const {
+  float tfar[CPU_PACKET_SIZE];
+  for (int i = 0; i < CPU_PACKET_SIZE; i++) tfar[i] = tmax;
+
+  CpuTracePacket tracePacket(packet);
+  uint64_t hitMask = 0;
+  auto leafFn = [&](const uint* leafIds, uint leavesNum, uint64_t mask) {
+    for (uint k = 0; k < leavesNum; k++) {
+      uint instId = m_tlasInstances[leafIds[k]];
+      const CpuInstance& inst = m_instances[instId];
+      // Only the rays reaching the world bounds of the instance go down
+      float tnear;
+      uint64_t instRays = tracePacket.intersectBox(
+          inst.bounds.bmin, inst.bounds.bmax, tmin, tfar, mask, tnear);
+      if (!instRays) continue;
+      uint64_t instMask = m_blas[inst.meshId].intersectPacket(
+          transformPacket(inst.worldToObject, packet, instRays), tmin, tfar,
+          hits);
+      for (uint64_t m = instMask; m; m &= m - 1)
+        hits[getFirstRay(m)].instanceId = instId;
+      hitMask |= instMask;
+    }
+  };
+  m_tlas.intersectPacket(tracePacket, tmin, tfar, leafFn);
+  return hitMask;
+}
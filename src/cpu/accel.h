@@ -0,0 +1,154 @@
+#pragma once
+
+#include "as_cache.h"
+#include "bvh_wide.h"
+
+#include <scene/scene.h>
+
+// Closest hit record, equivalent to what the closest hit shader receives
+struct CpuHit {
+  float t{CPU_INFINITY};
+  uint instanceId{0};  // gl_InstanceID
+  uint primId{0};      // gl_PrimitiveID
+  vec2 bary{0.f};      // hitAttributeEXT, weights of vertex 1 and 2
+};
+
+// Per instance data the closest hit shader gets from the tlas
+struct CpuInstance {
+  mat4 objectToWorld;  // gl_ObjectToWorldEXT
+  mat4 worldToObject;  // gl_WorldToObjectEXT
+  Mesh* pMesh;
+  uint meshId;
+  Aabb bounds;  // world space
+};
+
+// Bottom level: one bvh per mesh in object space, shared by every instance
+// of the mesh
+class CpuBlas {
+public:
+  // Subtrees are built on up to threadsNum threads, see Bvh::build
+  void build(Mesh* pMesh, uint threadsNum = 0);
+  // Key of the blas of a mesh in the cache: its positions and indices, the
+  // build settings and the layout of the file
+  static uint64_t computeCacheKey(Mesh* pMesh);
+  // Views the blas stored in a cache file, false when the file does not hold
+  // the blas of key
+  bool load(std::shared_ptr<MappedFile> pFile, uint64_t key);
+  bool store(const AsCache& cache, uint64_t key) const;
+  bool intersect(const CpuRay& ray, float tmin, float tmax, CpuHit& hit) const;
+  // Any hit, primId gets the occluding triangle
+  bool occluded(const CpuRay& ray, float tmin, float tmax, uint& primId) const;
+  bool occludedBy(uint primId, const CpuRay& ray, float tmin,
+                  float tmax) const;
+  // Per ray closest hits of a packet, updates tmax[i] and hits[i] of the rays
+  // that hit closer and returns their mask
+  uint64_t intersectPacket(const CpuRayPacket& packet, float tmin, float* tmax,
+                           CpuHit* hits) const;
+  const WideBvh& getBvh() const { return m_bvh; }
+  size_t getTrianglesNum() const { return m_triangles.size(); }
+  float getSahCost() const { return m_sahCost; }
+  const Aabb& getBounds() const { return m_bvh.getBounds(); }
+
+private:
+  // Object space triangle, edges are precomputed for the intersection test
+  struct Triangle {
+    vec3 v0;
+    vec3 e1;
+    vec3 e2;
+  };
+
+private:
+  CpuArray<Triangle> m_triangles{};  // indexed by gl_PrimitiveID
+  WideBvh m_bvh;
+  float m_sahCost{0.f};  // of the binary bvh before collapsing
+  std::shared_ptr<MappedFile> m_pCacheFile{};  // viewed by the arrays above
+};
+
+// Last occluder found by a shadow ray. Neighbouring pixels are often blocked
+// by the same triangle, so it is tried before any traversal. One per thread.
+struct CpuOccluderCache {
+  uint instanceId{~0u};
+  uint primId{0};
+};
+
+// Scene acceleration structure of the cpu backend. Like the tlas/blas split
+// in PipelineRaytrace, the top level bvh is built over instance bounds and
+// rays are brought to object space before entering the mesh bvh.
+class CpuAccel {
+public:
+  // With a cache directory, blas are mapped from the files of earlier runs
+  // and the missing ones are stored there once built. Trees are built on up
+  // to threadsNum threads, 0 means all hardware threads.
+  void build(Scene* pScene, const std::string& cacheDir = "",
+             uint threadsNum = 0);
+  void deinit();
+  const CpuInstance& getInstance(uint instanceId) const {
+    return m_instances[instanceId];
+  }
+
+  // gl_RayFlagsNoneEXT: closest hit in (tmin, tmax)
+  bool intersect(const CpuRay& ray, float tmin, float tmax, CpuHit& hit) const;
+
+  // gl_RayFlagsTerminateOnFirstHitEXT: any hit in (tmin, tmax). Occlusion
+  // only, it stops at the first hit and never computes hit attributes.
+  bool occluded(const CpuRay& ray, float tmin, float tmax,
+                CpuOccluderCache* pCache = nullptr) const;
+
+  // Closest hits of the CPU_PACKET_SIZE rays of a packet, returns the mask of
+  // rays that hit. Gives the same hits as intersect() ray by ray.
+  uint64_t intersectPacket(const CpuRayPacket& packet, float tmin, float tmax,
+                           CpuHit* hits) const;
+
+private:
+  // The direction is not normalized, so t is the same in both spaces
+  CpuRay toObject(const CpuInstance& inst, const CpuRay& ray) const {
+    return {transformPoint(inst.worldToObject, ray.o),
+            transformVector(inst.worldToObject, ray.d)};
+  }
+
+private:
+  vector<CpuBlas> m_blas{};  // indexed by mesh id
+  vector<CpuInstance> m_instances{};
+  vector<uint> m_tlasInstances{};  // instance id of each tlas leaf
+  WideBvh m_tlas;
+};
+
+// Moller-Trumbore, returns the barycentrics in the same convention as the
+// hit attributes of a vulkan triangle hit group. No face culling, as the
+// instances are created with TRIANGLE_FACING_CULL_DISABLE.
+inline bool intersectTriangle(const CpuRay& ray, const vec3& v0,
+                              const vec3& e1, const vec3& e2, float tmin,
+                              float tmax, float& t, vec2& bary) {
+  vec3 pvec = nvmath::cross(ray.d, e2);
+  float det = nvmath::dot(e1, pvec);
+  if (det == 0.f) return false;
+  float invDet = 1.f / det;
+  vec3 tvec = ray.o - v0;
+  float u = nvmath::dot(tvec, pvec) * invDet;
+  if (u < 0.f || u > 1.f) return false;
+  vec3 qvec = nvmath::cross(tvec, e1);
+  float v = nvmath::dot(ray.d, qvec) * invDet;
+  if (v < 0.f || u + v > 1.f) return false;
+  t = nvmath::dot(e2, qvec) * invDet;
+  if (t <= tmin || t >= tmax) return false;
+  bary = vec2(u, v);
+  return true;
+}
+
+// Same test as intersectTriangle, without the hit distance and barycentrics
+inline bool occludesTriangle(const CpuRay& ray, const vec3& v0,
+                             const vec3& e1, const vec3& e2, float tmin,
+                             float tmax) {
+  vec3 pvec = nvmath::cross(ray.d, e2);
+  float det = nvmath::dot(e1, pvec);
+  if (det == 0.f) return false;
+  float invDet = 1.f / det;
+  vec3 tvec = ray.o - v0;
+  float u = nvmath::dot(tvec, pvec) * invDet;
+  if (u < 0.f || u > 1.f) return false;
+  vec3 qvec = nvmath::cross(tvec, e1);
+  float v = nvmath::dot(ray.d, qvec) * invDet;
+  if (v < 0.f || u + v > 1.f) return false;
+  float t = nvmath::dot(e2, qvec) * invDet;
+  return t > tmin && t < tmax;
+}
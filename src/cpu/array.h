@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+using std::vector;
+
+// Read only array of the acceleration structures. It either owns the data it
+// was built with, or views memory owned by someone else, like a memory mapped
+// cache file, so that loading it costs no copy.
+template <typename T>
+class CpuArray {
+public:
+  CpuArray() = default;
+  CpuArray(vector<T> data) : m_owned(std::move(data)) {
+    m_pData = m_owned.data();
+    m_size = m_owned.size();
+  }
+  CpuArray(const T* pData, size_t size) : m_pData(pData), m_size(size) {}
+  CpuArray(const CpuArray& other) { *this = other; }
+  CpuArray(CpuArray&& other) = default;
+  CpuArray& operator=(CpuArray&& other) = default;
+  CpuArray& operator=(const CpuArray& other) {
+    m_owned = other.m_owned;
+    m_pData = other.isView() ? other.m_pData : m_owned.data();
+    m_size = other.m_size;
+    return *this;
+  }
+
+  bool isView() const { return m_owned.empty() && m_size > 0; }
+  bool empty() const { return m_size == 0; }
+  size_t size() const { return m_size; }
+  const T* data() const { return m_pData; }
+  const T* begin() const { return m_pData; }
+  const T* end() const { return m_pData + m_size; }
+  const T& operator[](size_t i) const { return m_pData[i]; }
+
+private:
+  vector<T> m_owned{};
+  const T* m_pData{nullptr};
+  size_t m_size{0};
+};
@@ -0,0 +1,57 @@
+#include "as_cache.h"
+
+#include <context/context.h>
+#include <filesystem/path.h>
+
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+void AsCache::init(const std::string& dir) {
+  m_dir = dir;
+  if (m_dir.empty()) return;
+  filesystem::path dirPath(m_dir);
+  if (!dirPath.exists() && !filesystem::create_directory(dirPath)) {
+    LOG_WARN("{}: cannot create {}, cache disabled", "AsCache", m_dir);
+    m_dir.clear();
+    return;
+  }
+  LOG_INFO("{}: acceleration structures cached in {}", "AsCache", m_dir);
+}
+
+std::string AsCache::getFilename(uint64_t key) const {
+  char name[32];
+  sprintf(name, "%016llx.bvh", (unsigned long long)key);
+  return (filesystem::path(m_dir) / name).str();
+}
+
+std::shared_ptr<MappedFile> AsCache::load(uint64_t key) const {
+  if (!isEnabled()) return nullptr;
+  auto pFile = std::make_shared<MappedFile>();
+  if (!pFile->open(getFilename(key))) return nullptr;
+  return pFile;
+}
+
+bool AsCache::store(uint64_t key, const vector<char>& bytes) const {
+  if (!isEnabled()) return false;
+  std::string filename = getFilename(key);
+  std::string tmpFilename =
+      filename + "." + std::to_string(std::random_device()()) + ".tmp";
+  {
+    std::ofstream file(tmpFilename, std::ios::binary);
+    file.write(bytes.data(), std::streamsize(bytes.size()));
+    if (!file) {
+      LOG_WARN("{}: cannot write {}", "AsCache", tmpFilename);
+      file.close();
+      std::remove(tmpFilename.c_str());
+      return false;
+    }
+  }
+  // Another job may have stored the same key in the meantime, both files
+  // are identical so either one wins
+  if (std::rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    std::remove(tmpFilename.c_str());
+    return filesystem::path(filename).exists();
+  }
+  return true;
+}
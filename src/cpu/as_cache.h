@@ -0,0 +1,71 @@
+#pragma once
+
+#include <core/mapped_file.h>
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::vector;
+
+// 64 bit hash of a sequence of buffers, eight bytes at a time so that large
+// meshes are hashed at memory speed. Not meant to resist collisions on
+// purpose, only to tell meshes apart.
+class Hasher {
+public:
+  void add(const void* pData, size_t size) {
+    const char* pBytes = static_cast<const char*>(pData);
+    for (; size >= 8; size -= 8, pBytes += 8) {
+      uint64_t word;
+      memcpy(&word, pBytes, 8);
+      mix(word);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, pBytes, size);
+    mix(tail ^ (uint64_t(size) << 56));
+  }
+  template <typename T>
+  void add(const T& value) {
+    add(&value, sizeof(T));
+  }
+  // Final avalanche of splitmix64
+  uint64_t get() const {
+    uint64_t h = m_hash;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+  }
+
+private:
+  void mix(uint64_t word) {
+    m_hash ^= word * 0x87c37b91114253d5ull;
+    m_hash = ((m_hash << 31) | (m_hash >> 33)) * 0x4cf5ad432745937full;
+  }
+
+private:
+  uint64_t m_hash{0x9e3779b97f4a7c15ull};
+};
+
+// Directory of acceleration structures built by earlier runs, see
+// --as_cache. Files are named after their key, a hash of the mesh and of the
+// build settings, so a changed mesh or builder simply misses.
+class AsCache {
+public:
+  // An empty directory disables the cache
+  void init(const std::string& dir);
+  bool isEnabled() const { return !m_dir.empty(); }
+
+  // Mapping of the file of key, nullptr when there is none
+  std::shared_ptr<MappedFile> load(uint64_t key) const;
+  // Written to a temporary file first and renamed, so that concurrent jobs
+  // never map a partial file
+  bool store(uint64_t key, const vector<char>& bytes) const;
+
+private:
+  std::string getFilename(uint64_t key) const;
+
+private:
+  std::string m_dir{};
+};
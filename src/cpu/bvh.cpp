@@ -0,0 +1,209 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <future>
+#include <numeric>
+#include <thread>
+
+// Number of bins per axis when evaluating the surface area heuristic
+#define BVH_SAH_BINS 32
+// Leaves are forced to split above this size
+#define BVH_MAX_LEAF_SIZE 8
+// Keeps the traversal stack of BVH_STACK_SIZE entries from overflowing
+#define BVH_MAX_DEPTH (BVH_STACK_SIZE - 4)
+// Subtrees smaller than this are not worth a task of their own
+#define BVH_PARALLEL_MIN_PRIMS 8192
+// Relative costs of a node traversal step and a primitive intersection
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_INTERSECTION_COST 1.0f
+
+void Bvh::build(const vector<Aabb>& primBounds, uint threadsNum) {
+  m_nodes.clear();
+  m_primIndices.resize(primBounds.size());
+  std::iota(m_primIndices.begin(), m_primIndices.end(), 0);
+  if (primBounds.empty()) return;
+
+  // Spawning two tasks per level, so this gives every thread a subtree
+  if (threadsNum == 0)
+    threadsNum = std::max(1u, std::thread::hardware_concurrency());
+  int spawnDepth = 0;
+  while ((1u << spawnDepth) < threadsNum) spawnDepth++;
+
+  BvhNode root;
+  root.leftOrFirst = 0;
+  root.count = uint(primBounds.size());
+  m_nodes.push_back(root);
+  buildNode(m_nodes, 0, primBounds, 0, spawnDepth);
+  m_nodes.shrink_to_fit();
+}
+
+bool Bvh::findSplit(const BvhNode& node, const Aabb& centroidBounds,
+                    const vector<Aabb>& primBounds, int& axis,
+                    uint& splitBin) const {
+  struct Bin {
+    Aabb bounds;
+    uint count{0};
+  };
+
+  float leafCost = BVH_INTERSECTION_COST * node.count;
+  float bestCost = std::numeric_limits<float>::max();
+  vec3 extents = centroidBounds.extents();
+  for (int a = 0; a < 3; a++) {
+    if (extents[a] <= 0.f) continue;
+    float scale = BVH_SAH_BINS / extents[a];
+
+    Bin bins[BVH_SAH_BINS];
+    for (uint i = node.leftOrFirst; i < node.leftOrFirst + node.count; i++) {
+      const Aabb& b = primBounds[m_primIndices[i]];
+      uint binId = std::min(
+          BVH_SAH_BINS - 1,
+          int((b.center()[a] - centroidBounds.bmin[a]) * scale));
+      bins[binId].bounds.grow(b);
+      bins[binId].count++;
+    }
+
+    // Sweep from both sides to get the cost of every bin boundary
+    float leftArea[BVH_SAH_BINS - 1], rightArea[BVH_SAH_BINS - 1];
+    uint leftCount[BVH_SAH_BINS - 1], rightCount[BVH_SAH_BINS - 1];
+    Aabb leftBox, rightBox;
+    uint leftSum = 0, rightSum = 0;
+    for (int i = 0; i < BVH_SAH_BINS - 1; i++) {
+      leftSum += bins[i].count;
+      leftCount[i] = leftSum;
+      leftBox.grow(bins[i].bounds);
+      leftArea[i] = leftBox.area();
+      rightSum += bins[BVH_SAH_BINS - 1 - i].count;
+      rightCount[BVH_SAH_BINS - 2 - i] = rightSum;
+      rightBox.grow(bins[BVH_SAH_BINS - 1 - i].bounds);
+      rightArea[BVH_SAH_BINS - 2 - i] = rightBox.area();
+    }
+
+    Aabb nodeBox;
+    nodeBox.bmin = node.bmin;
+    nodeBox.bmax = node.bmax;
+    float invArea = 1.f / std::max(nodeBox.area(), 1e-20f);
+    for (int i = 0; i < BVH_SAH_BINS - 1; i++) {
+      if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+      float cost = BVH_TRAVERSAL_COST +
+                   BVH_INTERSECTION_COST * invArea *
+                       (leftCount[i] * leftArea[i] +
+                        rightCount[i] * rightArea[i]);
+      if (cost < bestCost) {
+        bestCost = cost;
+        axis = a;
+        splitBin = uint(i);
+      }
+    }
+  }
+
+  if (bestCost == std::numeric_limits<float>::max()) return false;
+  return bestCost < leafCost || node.count > BVH_MAX_LEAF_SIZE;
+}
+
+void Bvh::buildNode(vector<BvhNode>& nodes, uint nodeId,
+                    const vector<Aabb>& primBounds, int depth,
+                    int spawnDepth) {
+  uint first = nodes[nodeId].leftOrFirst;
+  uint count = nodes[nodeId].count;
+
+  Aabb bounds, centroidBounds;
+  for (uint i = first; i < first + count; i++) {
+    const Aabb& b = primBounds[m_primIndices[i]];
+    bounds.grow(b);
+    centroidBounds.grow(b.center());
+  }
+  nodes[nodeId].bmin = bounds.bmin;
+  nodes[nodeId].bmax = bounds.bmax;
+  if (count <= 1 || depth >= BVH_MAX_DEPTH) return;
+
+  uint mid;
+  int axis = 0;
+  uint splitBin = 0;
+  if (findSplit(nodes[nodeId], centroidBounds, primBounds, axis, splitBin)) {
+    float scale = BVH_SAH_BINS / centroidBounds.extents()[axis];
+    float origin = centroidBounds.bmin[axis];
+    auto it = std::partition(
+        m_primIndices.begin() + first, m_primIndices.begin() + first + count,
+        [&](uint primId) {
+          int binId = std::min(
+              BVH_SAH_BINS - 1,
+              int((primBounds[primId].center()[axis] - origin) * scale));
+          return binId <= int(splitBin);
+        });
+    mid = uint(it - m_primIndices.begin());
+  } else if (count > BVH_MAX_LEAF_SIZE) {
+    // All centroids coincide, any split is as good as another
+    mid = first + count / 2;
+  } else {
+    return;
+  }
+
+  BvhNode left, right;
+  left.leftOrFirst = first;
+  left.count = mid - first;
+  right.leftOrFirst = mid;
+  right.count = first + count - mid;
+  nodes[nodeId].count = 0;
+
+  if (depth >= spawnDepth || count < BVH_PARALLEL_MIN_PRIMS) {
+    uint leftId = uint(nodes.size());
+    nodes[nodeId].leftOrFirst = leftId;
+    nodes.push_back(left);
+    nodes.push_back(right);
+    buildNode(nodes, leftId, primBounds, depth + 1, spawnDepth);
+    buildNode(nodes, leftId + 1, primBounds, depth + 1, spawnDepth);
+    return;
+  }
+
+  // Children work on disjoint ranges of m_primIndices, so both subtrees are
+  // built into local arrays at the same time and spliced in afterwards
+  vector<BvhNode> leftNodes{left}, rightNodes{right};
+  auto rightTask = std::async(std::launch::async, [&]() {
+    buildNode(rightNodes, 0, primBounds, depth + 1, spawnDepth);
+  });
+  buildNode(leftNodes, 0, primBounds, depth + 1, spawnDepth);
+  rightTask.get();
+
+  // Roots go next to each other, the rest of each subtree follows
+  uint childId = uint(nodes.size());
+  uint leftBase = childId + 2;
+  uint rightBase = leftBase + uint(leftNodes.size()) - 1;
+  auto relocate = [](BvhNode node, uint base) {
+    if (!node.isLeaf()) node.leftOrFirst = base + node.leftOrFirst - 1;
+    return node;
+  };
+  nodes[nodeId].leftOrFirst = childId;
+  nodes.reserve(nodes.size() + leftNodes.size() + rightNodes.size());
+  nodes.push_back(relocate(leftNodes[0], leftBase));
+  nodes.push_back(relocate(rightNodes[0], rightBase));
+  for (size_t i = 1; i < leftNodes.size(); i++)
+    nodes.push_back(relocate(leftNodes[i], leftBase));
+  for (size_t i = 1; i < rightNodes.size(); i++)
+    nodes.push_back(relocate(rightNodes[i], rightBase));
+}
+
+vector<float> Bvh::getBuildSettings() {
+  return {float(BVH_SAH_BINS), float(BVH_MAX_LEAF_SIZE), float(BVH_MAX_DEPTH),
+          BVH_TRAVERSAL_COST, BVH_INTERSECTION_COST};
+}
+
+float Bvh::computeSahCost() const {
+  if (m_nodes.empty()) return 0.f;
+  Aabb rootBox;
+  rootBox.bmin = m_nodes[0].bmin;
+  rootBox.bmax = m_nodes[0].bmax;
+  float invRootArea = 1.f / std::max(rootBox.area(), 1e-20f);
+
+  double cost = 0.0;
+  for (const auto& node : m_nodes) {
+    Aabb box;
+    box.bmin = node.bmin;
+    box.bmax = node.bmax;
+    float relArea = box.area() * invRootArea;
+    if (node.isLeaf())
+      cost += relArea * BVH_INTERSECTION_COST * node.count;
+    else
+      cost += relArea * BVH_TRAVERSAL_COST;
+  }
+  return float(cost);
+}
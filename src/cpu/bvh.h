@@ -0,0 +1,99 @@
+#pragma once
+
+#include "raymath.h"
+
+#include <limits>
+#include <vector>
+
+using std::vector;
+
+// Axis aligned box used by the cpu acceleration structures
+struct Aabb {
+  vec3 bmin{std::numeric_limits<float>::max()};
+  vec3 bmax{std::numeric_limits<float>::lowest()};
+
+  void grow(const vec3& p) {
+    bmin = {std::min(bmin.x, p.x), std::min(bmin.y, p.y),
+            std::min(bmin.z, p.z)};
+    bmax = {std::max(bmax.x, p.x), std::max(bmax.y, p.y),
+            std::max(bmax.z, p.z)};
+  }
+  void grow(const Aabb& b) {
+    grow(b.bmin);
+    grow(b.bmax);
+  }
+  vec3 center() const { return (bmin + bmax) * 0.5f; }
+  vec3 extents() const { return bmax - bmin; }
+  float area() const {
+    vec3 e = extents();
+    if (e.x < 0.f) return 0.f;
+    return 2.f * (e.x * e.y + e.y * e.z + e.z * e.x);
+  }
+};
+
+// Binary node, 32 bytes. Inner nodes store their children next to each other
+// at [leftOrFirst, leftOrFirst + 1], leaves store a range of primitives.
+struct BvhNode {
+  vec3 bmin;
+  uint leftOrFirst;
+  vec3 bmax;
+  uint count;  // 0 for inner nodes
+  bool isLeaf() const { return count > 0; }
+};
+
+// Ray with precomputed reciprocal direction for slab tests
+struct CpuTraceRay {
+  vec3 o;
+  vec3 d;
+  vec3 invD;
+  CpuTraceRay(const CpuRay& r) : o(r.o), d(r.d) {
+    invD = vec3(1.f / d.x, 1.f / d.y, 1.f / d.z);
+  }
+};
+
+inline bool intersectAabb(const CpuTraceRay& ray, const vec3& bmin,
+                          const vec3& bmax, float tmin, float tmax,
+                          float& tnear) {
+  float tx0 = (bmin.x - ray.o.x) * ray.invD.x;
+  float tx1 = (bmax.x - ray.o.x) * ray.invD.x;
+  float ty0 = (bmin.y - ray.o.y) * ray.invD.y;
+  float ty1 = (bmax.y - ray.o.y) * ray.invD.y;
+  float tz0 = (bmin.z - ray.o.z) * ray.invD.z;
+  float tz1 = (bmax.z - ray.o.z) * ray.invD.z;
+  tnear = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)),
+                   std::max(std::min(tz0, tz1), tmin));
+  float tfar = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)),
+                        std::min(std::max(tz0, tz1), tmax));
+  return tnear <= tfar;
+}
+
+// Traversal stack entries per level of the tree, see BVH_MAX_DEPTH
+#define BVH_STACK_SIZE 64
+
+// Binned SAH bounding volume hierarchy over a set of primitive bounds. Only
+// topology is kept here: leaves reference ranges of getPrimIndices(). It is
+// a build step, WideBvh collapses it into the tree that is traversed.
+class Bvh {
+public:
+  // Subtrees are built in parallel on up to threadsNum threads, 0 means all
+  // hardware threads
+  void build(const vector<Aabb>& primBounds, uint threadsNum = 0);
+  const vector<BvhNode>& getNodes() const { return m_nodes; }
+  const vector<uint>& getPrimIndices() const { return m_primIndices; }
+  bool isEmpty() const { return m_nodes.empty(); }
+  // SAH cost of the whole tree, relative to the surface area of the root
+  float computeSahCost() const;
+  // Parameters the tree depends on, trees cached on disk are keyed by them
+  static vector<float> getBuildSettings();
+
+private:
+  void buildNode(vector<BvhNode>& nodes, uint nodeId,
+                 const vector<Aabb>& primBounds, int depth, int spawnDepth);
+  bool findSplit(const BvhNode& node, const Aabb& centroidBounds,
+                 const vector<Aabb>& primBounds, int& axis,
+                 uint& splitBin) const;
+
+private:
+  vector<BvhNode> m_nodes{};
+  vector<uint> m_primIndices{};
+};
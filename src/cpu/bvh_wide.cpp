@@ -0,0 +1,300 @@
+#include "bvh_wide.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || \
+    defined(_M_IX86)
+#define BVH_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC always accepts intrinsics, only the call site needs a cpuid check
+#define BVH_TARGET_AVX2
+#define BVH_TARGET_AVX512
+#else
+#define BVH_TARGET_AVX2 __attribute__((target("avx2")))
+#define BVH_TARGET_AVX512 \
+  __attribute__((target("avx2,avx512f,avx512vl,popcnt")))
+#endif
+#endif
+
+SimdLevel detectSimdLevel() {
+#if defined(BVH_X86) && defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) return SimdLevel::Scalar;
+  __cpuid(info, 1);
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  if (!osxsave) return SimdLevel::Scalar;
+  // The os must save the ymm (and zmm) registers on context switches
+  unsigned long long xcr0 = _xgetbv(0);
+  __cpuidex(info, 7, 0);
+  bool avx2 = (info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+  bool avx512 = (info[1] & (1 << 16)) != 0 && (info[1] & (1u << 31)) != 0 &&
+                (xcr0 & 0xE6) == 0xE6;
+  if (avx2 && avx512) return SimdLevel::Avx512;
+  if (avx2) return SimdLevel::Avx2;
+  return SimdLevel::Scalar;
+#elif defined(BVH_X86)
+  // Checks both cpuid and the os support in xcr0
+  __builtin_cpu_init();
+  bool avx2 = __builtin_cpu_supports("avx2");
+  bool avx512 =
+      __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl");
+  if (avx2 && avx512) return SimdLevel::Avx512;
+  if (avx2) return SimdLevel::Avx2;
+  return SimdLevel::Scalar;
+#else
+  return SimdLevel::Scalar;
+#endif
+}
+
+const char* getSimdLevelName(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::Avx512:
+      return "avx512";
+    case SimdLevel::Avx2:
+      return "avx2";
+    default:
+      return "scalar";
+  }
+}
+
+// At most BVH_WIDTH entries, insertion sort beats anything fancier
+static void sortHits(uint hitsNum, uint* slots, float* tnears,
+                     uint64_t* masks = nullptr) {
+  for (uint i = 1; i < hitsNum; i++) {
+    uint slot = slots[i];
+    float t = tnears[i];
+    uint64_t mask = masks ? masks[i] : 0;
+    int j = int(i) - 1;
+    for (; j >= 0 && tnears[j] > t; j--) {
+      slots[j + 1] = slots[j];
+      tnears[j + 1] = tnears[j];
+      if (masks) masks[j + 1] = masks[j];
+    }
+    slots[j + 1] = slot;
+    tnears[j + 1] = t;
+    if (masks) masks[j + 1] = mask;
+  }
+}
+
+template <bool sorted>
+static uint testNodeScalar(const WideBvhNode& node, const CpuTraceRay& ray,
+                           float tmin, float tmax, uint* slots,
+                           float* tnears) {
+  uint hitsNum = 0;
+  for (uint i = 0; i < BVH_WIDTH; i++) {
+    vec3 bmin(node.bminX[i], node.bminY[i], node.bminZ[i]);
+    vec3 bmax(node.bmaxX[i], node.bmaxY[i], node.bmaxZ[i]);
+    float tnear;
+    if (!intersectAabb(ray, bmin, bmax, tmin, tmax, tnear)) continue;
+    slots[hitsNum] = i;
+    tnears[hitsNum++] = tnear;
+  }
+  if (sorted) sortHits(hitsNum, slots, tnears);
+  return hitsNum;
+}
+
+#ifdef BVH_X86
+// Same slab test as intersectAabb, on all eight children at once. Returns the
+// entry distances and the comparison result per lane.
+#define BVH_SLAB_TEST(node, ray, tmin, tmax, tnear, tfar)                   \
+  __m256 ox = _mm256_set1_ps(ray.o.x), oy = _mm256_set1_ps(ray.o.y);        \
+  __m256 oz = _mm256_set1_ps(ray.o.z);                                      \
+  __m256 idx = _mm256_set1_ps(ray.invD.x), idy = _mm256_set1_ps(ray.invD.y); \
+  __m256 idz = _mm256_set1_ps(ray.invD.z);                                  \
+  __m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bminX), ox), \
+                             idx);                                          \
+  __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bmaxX), ox), \
+                             idx);                                          \
+  __m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bminY), oy), \
+                             idy);                                          \
+  __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bmaxY), oy), \
+                             idy);                                          \
+  __m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bminZ), oz), \
+                             idz);                                          \
+  __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bmaxZ), oz), \
+                             idz);                                          \
+  __m256 tnear = _mm256_max_ps(                                             \
+      _mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),      \
+      _mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_set1_ps(tmin)));        \
+  __m256 tfar = _mm256_min_ps(                                              \
+      _mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)),      \
+      _mm256_min_ps(_mm256_max_ps(tz0, tz1), _mm256_set1_ps(tmax)));
+
+template <bool sorted>
+BVH_TARGET_AVX2 static uint testNodeAvx2(const WideBvhNode& node,
+                                         const CpuTraceRay& ray, float tmin,
+                                         float tmax, uint* slots,
+                                         float* tnears) {
+  BVH_SLAB_TEST(node, ray, tmin, tmax, tnear, tfar)
+  int mask = _mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+
+  float lanes[BVH_WIDTH];
+  _mm256_storeu_ps(lanes, tnear);
+  // The callers are sse code, which stalls on dirty upper halves of ymm
+  _mm256_zeroupper();
+  uint hitsNum = 0;
+  for (uint i = 0; i < BVH_WIDTH; i++) {
+    if (!(mask & (1 << i))) continue;
+    slots[hitsNum] = i;
+    tnears[hitsNum++] = lanes[i];
+  }
+  if (sorted) sortHits(hitsNum, slots, tnears);
+  return hitsNum;
+}
+
+template <bool sorted>
+BVH_TARGET_AVX512 static uint testNodeAvx512(const WideBvhNode& node,
+                                             const CpuTraceRay& ray,
+                                             float tmin, float tmax,
+                                             uint* slots, float* tnears) {
+  BVH_SLAB_TEST(node, ray, tmin, tmax, tnear, tfar)
+  // Mask registers and compress stores pack the hit lanes without a loop
+  __mmask8 mask = _mm256_cmp_ps_mask(tnear, tfar, _CMP_LE_OQ);
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  _mm256_mask_compressstoreu_epi32(slots, mask, lanes);
+  _mm256_mask_compressstoreu_ps(tnears, mask, tnear);
+  _mm256_zeroupper();
+  uint hitsNum = uint(_mm_popcnt_u32(mask));
+  if (sorted) sortHits(hitsNum, slots, tnears);
+  return hitsNum;
+}
+
+#undef BVH_SLAB_TEST
+#endif
+
+SimdLevel WideBvh::getSimdLevel() {
+  static const SimdLevel level = detectSimdLevel();
+  return level;
+}
+
+WideNodeTestFn WideBvh::getNodeTest(bool sorted) {
+#ifdef BVH_X86
+  switch (getSimdLevel()) {
+    case SimdLevel::Avx512:
+      return sorted ? testNodeAvx512<true> : testNodeAvx512<false>;
+    case SimdLevel::Avx2:
+      return sorted ? testNodeAvx2<true> : testNodeAvx2<false>;
+    default:
+      break;
+  }
+#endif
+  return sorted ? testNodeScalar<true> : testNodeScalar<false>;
+}
+
+uint WideBvh::testNodePacket(const WideBvhNode& node,
+                             const CpuTracePacket& packet, float tmin,
+                             const float* tmax, uint64_t active, uint* slots,
+                             uint64_t* masks, float* tnears) {
+  uint hitsNum = 0;
+  for (uint i = 0; i < BVH_WIDTH; i++) {
+    if (node.child[i] == BVH_INVALID_CHILD) continue;
+    vec3 bmin(node.bminX[i], node.bminY[i], node.bminZ[i]);
+    vec3 bmax(node.bmaxX[i], node.bmaxY[i], node.bmaxZ[i]);
+    // The frustum rejects most boxes before any ray is tested
+    if (packet.cullsBox(bmin, bmax)) continue;
+    float tnear;
+    uint64_t mask = packet.intersectBox(bmin, bmax, tmin, tmax, active, tnear);
+    if (!mask) continue;
+    slots[hitsNum] = i;
+    masks[hitsNum] = mask;
+    tnears[hitsNum++] = tnear;
+  }
+  sortHits(hitsNum, slots, tnears, masks);
+  return hitsNum;
+}
+
+void WideBvh::build(const Bvh& bvh) {
+  m_nodes = CpuArray<WideBvhNode>();
+  m_primIndices = CpuArray<uint>(bvh.getPrimIndices());
+  m_bounds = Aabb();
+  const auto& nodes = bvh.getNodes();
+  if (nodes.empty()) return;
+  m_bounds.bmin = nodes[0].bmin;
+  m_bounds.bmax = nodes[0].bmax;
+  // Wide nodes are a fraction of the binary ones, this is an upper bound
+  vector<WideBvhNode> wideNodes;
+  wideNodes.reserve(nodes.size() / 2 + 1);
+  collapse(nodes, 0, wideNodes);
+  wideNodes.shrink_to_fit();
+  m_nodes = CpuArray<WideBvhNode>(std::move(wideNodes));
+}
+
+void WideBvh::load(CpuArray<WideBvhNode> nodes, CpuArray<uint> primIndices,
+                   const Aabb& bounds) {
+  m_nodes = std::move(nodes);
+  m_primIndices = std::move(primIndices);
+  m_bounds = bounds;
+}
+
+uint WideBvh::collapse(const vector<BvhNode>& nodes, uint binaryId,
+                       vector<WideBvhNode>& wideNodes) {
+  // Open the inner child with the largest surface area until the node is
+  // full, which keeps the most likely visited boxes in one node
+  auto area = [&](uint id) {
+    Aabb box;
+    box.bmin = nodes[id].bmin;
+    box.bmax = nodes[id].bmax;
+    return box.area();
+  };
+  uint children[BVH_WIDTH];
+  uint childrenNum = 0;
+  const BvhNode& root = nodes[binaryId];
+  if (root.isLeaf()) {
+    children[childrenNum++] = binaryId;
+  } else {
+    children[childrenNum++] = root.leftOrFirst;
+    children[childrenNum++] = root.leftOrFirst + 1;
+  }
+  while (childrenNum < BVH_WIDTH) {
+    int best = -1;
+    float bestArea = -1.f;
+    for (uint i = 0; i < childrenNum; i++) {
+      if (nodes[children[i]].isLeaf()) continue;
+      if (area(children[i]) > bestArea) {
+        bestArea = area(children[i]);
+        best = int(i);
+      }
+    }
+    if (best < 0) break;
+    uint opened = children[best];
+    children[best] = nodes[opened].leftOrFirst;
+    children[childrenNum++] = nodes[opened].leftOrFirst + 1;
+  }
+
+  // Largest boxes first, the occlusion traversal visits them in this order
+  std::stable_sort(children, children + childrenNum,
+                   [&](uint a, uint b) { return area(a) > area(b); });
+
+  uint wideId = uint(wideNodes.size());
+  wideNodes.emplace_back();
+  const float inf = std::numeric_limits<float>::infinity();
+  for (uint i = 0; i < BVH_WIDTH; i++) {
+    WideBvhNode& node = wideNodes[wideId];
+    if (i >= childrenNum) {
+      node.bminX[i] = node.bminY[i] = node.bminZ[i] = inf;
+      node.bmaxX[i] = node.bmaxY[i] = node.bmaxZ[i] = inf;
+      node.child[i] = BVH_INVALID_CHILD;
+      node.count[i] = 0;
+      continue;
+    }
+    const BvhNode& child = nodes[children[i]];
+    node.bminX[i] = child.bmin.x;
+    node.bminY[i] = child.bmin.y;
+    node.bminZ[i] = child.bmin.z;
+    node.bmaxX[i] = child.bmax.x;
+    node.bmaxY[i] = child.bmax.y;
+    node.bmaxZ[i] = child.bmax.z;
+    node.count[i] = child.count;
+    if (child.isLeaf()) {
+      node.child[i] = child.leftOrFirst;
+    } else {
+      // wideNodes may grow, the reference above is refreshed every lane
+      uint childId = collapse(nodes, children[i], wideNodes);
+      wideNodes[wideId].child[i] = childId;
+    }
+  }
+  return wideId;
+}
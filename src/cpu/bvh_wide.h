@@ -0,0 +1,192 @@
+#pragma once
+
+#include "array.h"
+#include "bvh.h"
+#include "packet.h"
+
+// Children per node, one AVX register lane each
+#define BVH_WIDTH 8
+#define BVH_WIDE_STACK_SIZE (BVH_WIDTH * BVH_STACK_SIZE)
+#define BVH_INVALID_CHILD 0xFFFFFFFFu
+
+// Structure-of-arrays node: the boxes of all children are tested against a
+// ray with one instruction per plane. Unused slots hold an infinite point,
+// which no ray can hit.
+struct WideBvhNode {
+  float bminX[BVH_WIDTH];
+  float bminY[BVH_WIDTH];
+  float bminZ[BVH_WIDTH];
+  float bmaxX[BVH_WIDTH];
+  float bmaxY[BVH_WIDTH];
+  float bmaxZ[BVH_WIDTH];
+  uint child[BVH_WIDTH];  // inner: node index, leaf: first primitive
+  uint count[BVH_WIDTH];  // 0 for inner children
+};
+
+enum class SimdLevel { Scalar = 0, Avx2 = 1, Avx512 = 2 };
+
+// Highest instruction set supported by both the cpu and the os, from cpuid
+SimdLevel detectSimdLevel();
+const char* getSimdLevelName(SimdLevel level);
+
+// Tests a ray against the children of a node. Returns how many are hit, and
+// writes their slots to slots[], sorted by entry distance or in node order.
+typedef uint (*WideNodeTestFn)(const WideBvhNode& node,
+                               const CpuTraceRay& ray, float tmin, float tmax,
+                               uint* slots, float* tnears);
+
+// 8-wide bvh collapsed from the binary sah bvh. The node test is picked once
+// according to the instruction sets of the machine.
+class WideBvh {
+public:
+  void build(const Bvh& bvh);
+  // Bvh built earlier, e.g. viewed from a cache file
+  void load(CpuArray<WideBvhNode> nodes, CpuArray<uint> primIndices,
+            const Aabb& bounds);
+  bool isEmpty() const { return m_nodes.empty(); }
+  const CpuArray<WideBvhNode>& getNodes() const { return m_nodes; }
+  const CpuArray<uint>& getPrimIndices() const { return m_primIndices; }
+  const Aabb& getBounds() const { return m_bounds; }
+
+  // Closest hit traversal. leafFn(primId, tmax) returns true when it found a
+  // closer hit, and in that case it has shortened tmax.
+  template <typename LeafFn>
+  bool intersect(const CpuTraceRay& ray, float tmin, float& tmax,
+                 LeafFn leafFn) const;
+  // Any hit traversal. leafFn(primId, tmax) returns true on any hit.
+  template <typename LeafFn>
+  bool occluded(const CpuTraceRay& ray, float tmin, float tmax,
+                LeafFn leafFn) const;
+
+  // Closest hit traversal of a whole packet, tmax holds the tmax of every
+  // ray. Nodes are culled by the frustum of the packet, then only the rays
+  // entering them go down. leafFn(primIds, primsNum, mask) tests the
+  // primitives of a leaf with the rays of mask and lowers their tmax.
+  template <typename LeafFn>
+  void intersectPacket(const CpuTracePacket& packet, float tmin, float* tmax,
+                       LeafFn leafFn) const;
+
+  static SimdLevel getSimdLevel();
+
+private:
+  uint collapse(const vector<BvhNode>& nodes, uint binaryId,
+                vector<WideBvhNode>& wideNodes);
+  static WideNodeTestFn getNodeTest(bool sorted);
+  // Children of the node entered by some ray of active, with the masks of
+  // these rays, sorted by the earliest entry distance
+  static uint testNodePacket(const WideBvhNode& node,
+                             const CpuTracePacket& packet, float tmin,
+                             const float* tmax, uint64_t active, uint* slots,
+                             uint64_t* masks, float* tnears);
+
+private:
+  CpuArray<WideBvhNode> m_nodes{};
+  CpuArray<uint> m_primIndices{};
+  Aabb m_bounds;
+};
+
+template <typename LeafFn>
+bool WideBvh::intersect(const CpuTraceRay& ray, float tmin, float& tmax,
+                        LeafFn leafFn) const {
+  if (m_nodes.empty()) return false;
+  static const WideNodeTestFn testNode = getNodeTest(true);
+
+  bool hit = false;
+  uint stack[BVH_WIDE_STACK_SIZE];
+  float stackNear[BVH_WIDE_STACK_SIZE];
+  int stackSize = 0;
+  stack[stackSize] = 0;
+  stackNear[stackSize++] = tmin;
+  while (stackSize > 0) {
+    --stackSize;
+    // The hit may have moved closer since this node was pushed
+    if (stackNear[stackSize] > tmax) continue;
+    const WideBvhNode& node = m_nodes[stack[stackSize]];
+
+    uint slots[BVH_WIDTH];
+    float tnears[BVH_WIDTH];
+    uint hitsNum = testNode(node, ray, tmin, tmax, slots, tnears);
+
+    // Push far to near so the nearest child is visited first
+    for (int i = int(hitsNum) - 1; i >= 0; i--) {
+      uint slot = slots[i];
+      if (node.count[slot] == 0) {
+        stack[stackSize] = node.child[slot];
+        stackNear[stackSize++] = tnears[i];
+      }
+    }
+    // Leaves are intersected right away, nearest first
+    for (uint i = 0; i < hitsNum; i++) {
+      uint slot = slots[i];
+      if (node.count[slot] == 0 || tnears[i] > tmax) continue;
+      for (uint k = 0; k < node.count[slot]; k++)
+        hit |= leafFn(m_primIndices[node.child[slot] + k], tmax);
+    }
+  }
+  return hit;
+}
+
+template <typename LeafFn>
+bool WideBvh::occluded(const CpuTraceRay& ray, float tmin, float tmax,
+                       LeafFn leafFn) const {
+  if (m_nodes.empty()) return false;
+  // Any occluder will do, children are visited in node order, which puts
+  // the largest and most likely hit boxes first
+  static const WideNodeTestFn testNode = getNodeTest(false);
+
+  uint stack[BVH_WIDE_STACK_SIZE];
+  int stackSize = 0;
+  stack[stackSize++] = 0;
+  while (stackSize > 0) {
+    const WideBvhNode& node = m_nodes[stack[--stackSize]];
+
+    uint slots[BVH_WIDTH];
+    float tnears[BVH_WIDTH];
+    uint hitsNum = testNode(node, ray, tmin, tmax, slots, tnears);
+    // Leaves first, they may end the traversal right away
+    for (uint i = 0; i < hitsNum; i++) {
+      uint slot = slots[i];
+      for (uint k = 0; k < node.count[slot]; k++)
+        if (leafFn(m_primIndices[node.child[slot] + k], tmax)) return true;
+    }
+    for (int i = int(hitsNum) - 1; i >= 0; i--) {
+      uint slot = slots[i];
+      if (node.count[slot] == 0) stack[stackSize++] = node.child[slot];
+    }
+  }
+  return false;
+}
+
+template <typename LeafFn>
+void WideBvh::intersectPacket(const CpuTracePacket& packet, float tmin,
+                              float* tmax, LeafFn leafFn) const {
+  if (m_nodes.empty() || !packet.mask) return;
+
+  uint stack[BVH_WIDE_STACK_SIZE];
+  uint64_t stackMask[BVH_WIDE_STACK_SIZE];
+  int stackSize = 0;
+  stack[stackSize] = 0;
+  stackMask[stackSize++] = packet.mask;
+  while (stackSize > 0) {
+    --stackSize;
+    const WideBvhNode& node = m_nodes[stack[stackSize]];
+
+    uint slots[BVH_WIDTH];
+    uint64_t masks[BVH_WIDTH];
+    float tnears[BVH_WIDTH];
+    uint hitsNum = testNodePacket(node, packet, tmin, tmax,
+                                  stackMask[stackSize], slots, masks, tnears);
+    for (int i = int(hitsNum) - 1; i >= 0; i--) {
+      uint slot = slots[i];
+      if (node.count[slot] == 0) {
+        stack[stackSize] = node.child[slot];
+        stackMask[stackSize++] = masks[i];
+      }
+    }
+    for (uint i = 0; i < hitsNum; i++) {
+      uint slot = slots[i];
+      if (node.count[slot] == 0) continue;
+      leafFn(&m_primIndices[node.child[slot]], node.count[slot], masks[i]);
+    }
+  }
+}
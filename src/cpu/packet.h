@@ -0,0 +1,162 @@
+#pragma once
+
+#include "raymath.h"
+
+#include <limits>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Primary rays are traced by tiles of CPU_TILE_SIZE x CPU_TILE_SIZE pixels
+#define CPU_TILE_SIZE 8
+#define CPU_PACKET_SIZE (CPU_TILE_SIZE * CPU_TILE_SIZE)
+
+// Index of the lowest ray in a non-empty mask, to visit only active rays with
+// for (uint64_t m = mask; m; m &= m - 1) f(getFirstRay(m));
+inline int getFirstRay(uint64_t mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward64(&index, mask);
+  return int(index);
+#else
+  return __builtin_ctzll(mask);
+#endif
+}
+
+inline int getRaysNum(uint64_t mask) {
+  int num = 0;
+  for (; mask; mask &= mask - 1) num++;
+  return num;
+}
+
+// Rays of one tile sharing their origin, like the camera rays of a reference
+// view. Directions need not be normalized.
+struct CpuRayPacket {
+  vec3 o;
+  vec3 d[CPU_PACKET_SIZE];
+  vec3 corners[4];   // bound all directions, in order around the tile
+  uint64_t mask{0};  // bit i is set when ray i is traced
+};
+
+// The rays of mask in another space, e.g. from world to object space of an
+// instance. Other rays keep their directions, so no garbage reaches invD.
+inline CpuRayPacket transformPacket(const mat4& transform,
+                                    const CpuRayPacket& packet,
+                                    uint64_t mask) {
+  CpuRayPacket result = packet;
+  result.o = transformPoint(transform, packet.o);
+  for (uint64_t m = mask; m; m &= m - 1) {
+    int i = getFirstRay(m);
+    result.d[i] = transformVector(transform, packet.d[i]);
+  }
+  for (int k = 0; k < 4; k++)
+    result.corners[k] = transformVector(transform, packet.corners[k]);
+  result.mask = mask;
+  return result;
+}
+
+// Packet with what the traversal precomputes for it: reciprocal directions
+// for the slab tests of its rays, and the frustum bounding all of them to
+// reject nodes and triangles at once
+struct CpuTracePacket {
+  vec3 o;
+  uint64_t mask;
+  float invD[3][CPU_PACKET_SIZE];
+  // Side planes of the frustum, through o with normals pointing inside
+  vec3 planes[4];
+
+  CpuTracePacket(const CpuRayPacket& packet) : o(packet.o), mask(packet.mask) {
+    for (int k = 0; k < 4; k++) {
+      vec3 n = nvmath::cross(packet.corners[k], packet.corners[(k + 1) % 4]);
+      if (nvmath::dot(n, packet.corners[(k + 2) % 4]) < 0.f) n = -n;
+      planes[k] = n;
+    }
+    for (int a = 0; a < 3; a++)
+      for (int i = 0; i < CPU_PACKET_SIZE; i++)
+        invD[a][i] = 1.f / packet.d[i][a];
+  }
+
+  // Rays of active entering the box before their own tmax, same test as
+  // intersectAabb. tnear gets the earliest entry distance among them.
+  uint64_t intersectBox(const vec3& bmin, const vec3& bmax, float tmin,
+                        const float* tmax, uint64_t active,
+                        float& tnear) const {
+    // Once few rays are left, testing them one by one is cheaper
+    tnear = std::numeric_limits<float>::max();
+    if (getRaysNum(active) <= CPU_PACKET_SIZE / 8) {
+      uint64_t result = 0;
+      for (uint64_t m = active; m; m &= m - 1) {
+        int i = getFirstRay(m);
+        float t;
+        if (!intersectBox(bmin, bmax, tmin, tmax[i], i, t)) continue;
+        result |= 1ull << i;
+        tnear = std::min(tnear, t);
+      }
+      return result;
+    }
+
+    // Branchless over all rays so that the loop is vectorized
+    bool hit[CPU_PACKET_SIZE];
+    float tnears[CPU_PACKET_SIZE];
+    for (int i = 0; i < CPU_PACKET_SIZE; i++) {
+      float tx0 = (bmin.x - o.x) * invD[0][i];
+      float tx1 = (bmax.x - o.x) * invD[0][i];
+      float ty0 = (bmin.y - o.y) * invD[1][i];
+      float ty1 = (bmax.y - o.y) * invD[1][i];
+      float tz0 = (bmin.z - o.z) * invD[2][i];
+      float tz1 = (bmax.z - o.z) * invD[2][i];
+      tnears[i] = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)),
+                           std::max(std::min(tz0, tz1), tmin));
+      float tfar = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)),
+                            std::min(std::max(tz0, tz1), tmax[i]));
+      hit[i] = tnears[i] <= tfar;
+    }
+    uint64_t result = 0;
+    for (int i = 0; i < CPU_PACKET_SIZE; i++)
+      result |= uint64_t(hit[i]) << i;
+    result &= active;
+    for (uint64_t m = result; m; m &= m - 1)
+      tnear = std::min(tnear, tnears[getFirstRay(m)]);
+    return result;
+  }
+
+  // Slab test of ray i alone
+  bool intersectBox(const vec3& bmin, const vec3& bmax, float tmin, float tmax,
+                    int i, float& tnear) const {
+    float tx0 = (bmin.x - o.x) * invD[0][i];
+    float tx1 = (bmax.x - o.x) * invD[0][i];
+    float ty0 = (bmin.y - o.y) * invD[1][i];
+    float ty1 = (bmax.y - o.y) * invD[1][i];
+    float tz0 = (bmin.z - o.z) * invD[2][i];
+    float tz1 = (bmax.z - o.z) * invD[2][i];
+    tnear = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)),
+                     std::max(std::min(tz0, tz1), tmin));
+    float tfar = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)),
+                          std::min(std::max(tz0, tz1), tmax));
+    return tnear <= tfar;
+  }
+
+  // True when the box is outside one of the side planes, i.e. its corner
+  // furthest along the normal is behind the plane
+  bool cullsBox(const vec3& bmin, const vec3& bmax) const {
+    for (int k = 0; k < 4; k++) {
+      const vec3& n = planes[k];
+      vec3 p(n.x >= 0.f ? bmax.x : bmin.x, n.y >= 0.f ? bmax.y : bmin.y,
+             n.z >= 0.f ? bmax.z : bmin.z);
+      if (nvmath::dot(n, p - o) < 0.f) return true;
+    }
+    return false;
+  }
+
+  // True when the triangle is outside one of the side planes
+  bool cullsTriangle(const vec3& p0, const vec3& p1, const vec3& p2) const {
+    for (int k = 0; k < 4; k++) {
+      if (nvmath::dot(planes[k], p0 - o) < 0.f &&
+          nvmath::dot(planes[k], p1 - o) < 0.f &&
+          nvmath::dot(planes[k], p2 - o) < 0.f)
+        return true;
+    }
+    return false;
+  }
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <shared/binding.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// Host counterparts of shaders/utils/math.glsl. The cpu backend must follow
+// the same arithmetic as the ray tracing shaders so that both backends write
+// the same correspondence flow.
+
+#define CPU_EPS 0.001f
+#define CPU_INFINITY 10000000000.0f
+#define CPU_MINIMUM 0.00001f
+// Forward and backward flows of consistent pixels cancel out to within this
+// many pixels
+#define CPU_CONSISTENCY_THRESHOLD 0.5f
+
+struct CpuRay {
+  // Origin in world (or object) space
+  vec3 o;
+  // Direction in world (or object) space
+  vec3 d;
+};
+
+inline vec3 transformPoint(const mat4& transform, const vec3& point) {
+  vec4 tHomoPoint = transform * vec4(point.x, point.y, point.z, 1.f);
+  return vec3(tHomoPoint.x, tHomoPoint.y, tHomoPoint.z) / tHomoPoint.w;
+}
+
+inline vec3 transformVector(const mat4& transform, const vec3& vector) {
+  vec4 tHomoVector = transform * vec4(vector.x, vector.y, vector.z, 0.f);
+  return vec3(tHomoVector.x, tHomoVector.y, tHomoVector.z);
+}
+
+inline vec3 makeNormal(const vec3& n) {
+  float len = nvmath::length(n);
+  if (len == 0.f) return n;
+  return n / len;
+}
+
+inline vec3 transformDirection(const mat4& transform, const vec3& direction) {
+  return makeNormal(transformVector(transform, direction));
+}
+
+// Same as (n * m).xyz in glsl, i.e. transpose(m) * n. Used to bring object
+// space normals to world space with the world-to-object matrix.
+inline vec3 transformNormal(const mat4& worldToObject, const vec3& n) {
+  return vec3(worldToObject.a00 * n.x + worldToObject.a10 * n.y +
+                  worldToObject.a20 * n.z,
+              worldToObject.a01 * n.x + worldToObject.a11 * n.y +
+                  worldToObject.a21 * n.z,
+              worldToObject.a02 * n.x + worldToObject.a12 * n.y +
+                  worldToObject.a22 * n.z);
+}
+
+inline float intBitsToFloat(int32_t i) {
+  float f;
+  memcpy(&f, &i, sizeof(f));
+  return f;
+}
+
+inline int32_t floatBitsToInt(float f) {
+  int32_t i;
+  memcpy(&i, &f, sizeof(i));
+  return i;
+}
+
+// "A Fast and Robust Method for Avoiding Self-Intersection", see math.glsl
+inline vec3 offsetPositionAlongNormal(const vec3& worldPosition,
+                                      const vec3& normal) {
+  const float intScale = 256.0f;
+  const int32_t ofi[3] = {int32_t(intScale * normal.x),
+                          int32_t(intScale * normal.y),
+                          int32_t(intScale * normal.z)};
+  const float origin = 1.0f / 32.0f;
+  const float floatScale = 1.0f / 65536.0f;
+
+  vec3 p;
+  for (int axis = 0; axis < 3; axis++) {
+    float w = worldPosition[axis];
+    float pi = intBitsToFloat(floatBitsToInt(w) +
+                              (w < 0 ? -ofi[axis] : ofi[axis]));
+    p[axis] = std::abs(w) < origin ? w + floatScale * normal[axis] : pi;
+  }
+  return p;
+}
@@ -0,0 +1,92 @@
+#include "scheduler.h"
+
+#include <context/context.h>
+
+#include <algorithm>
+#include <thread>
+
+void TileScheduler::init(uint32_t threadsNum) {
+  if (threadsNum == 0)
+    threadsNum = std::max(1u, std::thread::hardware_concurrency());
+  m_threadsNum = threadsNum;
+  m_states.reset(new ThreadState[m_threadsNum]);
+  // A pool of 0 threads would get all hardware threads
+  m_workers.deinit();
+  if (m_threadsNum > 1) m_workers.init(m_threadsNum - 1);
+  resetStats();
+}
+
+void TileScheduler::deinit() { m_workers.deinit(); }
+
+void TileScheduler::resetStats() {
+  for (uint32_t threadId = 0; threadId < m_threadsNum; threadId++) {
+    m_states[threadId].busyMs = 0.0;
+    m_states[threadId].tilesNum = 0;
+    m_states[threadId].stealsNum = 0;
+  }
+  m_wallMs = 0.0;
+}
+
+bool TileScheduler::popTile(uint32_t threadId, uint32_t& tileId) {
+  auto& range = m_states[threadId].range;
+  uint64_t current = range.load();
+  while (getBegin(current) < getEnd(current)) {
+    uint64_t next = packRange(getBegin(current) + 1, getEnd(current));
+    if (range.compare_exchange_weak(current, next)) {
+      tileId = getBegin(current);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool TileScheduler::stealTiles(uint32_t threadId) {
+  while (true) {
+    // The fullest range has the most work left to share
+    uint32_t victimId = threadId, mostTiles = 0;
+    uint64_t victimRange = 0;
+    for (uint32_t otherId = 0; otherId < m_threadsNum; otherId++) {
+      if (otherId == threadId) continue;
+      uint64_t range = m_states[otherId].range.load();
+      uint32_t tilesNum = getEnd(range) - getBegin(range);
+      if (tilesNum > mostTiles) {
+        mostTiles = tilesNum;
+        victimId = otherId;
+        victimRange = range;
+      }
+    }
+    // Nothing left but tiles already being worked on
+    if (mostTiles == 0) return false;
+
+    // Back half, the owner keeps working from the front
+    uint32_t stolen = (mostTiles + 1) / 2;
+    uint32_t begin = getBegin(victimRange), end = getEnd(victimRange);
+    uint64_t left = packRange(begin, end - stolen);
+    if (!m_states[victimId].range.compare_exchange_strong(victimRange, left))
+      continue;
+    m_states[threadId].range = packRange(end - stolen, end);
+    m_states[threadId].stealsNum++;
+    return true;
+  }
+}
+
+void TileScheduler::logStats() const {
+  double busyMin = 0.0, busyMax = 0.0, busySum = 0.0;
+  for (uint32_t threadId = 0; threadId < m_threadsNum; threadId++) {
+    const ThreadState& state = m_states[threadId];
+    LOG_INFO("{}: thread {} busy {:.1f} ms, {} tiles, {} steals",
+             "TileScheduler", threadId, state.busyMs, state.tilesNum,
+             state.stealsNum);
+    busyMin = threadId == 0 ? state.busyMs : std::min(busyMin, state.busyMs);
+    busyMax = std::max(busyMax, state.busyMs);
+    busySum += state.busyMs;
+  }
+  // Efficiency is the busy fraction of the threads over the wall time, 100%
+  // means the work scaled linearly with the number of threads
+  LOG_INFO(
+      "{}: {} threads, wall {:.1f} ms, busy min {:.1f} / avg {:.1f} / max "
+      "{:.1f} ms, efficiency {:.1f}%",
+      "TileScheduler", m_threadsNum, m_wallMs, busyMin,
+      busySum / m_threadsNum, busyMax,
+      m_wallMs > 0.0 ? 100.0 * busySum / (m_threadsNum * m_wallMs) : 0.0);
+}
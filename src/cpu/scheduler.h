@@ -0,0 +1,103 @@
+#pragma once
+
+#include <core/worker_pool.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <future>
+#include <vector>
+
+using std::vector;
+
+// Work stealing scheduler over the tiles of a film. Every thread starts on
+// its own contiguous range of tiles and takes them from the front. When its
+// range is empty it steals the back half of the fullest range of another
+// thread, so cheap sky tiles and expensive geometry tiles even out.
+// The calling thread works as thread 0, the others are parked in a worker
+// pool between runs, so a run costs no thread creation.
+class TileScheduler {
+public:
+  // 0 threads means all hardware threads
+  void init(uint32_t threadsNum);
+  // Joins the parked threads
+  void deinit();
+  uint32_t getThreadsNum() const { return m_threadsNum; }
+
+  // Runs tileFn(tileId) for tileId in [0, tilesNum) over all threads, returns
+  // once every tile is done
+  template <typename TileFn>
+  void run(uint32_t tilesNum, TileFn tileFn);
+
+  // Busy time, tiles and steals per thread over all runs so far
+  void logStats() const;
+  void resetStats();
+
+private:
+  // Range [begin, end) of tiles packed in one word, so that the owner and the
+  // thieves update it with a single compare and swap
+  static uint64_t packRange(uint32_t begin, uint32_t end) {
+    return (uint64_t(begin) << 32) | end;
+  }
+  static uint32_t getBegin(uint64_t range) { return uint32_t(range >> 32); }
+  static uint32_t getEnd(uint64_t range) { return uint32_t(range); }
+
+  bool popTile(uint32_t threadId, uint32_t& tileId);
+  bool stealTiles(uint32_t threadId);
+
+  struct ThreadState {
+    std::atomic<uint64_t> range{0};
+    double busyMs{0.0};
+    uint64_t tilesNum{0};
+    uint64_t stealsNum{0};
+    char padding[64];  // keeps neighbouring states off each other's lines
+  };
+
+private:
+  uint32_t m_threadsNum{1};
+  WorkerPool m_workers;  // threads 1 to m_threadsNum - 1
+  std::unique_ptr<ThreadState[]> m_states{};
+  double m_wallMs{0.0};
+};
+
+template <typename TileFn>
+void TileScheduler::run(uint32_t tilesNum, TileFn tileFn) {
+  using Clock = std::chrono::steady_clock;
+  auto wallStart = Clock::now();
+
+  // Even split to start with, then stealing balances the rest
+  for (uint32_t threadId = 0; threadId < m_threadsNum; threadId++) {
+    uint32_t begin = uint32_t(uint64_t(tilesNum) * threadId / m_threadsNum);
+    uint32_t end = uint32_t(uint64_t(tilesNum) * (threadId + 1) / m_threadsNum);
+    m_states[threadId].range = packRange(begin, end);
+  }
+
+  auto worker = [&](uint32_t threadId) {
+    ThreadState& state = m_states[threadId];
+    while (true) {
+      uint32_t tileId;
+      if (!popTile(threadId, tileId)) {
+        if (stealTiles(threadId)) continue;
+        break;
+      }
+      auto start = Clock::now();
+      tileFn(tileId);
+      state.busyMs +=
+          std::chrono::duration<double, std::milli>(Clock::now() - start)
+              .count();
+      state.tilesNum++;
+    }
+  };
+
+  vector<std::future<void>> runs;
+  for (uint32_t threadId = 1; threadId < m_threadsNum; threadId++)
+    runs.push_back(
+        m_workers.submit([&worker, threadId]() { worker(threadId); }));
+  worker(0);
+  for (auto& done : runs) done.get();
+
+  m_wallMs +=
+      std::chrono::duration<double, std::milli>(Clock::now() - wallStart)
+          .count();
+}
@@ -0,0 +1,279 @@
+#include "gltf.h"
+
+// Images are not needed for correspondence, so tinygltf neither decodes nor
+// reads them
+#define TINYGLTF_IMPLEMENTATION
+#define TINYGLTF_NO_STB_IMAGE
+#define TINYGLTF_NO_STB_IMAGE_WRITE
+#define TINYGLTF_NO_EXTERNAL_IMAGE
+#include <tiny_gltf.h>
+#include <context/context.h>
+
+#include <cstring>
+#include <functional>
+
+static bool skipImage(tinygltf::Image*, const int, std::string*, std::string*,
+                      int, int, const unsigned char*, int, void*) {
+  return true;
+}
+
+// Bytes of the elements of an accessor, with their stride
+static bool getAccessorData(const tinygltf::Model& model, int accessorId,
+                            const unsigned char*& pData, size_t& stride,
+                            std::string& error) {
+  if (accessorId < 0 || accessorId >= int(model.accessors.size())) {
+    error = "bad accessor " + std::to_string(accessorId);
+    return false;
+  }
+  const auto& accessor = model.accessors[accessorId];
+  if (accessor.sparse.isSparse || accessor.bufferView < 0) {
+    error = "sparse accessors are not supported";
+    return false;
+  }
+  const auto& view = model.bufferViews[accessor.bufferView];
+  const auto& buffer = model.buffers[view.buffer];
+  int byteStride = accessor.ByteStride(view);
+  if (byteStride <= 0) {
+    error = "bad stride of accessor " + std::to_string(accessorId);
+    return false;
+  }
+  stride = size_t(byteStride);
+  size_t elementSize =
+      size_t(tinygltf::GetComponentSizeInBytes(accessor.componentType) *
+             tinygltf::GetNumComponentsInType(accessor.type));
+  size_t begin = view.byteOffset + accessor.byteOffset;
+  size_t end = begin + stride * (accessor.count - 1) + elementSize;
+  if (accessor.count > 0 && end > buffer.data.size()) {
+    error = "accessor " + std::to_string(accessorId) + " exceeds its buffer";
+    return false;
+  }
+  pData = buffer.data.data() + begin;
+  return true;
+}
+
+// Float vectors of an accessor appended to out. Tightly packed floats are
+// copied at once, normalized integers (allowed for uvs) are converted.
+template <typename T>
+static bool appendAccessor(const tinygltf::Model& model, int accessorId,
+                           vector<T>& out, std::string& error) {
+  const int componentsNum = int(sizeof(T) / sizeof(float));
+  const unsigned char* pData;
+  size_t stride;
+  if (!getAccessorData(model, accessorId, pData, stride, error)) return false;
+  const auto& accessor = model.accessors[accessorId];
+  if (tinygltf::GetNumComponentsInType(accessor.type) != componentsNum) {
+    error = "accessor " + std::to_string(accessorId) + " has a bad type";
+    return false;
+  }
+
+  size_t base = out.size();
+  out.resize(base + accessor.count);
+  if (accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT) {
+    if (stride == sizeof(T))
+      memcpy(out.data() + base, pData, accessor.count * sizeof(T));
+    else
+      for (size_t i = 0; i < accessor.count; i++)
+        memcpy(&out[base + i], pData + i * stride, sizeof(T));
+    return true;
+  }
+  float scale;
+  if (accessor.normalized &&
+      accessor.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE)
+    scale = 1.f / 255.f;
+  else if (accessor.normalized &&
+           accessor.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT)
+    scale = 1.f / 65535.f;
+  else {
+    error = "accessor " + std::to_string(accessorId) + " is not float";
+    return false;
+  }
+  for (size_t i = 0; i < accessor.count; i++) {
+    float* pOut = reinterpret_cast<float*>(&out[base + i]);
+    for (int c = 0; c < componentsNum; c++) {
+      if (accessor.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE)
+        pOut[c] = scale * pData[i * stride + c];
+      else {
+        uint16_t value;
+        memcpy(&value, pData + i * stride + 2 * c, 2);
+        pOut[c] = scale * value;
+      }
+    }
+  }
+  return true;
+}
+
+// Indices of an accessor appended to out, offset by base
+static bool appendIndices(const tinygltf::Model& model, int accessorId,
+                          uint base, vector<uint>& out, std::string& error) {
+  const unsigned char* pData;
+  size_t stride;
+  if (!getAccessorData(model, accessorId, pData, stride, error)) return false;
+  const auto& accessor = model.accessors[accessorId];
+  size_t first = out.size();
+  out.resize(first + accessor.count);
+  for (size_t i = 0; i < accessor.count; i++) {
+    const unsigned char* pIndex = pData + i * stride;
+    uint index;
+    if (accessor.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT)
+      memcpy(&index, pIndex, 4);
+    else if (accessor.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT) {
+      uint16_t value;
+      memcpy(&value, pIndex, 2);
+      index = value;
+    } else if (accessor.componentType ==
+               TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE)
+      index = *pIndex;
+    else {
+      error = "accessor " + std::to_string(accessorId) + " is not an index";
+      return false;
+    }
+    out[first + i] = base + index;
+  }
+  return true;
+}
+
+// All triangle primitives of a mesh merged into one. Normals are kept only
+// when every primitive has them, missing uvs are zeroed.
+static bool loadGltfMesh(const tinygltf::Model& model,
+                         const tinygltf::Mesh& mesh, bool recomputeNormal,
+                         MeshData& data, std::string& error) {
+  bool hasNormals = !recomputeNormal, hasUvs = false;
+  for (const auto& primitive : mesh.primitives) {
+    if (primitive.mode != TINYGLTF_MODE_TRIANGLES && primitive.mode != -1)
+      continue;
+    hasNormals &= primitive.attributes.count("NORMAL") > 0;
+    hasUvs |= primitive.attributes.count("TEXCOORD_0") > 0;
+  }
+
+  for (const auto& primitive : mesh.primitives) {
+    if (primitive.mode != TINYGLTF_MODE_TRIANGLES && primitive.mode != -1)
+      continue;
+    auto position = primitive.attributes.find("POSITION");
+    if (position == primitive.attributes.end()) continue;
+    uint base = uint(data.positions.size());
+    if (!appendAccessor(model, position->second, data.positions, error))
+      return false;
+    uint verticesNum = uint(data.positions.size()) - base;
+
+    if (hasNormals &&
+        !appendAccessor(model, primitive.attributes.at("NORMAL"), data.normals,
+                        error))
+      return false;
+    if (hasUvs) {
+      auto uv = primitive.attributes.find("TEXCOORD_0");
+      if (uv == primitive.attributes.end())
+        data.uvs.resize(data.positions.size(), vec2(0.f, 0.f));
+      else if (!appendAccessor(model, uv->second, data.uvs, error))
+        return false;
+    }
+    if ((hasNormals && data.normals.size() != data.positions.size()) ||
+        (hasUvs && data.uvs.size() != data.positions.size())) {
+      error = "attributes of mesh [" + mesh.name + "] differ in count";
+      return false;
+    }
+
+    if (primitive.indices < 0)
+      for (uint i = 0; i < verticesNum; i++) data.indices.push_back(base + i);
+    else if (!appendIndices(model, primitive.indices, base, data.indices,
+                            error))
+      return false;
+  }
+  for (uint index : data.indices)
+    if (index >= data.positions.size()) {
+      error = "index out of range in mesh [" + mesh.name + "]";
+      return false;
+    }
+  return true;
+}
+
+// Local transform of a node, its matrix or translation * rotation * scale
+static mat4 getNodeTransform(const tinygltf::Node& node) {
+  const auto& m = node.matrix;
+  if (m.size() == 16)
+    return mat4(float(m[0]), float(m[1]), float(m[2]), float(m[3]),
+                float(m[4]), float(m[5]), float(m[6]), float(m[7]),
+                float(m[8]), float(m[9]), float(m[10]), float(m[11]),
+                float(m[12]), float(m[13]), float(m[14]), float(m[15]));
+
+  mat4 transform = nvmath::mat4f_id;
+  vec3 s = {1.f, 1.f, 1.f};
+  if (node.scale.size() == 3)
+    s = vec3(float(node.scale[0]), float(node.scale[1]), float(node.scale[2]));
+  if (node.rotation.size() == 4) {
+    float x = float(node.rotation[0]), y = float(node.rotation[1]);
+    float z = float(node.rotation[2]), w = float(node.rotation[3]);
+    transform.a00 = 1.f - 2.f * (y * y + z * z);
+    transform.a01 = 2.f * (x * y - z * w);
+    transform.a02 = 2.f * (x * z + y * w);
+    transform.a10 = 2.f * (x * y + z * w);
+    transform.a11 = 1.f - 2.f * (x * x + z * z);
+    transform.a12 = 2.f * (y * z - x * w);
+    transform.a20 = 2.f * (x * z - y * w);
+    transform.a21 = 2.f * (y * z + x * w);
+    transform.a22 = 1.f - 2.f * (x * x + y * y);
+  }
+  transform.a00 *= s.x, transform.a10 *= s.x, transform.a20 *= s.x;
+  transform.a01 *= s.y, transform.a11 *= s.y, transform.a21 *= s.y;
+  transform.a02 *= s.z, transform.a12 *= s.z, transform.a22 *= s.z;
+  if (node.translation.size() == 3)
+    transform.set_translation(vec3(float(node.translation[0]),
+                                   float(node.translation[1]),
+                                   float(node.translation[2])));
+  return transform;
+}
+
+bool loadGltf(const std::string& gltfPath, GltfScene& scene,
+              bool recomputeNormal, std::string& error) {
+  tinygltf::TinyGLTF gltfLoader;
+  tinygltf::Model model;
+  std::string warning;
+  gltfLoader.SetImageLoader(skipImage, nullptr);
+  bool isBinary = gltfPath.size() >= 4 &&
+                  (gltfPath.compare(gltfPath.size() - 4, 4, ".glb") == 0 ||
+                   gltfPath.compare(gltfPath.size() - 4, 4, ".GLB") == 0);
+  bool loaded =
+      isBinary
+          ? gltfLoader.LoadBinaryFromFile(&model, &error, &warning, gltfPath)
+          : gltfLoader.LoadASCIIFromFile(&model, &error, &warning, gltfPath);
+  if (!warning.empty())
+    LOG_WARN("{}: [{}] --- {}", "Loader", gltfPath, warning);
+  if (!loaded) return false;
+
+  scene = GltfScene();
+  scene.meshes.resize(model.meshes.size());
+  for (size_t meshId = 0; meshId < model.meshes.size(); meshId++)
+    if (!loadGltfMesh(model, model.meshes[meshId], recomputeNormal,
+                      scene.meshes[meshId], error))
+      return false;
+
+  // Roots of the default scene, or every node no other node refers to
+  vector<int> roots;
+  if (!model.scenes.empty()) {
+    int sceneId = model.defaultScene >= 0 ? model.defaultScene : 0;
+    roots = model.scenes[sceneId].nodes;
+  } else {
+    vector<bool> isChild(model.nodes.size(), false);
+    for (const auto& node : model.nodes)
+      for (int child : node.children) isChild[child] = true;
+    for (int nodeId = 0; nodeId < int(model.nodes.size()); nodeId++)
+      if (!isChild[nodeId]) roots.push_back(nodeId);
+  }
+
+  std::function<void(int, const mat4&)> visit = [&](int nodeId,
+                                                    const mat4& parent) {
+    const auto& node = model.nodes[nodeId];
+    mat4 world = parent * getNodeTransform(node);
+    if (node.mesh >= 0) scene.instances.emplace_back(world, uint(node.mesh));
+    if (node.camera >= 0) {
+      // Gltf cameras look down -z with +y up
+      CameraShot shot;
+      shot.eye = vec3(world * vec4(0, 0, 0, 1));
+      shot.lookat = vec3(world * vec4(0, 0, -1, 1));
+      shot.up = nvmath::normalize(vec3(world * vec4(0, 1, 0, 0)));
+      scene.shots.push_back(shot);
+    }
+    for (int child : node.children) visit(child, world);
+  };
+  for (int root : roots) visit(root, nvmath::mat4f_id);
+  return true;
+}
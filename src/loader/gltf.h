@@ -0,0 +1,22 @@
+#pragma once
+
+#include <core/camera.h>
+#include <core/mesh_io.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Meshes, instances and camera poses of a gltf 2.0 scene
+struct GltfScene {
+  vector<MeshData> meshes{};  // one per gltf mesh, all its triangle primitives
+  vector<std::pair<mat4, uint>> instances{};  // world transform and mesh id
+  vector<CameraShot> shots{};                 // one per camera node
+};
+
+// Load a .gltf or .glb file. Vertex streams are copied from the accessors,
+// in one memcpy when they are tightly packed floats. Instances and shots
+// take the world transform of their node in the default scene. With
+// recomputeNormal, normals are dropped for face normals as with obj meshes.
+bool loadGltf(const std::string& gltfPath, GltfScene& scene,
+              bool recomputeNormal, std::string& error);
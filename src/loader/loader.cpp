@@ -1,5 +1,8 @@
 #include "loader.h"
+#include "gltf.h"
+#include "manifest.h"
 #include "utils.h"
+#include <core/mapped_file.h>
 #include <shared/camera.h>
 #include <shared/pushconstant.h>
 #include <filesystem/path.h>
@@ -12,12 +15,10 @@ using namespace filesystem;
 #include <nvvk/commands_vk.hpp>
 
 #include <filesystem>
-#include <fstream>
 
 #define PI 3.14159265358979323846f
 
 using nlohmann::json;
-using std::ifstream;
 using std::string;
 
 static json defaultSceneOptions = json::parse(R"(
@@ -32,23 +33,10 @@ static json defaultSceneOptions = json::parse(R"(
 
 VkExtent2D Loader::loadSizeFirst(std::string sceneFilePath,
                                  const std::string& root) {
-  bool isRelativePath = !path(sceneFilePath).is_absolute();
-  if (isRelativePath)
-    sceneFilePath = nvh::findFile(sceneFilePath, {root}, true);
-  if (sceneFilePath.empty()) {
-    LOG_ERROR("{}: failed to load scene from file [{}]", "Loader",
-              sceneFilePath);
-    exit(1);
-  }
-  m_sceneFileDir = path(sceneFilePath).parent_path().str();
-
-  ifstream sceneFileStream(sceneFilePath);
-  json sceneFileJson;
-  sceneFileStream >> sceneFileJson;
+  parseFile(sceneFilePath, root);
 
   // Multiview correspondence
-  JsonCheckKeys(sceneFileJson, {"camera", "meshes", "instances", "shots", "pairs"});
-  auto& cameraJson = sceneFileJson["camera"];
+  auto& cameraJson = m_sceneFileJson["camera"];
   JsonCheckKeys(cameraJson, {"type", "film"});
   auto& filmJson = cameraJson["film"];
   JsonCheckKeys(filmJson, {"resolution"});
@@ -62,6 +50,14 @@ void Loader::loadSceneFromJson(std::string sceneFilePath,
                                const std::string& root, Scene* pScene) {
   LOG_INFO("{}: loading scene assets, this may take tens of seconds", "Loader");
 
+  parseFile(sceneFilePath, root);
+  m_pScene = pScene;
+  m_pScene->reset();
+  parse(m_sceneFileJson);
+  submit();
+}
+
+void Loader::parseFile(std::string sceneFilePath, const std::string& root) {
   bool isRelativePath = !path(sceneFilePath).is_absolute();
   if (isRelativePath)
     sceneFilePath = nvh::findFile(sceneFilePath, {root}, true);
@@ -70,48 +66,95 @@ void Loader::loadSceneFromJson(std::string sceneFilePath,
               sceneFilePath);
     exit(1);
   }
+  if (sceneFilePath == m_sceneFilePath) return;
+  m_sceneFilePath = sceneFilePath;
   m_sceneFileDir = path(sceneFilePath).parent_path().str();
 
-  ifstream sceneFileStream(sceneFilePath);
-  json sceneFileJson;
-  sceneFileStream >> sceneFileJson;
+  MappedFile sceneFile;
+  if (!sceneFile.open(sceneFilePath)) {
+    LOG_ERROR("{}: failed to read scene file [{}]", "Loader", sceneFilePath);
+    exit(1);
+  }
 
-  m_pScene = pScene;
-  m_pScene->reset();
-  parse(sceneFileJson);
-  submit();
+  // Shots and pairs are converted as soon as they are parsed, see SceneSax
+  nvh::Stopwatch sw;
+  m_shots.clear();
+  m_pairs.clear();
+  SceneSax sax(
+      m_sceneFileJson,
+      [&](const ShotFields& fields) {
+        CameraShot shot;
+        std::string error;
+        if (!fieldsToShot(fields, shot, error)) {
+          LOG_ERROR("{}: shot [{}] {}", "Loader", m_shots.size(), error);
+          exit(1);
+        }
+        m_shots.push_back(shot);
+      },
+      [&](int ref, int src) {
+        if (ref < 0 || src < 0) {
+          LOG_ERROR("{}: pair [{}] needs [\"ref\"] and [\"src\"]", "Loader",
+                    m_pairs.size());
+          exit(1);
+        }
+        m_pairs.emplace_back(ref, src);
+      });
+  const char* pData = sceneFile.getData();
+  if (!json::sax_parse(pData, pData + sceneFile.getSize(), &sax)) {
+    LOG_ERROR("{}: failed to parse scene file [{}] --- {}", "Loader",
+              sceneFilePath, sax.getError());
+    exit(1);
+  }
+  LOG_INFO("{}: parsed [{}] with {} shots and {} pairs in {:.2f} ms", "Loader",
+           sceneFilePath, m_shots.size(), m_pairs.size(), sw.elapsed());
 }
 
 void Loader::parse(const nlohmann::json& sceneFileJson) {
-  JsonCheckKeys(sceneFileJson,
-                // Multiview corresnpondence
-                {"camera", "meshes", "instances", "shots", "pairs"});
+  // Multiview corresnpondence. Meshes, instances and shots may all come from
+  // gltf files instead.
+  // Pairs may come from a manifest instead.
+  JsonCheckKeys(sceneFileJson, {"camera"});
+  if (!sceneFileJson.contains("pairs") && !sceneFileJson.contains("manifest")) {
+    LOG_ERROR("{}: scene file needs [\"pairs\"] or [\"manifest\"]",
+              "Loader");
+    exit(1);
+  }
 
   auto& cameraJson = sceneFileJson["camera"];
-  auto& meshesJson = sceneFileJson["meshes"];
-  auto& instancesJson = sceneFileJson["instances"];
 
   // parse scene file to generate raw data
   // camera
   addCamera(cameraJson);
+  // gltf, before the instances that may refer to its meshes
+  if (sceneFileJson.contains("gltf")) {
+    for (auto& gltfJson : sceneFileJson["gltf"]) {
+      addGltf(gltfJson);
+    }
+  }
   // meshes
-  for (auto& meshJson : meshesJson) {
-    addMesh(meshJson);
+  if (sceneFileJson.contains("meshes")) {
+    for (auto& meshJson : sceneFileJson["meshes"]) {
+      addMesh(meshJson);
+    }
   }
   // instances
-  for (auto& instanceJson : instancesJson) {
-    addInstance(instanceJson);
+  if (sceneFileJson.contains("instances")) {
+    for (auto& instanceJson : sceneFileJson["instances"]) {
+      addInstance(instanceJson);
+    }
   }
-  // shots
-  auto& shotsJson = sceneFileJson["shots"];
-  for (auto& shotJson : shotsJson) {
-    addShot(shotJson);
+  // shots, parsed along with the file
+  for (auto& shot : m_shots) {
+    m_pScene->addShot(shot);
   }
   // Multiview corresnpondence
-  // pairs
-  auto& pairsJson = sceneFileJson["pairs"];
-  for (auto& pairJson : pairsJson) {
-    addPair(pairJson);
+  // pairs, parsed along with the file
+  for (auto& pair : m_pairs) {
+    m_pScene->addPair(pair.first, pair.second);
+  }
+  // shots and pairs of a manifest, after those of the scene file
+  if (sceneFileJson.contains("manifest")) {
+    addManifest(sceneFileJson["manifest"]);
   }
 }
 
@@ -153,6 +196,11 @@ void Loader::addMesh(const nlohmann::json& meshJson) {
     LOG_ERROR("{}: failed to load mesh from file [{}]", "Loader", meshPath);
     exit(1);
   }
+  // Obj and ply files are parsed, binary mesh files mapped, see Mesh
+  if (getMeshFormat(meshPath) == MeshFormat::Unknown) {
+    LOG_ERROR("{}: unsupported mesh format of [{}]", "Loader", meshPath);
+    exit(1);
+  }
   bool recomputeNormal = false;
   vec2 uvScale = {1.f, 1.f};
   if (meshJson.contains("recompute_normal"))
@@ -162,6 +210,72 @@ void Loader::addMesh(const nlohmann::json& meshJson) {
   m_pScene->addMesh(meshName, meshPath, recomputeNormal, uvScale);
 }
 
+void Loader::addGltf(const nlohmann::json& gltfJson) {
+  JsonCheckKeys(gltfJson, {"name", "path"});
+  std::string gltfName = gltfJson["name"];
+  auto gltfPath = nvh::findFile(gltfJson["path"], {m_sceneFileDir}, true);
+  if (gltfPath.empty()) {
+    LOG_ERROR("{}: failed to load gltf from file [{}]", "Loader",
+              gltfJson["path"]);
+    exit(1);
+  }
+  bool recomputeNormal = false;
+  vec2 uvScale = {1.f, 1.f};
+  if (gltfJson.contains("recompute_normal"))
+    recomputeNormal = gltfJson["recompute_normal"];
+  if (gltfJson.contains("uv_scale")) uvScale = Json2Vec2(gltfJson["uv_scale"]);
+
+  nvh::Stopwatch sw;
+  GltfScene gltf;
+  std::string error;
+  if (!loadGltf(gltfPath, gltf, recomputeNormal, error)) {
+    LOG_ERROR("{}: load gltf from [{}] --- {}", "Loader", gltfPath, error);
+    exit(1);
+  }
+  LOG_INFO("{}: loaded [{}] with {} meshes, {} instances and {} shots in "
+           "{:.2f} ms",
+           "Loader", gltfPath, gltf.meshes.size(), gltf.instances.size(),
+           gltf.shots.size(), sw.elapsed());
+
+  // Meshes are named <name>/<gltf mesh index>, so that instances of the
+  // scene file can refer to them too
+  auto getMeshName = [&](uint meshId) {
+    return gltfName + "/" + std::to_string(meshId);
+  };
+  for (uint meshId = 0; meshId < gltf.meshes.size(); meshId++) {
+    for (auto& uv : gltf.meshes[meshId].uvs) uv = uvScale * uv;
+    m_pScene->addMesh(getMeshName(meshId), std::move(gltf.meshes[meshId]));
+  }
+  for (const auto& instance : gltf.instances)
+    m_pScene->addInstance(instance.first, getMeshName(instance.second));
+  for (const auto& shot : gltf.shots) m_pScene->addShot(shot);
+}
+
+void Loader::addManifest(const nlohmann::json& manifestJson) {
+  auto manifestPath = nvh::findFile(manifestJson, {m_sceneFileDir}, true);
+  if (manifestPath.empty()) {
+    LOG_ERROR("{}: failed to load manifest from file [{}]", "Loader",
+              manifestJson);
+    exit(1);
+  }
+
+  // Records go straight into the scene as the mapped file is read
+  nvh::Stopwatch sw;
+  int shotsBase = m_pScene->getShotsNum();
+  uint pairsBase = m_pScene->getPairsNum();
+  std::string error;
+  bool loaded = readManifest(
+      manifestPath, [&](const CameraShot& shot) { m_pScene->addShot(shot); },
+      [&](int ref, int src) { m_pScene->addPair(ref, src); }, error);
+  if (!loaded) {
+    LOG_ERROR("{}: manifest [{}] {}", "Loader", manifestPath, error);
+    exit(1);
+  }
+  LOG_INFO("{}: loaded [{}] with {} shots and {} pairs in {:.2f} ms", "Loader",
+           manifestPath, m_pScene->getShotsNum() - shotsBase,
+           m_pScene->getPairsNum() - pairsBase, sw.elapsed());
+}
+
 static void parseToWorld(const json& toworldJson, mat4& transform,
                          bool banTranslation = false) {
   transform = nvmath::mat4f_id;
@@ -202,41 +316,3 @@ void Loader::addInstance(const nlohmann::json& instanceJson) {
     parseToWorld(instanceJson["toworld"], transform);
   m_pScene->addInstance(transform, meshName);
 }
-
-void Loader::addShot(const nlohmann::json& shotJson) {
-  JsonCheckKeys(shotJson, {"type"});
-  vec3 eye, lookat, up;
-  mat4 ext = nvmath::mat4f_zero;
-  if (shotJson["type"] == "lookat") {
-    JsonCheckKeys(shotJson, {"eye", "lookat", "up"});
-    eye = Json2Vec3(shotJson["eye"]);
-    lookat = Json2Vec3(shotJson["lookat"]);
-    up = Json2Vec3(shotJson["up"]);
-  } else if (shotJson["type"] == "opencv") {
-    JsonCheckKeys(shotJson, {"matrix"});
-    ext = Json2Mat4(shotJson["matrix"]);
-    auto cameraToWorld = nvmath::invert_rot_trans(ext);
-    cameraToWorld.get_translation(eye);
-    up = vec3(cameraToWorld * vec4(0, -1, 0, 0));
-    lookat = vec3(cameraToWorld * vec4(0, 0, 1, 1));
-  } else {
-    LOG_ERROR("{}: unrecognized shot type [{}]", "Loader", shotJson["type"]);
-    exit(1);
-  }
-
-  CameraShot shot;
-  //shot.ext = ext;
-  shot.eye = eye;
-  shot.up = up;
-  shot.lookat = lookat;
-
-  m_pScene->addShot(shot);
-}
-
-// Multiview corresnpondence
-void Loader::addPair(const nlohmann::json& pairJson) {
-  JsonCheckKeys(pairJson, {"ref", "src"});
-  int ref = pairJson["ref"];
-  int src = pairJson["src"];
-  m_pScene->addPair(ref, src);
-}
@@ -4,7 +4,12 @@
 #include <vector>
 #include <scene/scene.h>
 #include <ext/json.hpp>
+#include "scene_sax.h"
 
+// The scene file is parsed once, by whichever of loadSizeFirst and
+// loadSceneFromJson comes first, and kept for the other one. Shots and pairs
+// are converted as the parser reaches them and dropped from the document,
+// so that files with tens of thousands of them stay cheap.
 class Loader {
 public:
   Loader() {}
@@ -16,6 +21,7 @@ public:
                          Scene* pScene);
 
 private:
+  void parseFile(std::string sceneFilePath, const std::string& root);
   void parse(const nlohmann::json& sceneJson);
   void submit();
 
@@ -23,13 +29,19 @@ private:
   void addCamera(const nlohmann::json& cameraJson);
   void addMesh(const nlohmann::json& meshJson);
   void addInstance(const nlohmann::json& instanceJson);
-  void addShot(const nlohmann::json& shotJson);
+  // Meshes, instances and shots of a gltf file
+  void addGltf(const nlohmann::json& gltfJson);
+  // Shots and pairs of a csv or binary manifest
+  void addManifest(const nlohmann::json& manifestJson);
 
 private:
   Scene* m_pScene = nullptr;
+  string m_sceneFilePath = "";
   string m_sceneFileDir = "";
+  nlohmann::json m_sceneFileJson;  // without shots and pairs
+  vector<CameraShot> m_shots = {};
 
   // Multiview correspondence
 private:
-  void addPair(const nlohmann::json& shotJson);
+  vector<std::pair<int, int>> m_pairs = {};
 };
\ No newline at end of file
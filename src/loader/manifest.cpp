@@ -0,0 +1,280 @@
+#include "manifest.h"
+
+#include <context/context.h>
+#include <core/mapped_file.h>
+#include <nvmath/nvmath.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+bool fieldsToShot(const ShotFields& fields, CameraShot& shot,
+                  std::string& error) {
+  auto checkField = [&](const vector<float>& field, size_t size,
+                        const char* name) {
+    if (field.size() >= size) return true;
+    error = "needs " + std::to_string(size) + " numbers in [\"" + name + "\"]";
+    return false;
+  };
+  vec3 eye, lookat, up;
+  mat4 ext = nvmath::mat4f_zero;
+  if (fields.type == "lookat") {
+    if (!checkField(fields.eye, 3, "eye") ||
+        !checkField(fields.lookat, 3, "lookat") ||
+        !checkField(fields.up, 3, "up"))
+      return false;
+    eye = vec3(fields.eye[0], fields.eye[1], fields.eye[2]);
+    lookat = vec3(fields.lookat[0], fields.lookat[1], fields.lookat[2]);
+    up = vec3(fields.up[0], fields.up[1], fields.up[2]);
+  } else if (fields.type == "opencv") {
+    if (!checkField(fields.matrix, 16, "matrix")) return false;
+    // Row major in the file, like Json2Mat4
+    const auto& m = fields.matrix;
+    ext = mat4(m[0], m[4], m[8], m[12], m[1], m[5], m[9], m[13], m[2], m[6],
+               m[10], m[14], m[3], m[7], m[11], m[15]);
+    auto cameraToWorld = nvmath::invert_rot_trans(ext);
+    cameraToWorld.get_translation(eye);
+    up = vec3(cameraToWorld * vec4(0, -1, 0, 0));
+    lookat = vec3(cameraToWorld * vec4(0, 0, 1, 1));
+  } else {
+    error = "has unrecognized type [" + fields.type + "]";
+    return false;
+  }
+
+  shot = CameraShot();
+  //shot.ext = ext;
+  shot.eye = eye;
+  shot.up = up;
+  shot.lookat = lookat;
+  return true;
+}
+
+static bool hasExtension(const std::string& path, const std::string& ext) {
+  if (path.size() < ext.size()) return false;
+  return std::equal(ext.rbegin(), ext.rend(), path.rbegin(),
+                    [](char a, char b) {
+                      return std::tolower(a) == std::tolower(b);
+                    });
+}
+
+ManifestFormat getManifestFormat(const std::string& manifestPath) {
+  if (hasExtension(manifestPath, ".csv")) return ManifestFormat::Csv;
+  if (hasExtension(manifestPath, MANIFEST_FILE_EXTENSION))
+    return ManifestFormat::Binary;
+  return ManifestFormat::Unknown;
+}
+
+// Field of a csv line, without surrounding blanks
+struct CsvField {
+  const char* pBegin;
+  const char* pEnd;
+  bool is(const char* text) const {
+    size_t size = strlen(text);
+    return size_t(pEnd - pBegin) == size && !memcmp(pBegin, text, size);
+  }
+};
+
+static void splitCsvLine(const char* pBegin, const char* pEnd,
+                         vector<CsvField>& fields) {
+  auto isBlank = [](char c) { return c == ' ' || c == '\t' || c == '\r'; };
+  fields.clear();
+  while (true) {
+    const char* pComma =
+        static_cast<const char*>(memchr(pBegin, ',', pEnd - pBegin));
+    const char* pFieldEnd = pComma ? pComma : pEnd;
+    CsvField field = {pBegin, pFieldEnd};
+    while (field.pBegin < field.pEnd && isBlank(*field.pBegin)) field.pBegin++;
+    while (field.pEnd > field.pBegin && isBlank(field.pEnd[-1])) field.pEnd--;
+    fields.push_back(field);
+    if (!pComma) break;
+    pBegin = pComma + 1;
+  }
+}
+
+// The mapped file is not null terminated, so numbers are copied out before
+// strtof and strtol see them
+static bool parseCsvNumber(const CsvField& field, float& value) {
+  char text[64];
+  size_t size = size_t(field.pEnd - field.pBegin);
+  if (size == 0 || size >= sizeof(text)) return false;
+  memcpy(text, field.pBegin, size);
+  text[size] = '\0';
+  char* pEnd;
+  value = strtof(text, &pEnd);
+  return pEnd == text + size;
+}
+
+static bool parseCsvIndex(const CsvField& field, int& value) {
+  char text[32];
+  size_t size = size_t(field.pEnd - field.pBegin);
+  if (size == 0 || size >= sizeof(text)) return false;
+  memcpy(text, field.pBegin, size);
+  text[size] = '\0';
+  char* pEnd;
+  long index = strtol(text, &pEnd, 10);
+  value = int(index);
+  return pEnd == text + size && index >= 0 && index <= INT32_MAX;
+}
+
+static bool readCsvManifest(const MappedFile& file, ManifestShotFn& shotFn,
+                            ManifestPairFn& pairFn, std::string& error) {
+  const char* pData = file.getData();
+  const char* pEnd = pData + file.getSize();
+  vector<CsvField> fields;
+  ShotFields shotFields;
+  CameraShot shot;
+  size_t lineId = 0;
+  auto fail = [&](const std::string& what) {
+    error = "line " + std::to_string(lineId) + " " + what;
+    return false;
+  };
+  while (pData < pEnd) {
+    const char* pLineEnd =
+        static_cast<const char*>(memchr(pData, '\n', pEnd - pData));
+    if (!pLineEnd) pLineEnd = pEnd;
+    splitCsvLine(pData, pLineEnd, fields);
+    pData = pLineEnd + 1;
+    lineId++;
+    if (fields[0].pBegin == fields[0].pEnd && fields.size() == 1) continue;
+    if (*fields[0].pBegin == '#') continue;
+
+    if (fields[0].is("shot")) {
+      if (fields.size() < 2) return fail("has a shot without type");
+      shotFields.type.assign(fields[1].pBegin, fields[1].pEnd);
+      // Numbers go to the fields of the type, fieldsToShot checks them
+      size_t numbersNum = fields.size() - 2;
+      vector<float>* parts[3] = {&shotFields.eye, &shotFields.lookat,
+                                 &shotFields.up};
+      size_t partsNum = 3, partSize = 3;
+      if (shotFields.type == "opencv") {
+        parts[0] = &shotFields.matrix;
+        partsNum = 1, partSize = 16;
+      } else if (shotFields.type != "lookat") {
+        fieldsToShot(shotFields, shot, error);
+        return fail(error);
+      }
+      if (numbersNum != partsNum * partSize)
+        return fail("has a " + shotFields.type + " shot of " +
+                    std::to_string(numbersNum) + " numbers");
+      for (size_t partId = 0; partId < partsNum; partId++) {
+        auto& part = *parts[partId];
+        part.resize(partSize);
+        for (size_t i = 0; i < partSize; i++)
+          if (!parseCsvNumber(fields[2 + partId * partSize + i], part[i]))
+            return fail("has a bad number");
+      }
+      if (!fieldsToShot(shotFields, shot, error)) return fail(error);
+      shotFn(shot);
+    } else if (fields[0].is("pair")) {
+      int ref, src;
+      if (fields.size() != 3 || !parseCsvIndex(fields[1], ref) ||
+          !parseCsvIndex(fields[2], src))
+        return fail("needs a pair of ref and src indices");
+      pairFn(ref, src);
+    } else {
+      return fail("is neither a shot nor a pair");
+    }
+  }
+  return true;
+}
+
+static const char manifestFileMagic[8] = "BINVIEW";
+
+static bool readBinaryManifest(const MappedFile& file, ManifestShotFn& shotFn,
+                               ManifestPairFn& pairFn, std::string& error) {
+  ManifestFileHeader header;
+  if (file.getSize() < sizeof(header)) {
+    error = "is too small for a manifest";
+    return false;
+  }
+  const char* pData = file.getData();
+  memcpy(&header, pData, sizeof(header));
+  auto fits = [&](uint64_t offset, uint64_t num, size_t stride) {
+    return offset <= file.getSize() &&
+           num <= (file.getSize() - offset) / stride;
+  };
+  if (memcmp(header.magic, manifestFileMagic, sizeof(header.magic)) != 0 ||
+      header.version != MANIFEST_FILE_VERSION ||
+      !fits(header.shotsOffset, header.shotsNum, sizeof(ManifestShot)) ||
+      !fits(header.pairsOffset, header.pairsNum, 2 * sizeof(int32_t))) {
+    error = "is not a valid manifest of version " +
+            std::to_string(MANIFEST_FILE_VERSION);
+    return false;
+  }
+
+  CameraShot shot;
+  for (uint32_t shotId = 0; shotId < header.shotsNum; shotId++) {
+    ManifestShot record;
+    memcpy(&record, pData + header.shotsOffset + shotId * sizeof(record),
+           sizeof(record));
+    shot.eye = record.eye;
+    shot.lookat = record.lookat;
+    shot.up = record.up;
+    shotFn(shot);
+  }
+  for (uint32_t pairId = 0; pairId < header.pairsNum; pairId++) {
+    int32_t pair[2];
+    memcpy(pair, pData + header.pairsOffset + pairId * sizeof(pair),
+           sizeof(pair));
+    if (pair[0] < 0 || pair[1] < 0) {
+      error = "has a negative index in pair " + std::to_string(pairId);
+      return false;
+    }
+    pairFn(pair[0], pair[1]);
+  }
+  return true;
+}
+
+bool readManifest(const std::string& manifestPath, ManifestShotFn shotFn,
+                  ManifestPairFn pairFn, std::string& error) {
+  ManifestFormat format = getManifestFormat(manifestPath);
+  if (format == ManifestFormat::Unknown) {
+    error = "is neither a csv nor a " MANIFEST_FILE_EXTENSION " manifest";
+    return false;
+  }
+  MappedFile file;
+  if (!file.open(manifestPath)) {
+    error = "cannot be read";
+    return false;
+  }
+  if (format == ManifestFormat::Csv)
+    return readCsvManifest(file, shotFn, pairFn, error);
+  return readBinaryManifest(file, shotFn, pairFn, error);
+}
+
+bool writeManifestFile(const std::string& filename,
+                       const vector<CameraShot>& shots,
+                       const vector<std::pair<int, int>>& pairs) {
+  ManifestFileHeader header = {};
+  memcpy(header.magic, manifestFileMagic, sizeof(header.magic));
+  header.version = MANIFEST_FILE_VERSION;
+  header.shotsNum = static_cast<uint32_t>(shots.size());
+  header.pairsNum = static_cast<uint32_t>(pairs.size());
+  header.shotsOffset = sizeof(header);
+  header.pairsOffset = header.shotsOffset + shots.size() * sizeof(ManifestShot);
+
+  vector<char> bytes(header.pairsOffset + pairs.size() * 2 * sizeof(int32_t));
+  memcpy(bytes.data(), &header, sizeof(header));
+  char* pShots = bytes.data() + header.shotsOffset;
+  for (const auto& shot : shots) {
+    ManifestShot record = {shot.eye, shot.lookat, shot.up};
+    memcpy(pShots, &record, sizeof(record));
+    pShots += sizeof(record);
+  }
+  char* pPairs = bytes.data() + header.pairsOffset;
+  for (const auto& pair : pairs) {
+    int32_t record[2] = {pair.first, pair.second};
+    memcpy(pPairs, record, sizeof(record));
+    pPairs += sizeof(record);
+  }
+
+  std::ofstream file(filename, std::ios::binary);
+  file.write(bytes.data(), std::streamsize(bytes.size()));
+  if (!file) {
+    LOG_ERROR("{}: cannot write [{}]", "Manifest", filename);
+    return false;
+  }
+  return true;
+}
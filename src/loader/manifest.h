@@ -0,0 +1,61 @@
+#pragma once
+
+#include <core/camera.h>
+#include "scene_sax.h"
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+using std::vector;
+
+// Camera pose of the fields of a lookat or opencv shot, the same for shots
+// of a scene file and of a manifest. False with error on bad fields.
+bool fieldsToShot(const ShotFields& fields, CameraShot& shot,
+                  std::string& error);
+
+// Shots and pairs of a large dataset can live in a manifest referenced by
+// the scene file instead of its shots and pairs arrays. A csv manifest has
+// one record per line, fields separated by commas:
+//
+//   # comment
+//   shot,lookat,<eye xyz>,<lookat xyz>,<up xyz>
+//   shot,opencv,<16 numbers, row major world to camera matrix>
+//   pair,<ref>,<src>
+//
+// A binary manifest, written by the manifest_convert tool, holds the camera
+// poses and pairs as plain arrays.
+#define MANIFEST_FILE_EXTENSION ".views"
+#define MANIFEST_FILE_VERSION 1
+
+struct ManifestFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t shotsNum;
+  uint32_t pairsNum;
+  uint32_t padding;
+  uint64_t shotsOffset;  // of shotsNum ManifestShot
+  uint64_t pairsOffset;  // of pairsNum ref and src int32 pairs
+};
+
+struct ManifestShot {
+  vec3 eye;
+  vec3 lookat;
+  vec3 up;
+};
+
+enum class ManifestFormat { Csv, Binary, Unknown };
+// Chosen by extension
+ManifestFormat getManifestFormat(const std::string& manifestPath);
+
+// Records are handed over in file order while the mapped file is read, no
+// copy of the whole manifest is made
+using ManifestShotFn = std::function<void(const CameraShot& shot)>;
+using ManifestPairFn = std::function<void(int ref, int src)>;
+bool readManifest(const std::string& manifestPath, ManifestShotFn shotFn,
+                  ManifestPairFn pairFn, std::string& error);
+
+bool writeManifestFile(const std::string& filename,
+                       const vector<CameraShot>& shots,
+                       const vector<std::pair<int, int>>& pairs);
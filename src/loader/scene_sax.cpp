@@ -0,0 +1,153 @@
+#include "scene_sax.h"
+
+using nlohmann::json;
+
+json* SceneSax::addValue(json&& value) {
+  if (m_stack.empty()) {
+    m_root = std::move(value);
+    return &m_root;
+  }
+  // Only the innermost open container grows, so pointers to the outer ones
+  // on the stack stay valid
+  json& parent = *m_stack.back();
+  if (parent.is_array()) {
+    parent.push_back(std::move(value));
+    return &parent.back();
+  }
+  json& slot = parent[m_key];
+  slot = std::move(value);
+  return &slot;
+}
+
+void SceneSax::addNumber(double value) {
+  if (m_stream == Stream::Pairs && m_streamDepth == 1 && m_pIndex)
+    *m_pIndex = int(value);
+  else if (m_stream == Stream::Shots && m_streamDepth == 2 && m_pField)
+    m_pField->push_back(float(value));
+}
+
+bool SceneSax::null() {
+  if (m_stream == Stream::None) addValue(json(nullptr));
+  return true;
+}
+
+bool SceneSax::boolean(bool val) {
+  if (m_stream == Stream::None) addValue(json(val));
+  return true;
+}
+
+bool SceneSax::number_integer(number_integer_t val) {
+  if (m_stream == Stream::None)
+    addValue(json(val));
+  else
+    addNumber(double(val));
+  return true;
+}
+
+bool SceneSax::number_unsigned(number_unsigned_t val) {
+  if (m_stream == Stream::None)
+    addValue(json(val));
+  else
+    addNumber(double(val));
+  return true;
+}
+
+bool SceneSax::number_float(number_float_t val, const string_t&) {
+  if (m_stream == Stream::None)
+    addValue(json(val));
+  else
+    addNumber(val);
+  return true;
+}
+
+bool SceneSax::string(string_t& val) {
+  if (m_stream == Stream::None)
+    addValue(json(std::move(val)));
+  else if (m_stream == Stream::Shots && m_streamDepth == 1 && m_isType)
+    m_shot.type = std::move(val);
+  return true;
+}
+
+bool SceneSax::binary(binary_t& val) {
+  if (m_stream == Stream::None) addValue(json::binary(std::move(val)));
+  return true;
+}
+
+bool SceneSax::start_object(std::size_t) {
+  if (m_stream != Stream::None) {
+    // New element, fields keep their capacity across shots
+    if (++m_streamDepth == 1) {
+      m_shot.type.clear();
+      m_shot.eye.clear();
+      m_shot.lookat.clear();
+      m_shot.up.clear();
+      m_shot.matrix.clear();
+      m_ref = m_src = -1;
+      m_isType = false;
+      m_pField = nullptr;
+      m_pIndex = nullptr;
+    }
+    return true;
+  }
+  m_stack.push_back(addValue(json::object()));
+  return true;
+}
+
+bool SceneSax::key(string_t& val) {
+  if (m_stream == Stream::None) {
+    m_key = val;
+  } else if (m_streamDepth == 1) {
+    // Resolved once per key rather than per number
+    m_isType = val == "type";
+    m_pField = val == "eye"      ? &m_shot.eye
+               : val == "lookat" ? &m_shot.lookat
+               : val == "up"     ? &m_shot.up
+               : val == "matrix" ? &m_shot.matrix
+                                 : nullptr;
+    m_pIndex = val == "ref" ? &m_ref : val == "src" ? &m_src : nullptr;
+  }
+  return true;
+}
+
+bool SceneSax::end_object() {
+  if (m_stream != Stream::None) {
+    if (m_streamDepth-- == 1) {
+      if (m_stream == Stream::Shots) m_shotFn(m_shot);
+      if (m_stream == Stream::Pairs) m_pairFn(m_ref, m_src);
+    }
+    return true;
+  }
+  m_stack.pop_back();
+  return true;
+}
+
+bool SceneSax::start_array(std::size_t) {
+  if (m_stream != Stream::None) {
+    m_streamDepth++;
+    return true;
+  }
+  // Top level shots and pairs stay empty in the document
+  if (m_stack.size() == 1 && (m_key == "shots" || m_key == "pairs")) {
+    addValue(json::array());
+    m_stream = m_key == "shots" ? Stream::Shots : Stream::Pairs;
+    m_streamDepth = 0;
+    return true;
+  }
+  m_stack.push_back(addValue(json::array()));
+  return true;
+}
+
+bool SceneSax::end_array() {
+  if (m_stream != Stream::None) {
+    if (m_streamDepth-- == 0) m_stream = Stream::None;
+    return true;
+  }
+  m_stack.pop_back();
+  return true;
+}
+
+bool SceneSax::parse_error(std::size_t, const std::string&,
+                           const nlohmann::detail::exception& ex) {
+  m_error = ex.what();
+  return false;
+}
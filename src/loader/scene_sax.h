@@ -0,0 +1,68 @@
+#pragma once
+
+#include <ext/json.hpp>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Fields of one element of the shots array of a scene file
+struct ShotFields {
+  std::string type;
+  std::vector<float> eye, lookat, up, matrix;
+};
+
+// Sax handler of a scene file. It builds the document like json::parse,
+// except for the top level shots and pairs arrays, which make up almost all
+// of large scene files. Their elements are handed over as plain fields as
+// soon as they are parsed, no json value is built for them, and the arrays
+// are left empty in the document.
+class SceneSax : public nlohmann::json_sax<nlohmann::json> {
+public:
+  using ShotFn = std::function<void(const ShotFields& shot)>;
+  // -1 for a missing index
+  using PairFn = std::function<void(int ref, int src)>;
+  SceneSax(nlohmann::json& root, ShotFn shotFn, PairFn pairFn)
+      : m_root(root), m_shotFn(shotFn), m_pairFn(pairFn) {}
+  const std::string& getError() const { return m_error; }
+
+  bool null() override;
+  bool boolean(bool val) override;
+  bool number_integer(number_integer_t val) override;
+  bool number_unsigned(number_unsigned_t val) override;
+  bool number_float(number_float_t val, const string_t& s) override;
+  bool string(string_t& val) override;
+  bool binary(binary_t& val) override;
+  bool start_object(std::size_t elements) override;
+  bool key(string_t& val) override;
+  bool end_object() override;
+  bool start_array(std::size_t elements) override;
+  bool end_array() override;
+  bool parse_error(std::size_t position, const std::string& lastToken,
+                   const nlohmann::detail::exception& ex) override;
+
+private:
+  enum class Stream { None, Shots, Pairs };
+  nlohmann::json* addValue(nlohmann::json&& value);
+  void addNumber(double value);
+
+private:
+  nlohmann::json& m_root;
+  ShotFn m_shotFn;
+  PairFn m_pairFn;
+  std::string m_error{};
+  // Document
+  std::vector<nlohmann::json*> m_stack{};  // open objects and arrays
+  std::string m_key{};                     // of the next value of an object
+  // Streamed array, depth 0 is the array itself, 1 an element and 2 an
+  // array of numbers in that element
+  Stream m_stream{Stream::None};
+  int m_streamDepth{0};
+  ShotFields m_shot{};
+  int m_ref{-1};
+  int m_src{-1};
+  // Destination of the values of the current key of an element
+  bool m_isType{false};
+  std::vector<float>* m_pField{nullptr};
+  int* m_pIndex{nullptr};
+};
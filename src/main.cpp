@@ -1,4 +1,5 @@
 #include "tracer/tracer.h"
+#include "tracer/tracer_cpu.h"
 
 #include <ext/json.hpp>
 #include <nvh/inputparser.h>
@@ -20,6 +21,40 @@ int main(int argc, char** argv) {
   if (parser.exist("--gpu_id")) tis.gpuId = parser.getInt("--gpu_id");
   tis.outputname = parser.getString("--out", "asuna_out.hdr");
   tis.scenefile = parser.getString("--scene", "PLEASE_SET_SCENE_PATH");
+  tis.backend = parser.getString("--backend", "gpu");
+  if (parser.exist("--benchmark")) tis.benchmark = true;
+  if (parser.exist("--threads")) tis.threads = parser.getInt("--threads");
+  if (parser.exist("--tile_size")) tis.tileSize = parser.getInt("--tile_size");
+  tis.asCache = parser.getString("--as_cache", "");
+  if (parser.exist("--batch")) tis.batchSize = parser.getInt("--batch");
+  if (parser.exist("--ref_cache")) tis.refCache = true;
+  if (parser.exist("--fan_out")) tis.fanOut = true;
+  if (parser.exist("--bidirectional")) tis.bidirectional = true;
+  string format = parser.getString("--format", "rgba32f");
+  if (format == "rg32f")
+    tis.outputFormat = OutputFormat::Rg32f;
+  else if (format == "rg16f")
+    tis.outputFormat = OutputFormat::Rg16f;
+  else if (format != "rgba32f")
+    LOG_WARN("{}: unknown output format [{}], using rgba32f", "Main", format);
+  string compression = parser.getString("--exr_compression", "zip");
+  if (compression == "none")
+    tis.exrCompression = ExrCompression::None;
+  else if (compression == "piz")
+    tis.exrCompression = ExrCompression::Piz;
+  else if (compression == "zips")
+    tis.exrCompression = ExrCompression::Zips;
+  else if (compression != "zip")
+    LOG_WARN("{}: unknown exr compression [{}], using zip", "Main",
+             compression);
+
+  if (tis.backend == "cpu") {
+    TracerCpu asuna;
+    asuna.init(tis);
+    asuna.run();
+    asuna.deinit();
+    return 0;
+  }
 
   Tracer asuna;
   asuna.init(tis);
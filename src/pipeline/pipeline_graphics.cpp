@@ -11,6 +11,7 @@
 #include "nvvk/images_vk.hpp"
 #include "nvvk/renderpasses_vk.hpp"
 
+#include <algorithm>
 #include <cstdint>
 #include <vector>
 
@@ -26,8 +27,30 @@ void PipelineGraphics::init(ContextAware* pContext, Scene* pScene) {
   updateGraphicsDescriptorSet();
 }
 
+// Cameras and pairs are resident since init, pairs are selected by push
+// constants of the raytrace pipeline. Only the visibility mask is cleared
+// for the flags of the next batch, which the shaders set bit by bit.
 void PipelineGraphics::run(const VkCommandBuffer& cmdBuf) {
-  updateCameraBuffer(cmdBuf);
+  if (!m_pContext->getCompactOutputMode()) return;
+  // After the shaders and the readback of the previous batch
+  VkBufferMemoryBarrier barrier{VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = m_bMask.buffer;
+  barrier.offset = 0;
+  barrier.size = VK_WHOLE_SIZE;
+  auto rtStage = VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+  vkCmdPipelineBarrier(cmdBuf, rtStage | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1,
+                       &barrier, 0, nullptr);
+  vkCmdFillBuffer(cmdBuf, m_bMask.buffer, 0, VK_WHOLE_SIZE, 0);
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask =
+      VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, rtStage, 0, 0,
+                       nullptr, 1, &barrier, 0, nullptr);
 }
 
 void PipelineGraphics::deinit() {
@@ -35,9 +58,15 @@ void PipelineGraphics::deinit() {
   auto m_device = m_pContext->getDevice();
   auto m_cmdPool = m_pContext->getCommandPool();
 
+  for (auto& view : m_colorArrayViews)
+    vkDestroyImageView(m_device, view, nullptr);
+  m_colorArrayViews.clear();
   for (auto& m_tColor : m_tColors) m_alloc.destroy(m_tColor);
+  for (auto& m_tGbuffer : m_tGbuffers) m_alloc.destroy(m_tGbuffer);
   m_alloc.destroy(m_tDepth);
-  m_alloc.destroy(m_bCamera);
+  m_alloc.destroy(m_bMask);
+  m_alloc.destroy(m_bCameras);
+  m_alloc.destroy(m_bPairs);
   vkDestroyRenderPass(m_device, m_offscreenRenderPass, nullptr);
   vkDestroyFramebuffer(m_device, m_offscreenFramebuffer, nullptr);
   m_offscreenRenderPass = VK_NULL_HANDLE;
@@ -46,62 +75,6 @@ void PipelineGraphics::deinit() {
   PipelineAware::deinit();
 }
 
-void PipelineGraphics::updateCameraBuffer(const VkCommandBuffer& cmdBuf) {
-  // Upload updated camera information to GPU
-  // Prepare new UBO contents on host.
-  auto m_size = m_pContext->getSize();
-  GpuCameraPair hostCamera = {};
-
-  auto pairRefSrc = m_pScene->getPair();
-  auto ref = pairRefSrc.first;
-  auto src = pairRefSrc.second;
-
-  m_pScene->setShot(ref);
-  auto& camRef = m_pScene->getCamera();
-  hostCamera.ref = camRef.toGpuStruct();
-
-  m_pScene->setShot(src);
-  auto& camSrc = m_pScene->getCamera();
-  hostCamera.src = camSrc.toGpuStruct();
-
-  // UBO on the device, and what stages access it.
-  VkBuffer deviceUBO = m_bCamera.buffer;
-  auto uboUsageStages = VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
-                        VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
-
-  if (!m_pContext->getOfflineMode()) {
-    // Ensure that the modified UBO is not visible to previous frames.
-    VkBufferMemoryBarrier beforeBarrier{
-        VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
-    beforeBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    beforeBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    beforeBarrier.buffer = deviceUBO;
-    beforeBarrier.offset = 0;
-    beforeBarrier.size = sizeof(GpuCameraPair);
-    vkCmdPipelineBarrier(cmdBuf, uboUsageStages, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                         VK_DEPENDENCY_DEVICE_GROUP_BIT, 0, nullptr, 1,
-                         &beforeBarrier, 0, nullptr);
-  }
-
-  // Schedule the host-to-device upload. (hostUBO is copied into the cmd
-  // buffer so it is okay to deallocate when the function returns).
-  vkCmdUpdateBuffer(cmdBuf, m_bCamera.buffer, 0, sizeof(GpuCameraPair),
-                    &hostCamera);
-
-  if (!m_pContext->getOfflineMode()) {
-    // Making sure the updated UBO will be visible.
-    VkBufferMemoryBarrier afterBarrier{VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
-    afterBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    afterBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-    afterBarrier.buffer = deviceUBO;
-    afterBarrier.offset = 0;
-    afterBarrier.size = sizeof(GpuCameraPair);
-    vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT, uboUsageStages,
-                         VK_DEPENDENCY_DEVICE_GROUP_BIT, 0, nullptr, 1,
-                         &afterBarrier, 0, nullptr);
-  }
-}
-
 void PipelineGraphics::createOffscreenResources() {
   auto& m_alloc = m_pContext->getAlloc();
   auto& m_debug = m_pContext->getDebug();
@@ -110,15 +83,23 @@ void PipelineGraphics::createOffscreenResources() {
   auto m_size = m_pContext->getSize();
   auto m_graphicsQueueIndex = m_pContext->getQueueFamily();
 
+  for (auto& view : m_colorArrayViews)
+    vkDestroyImageView(m_device, view, nullptr);
+  m_colorArrayViews.clear();
   for (auto& m_tColor : m_tColors) m_alloc.destroy(m_tColor);
   m_tColors.clear();
+  for (auto& m_tGbuffer : m_tGbuffers) m_alloc.destroy(m_tGbuffer);
+  m_tGbuffers.clear();
+  m_alloc.destroy(m_bMask);
   m_alloc.destroy(m_tDepth);
   vkDestroyRenderPass(m_device, m_offscreenRenderPass, nullptr);
   vkDestroyFramebuffer(m_device, m_offscreenFramebuffer, nullptr);
   m_offscreenRenderPass = VK_NULL_HANDLE;
   m_offscreenFramebuffer = VK_NULL_HANDLE;
 
-  VkFormat colorFormat{VK_FORMAT_R32G32B32A32_SFLOAT};
+  VkFormat colorFormat = m_pContext->getOutputImageFormat();
+  // The reference view cache keeps full positions whatever the output
+  VkFormat gbufferFormat{VK_FORMAT_R32G32B32A32_SFLOAT};
   VkFormat depthFormat = nvvk::findDepthFormat(m_physicalDevice);
 
   // Creating the color image
@@ -128,20 +109,69 @@ void PipelineGraphics::createOffscreenResources() {
       auto colorCreateInfo = nvvk::makeImage2DCreateInfo(
           m_size, colorFormat,
           VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
-              VK_IMAGE_USAGE_STORAGE_BIT);
+              VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+      colorCreateInfo.arrayLayers = channelId < m_pContext->getBatchImagesNum()
+                                        ? m_pContext->getBatchSize()
+                                        : 1;
       nvvk::Image image = m_alloc.createImage(colorCreateInfo);
+      // First layer for post processing and the framebuffer
       VkImageViewCreateInfo ivInfo =
           nvvk::makeImageViewCreateInfo(image.image, colorCreateInfo);
+      ivInfo.subresourceRange.layerCount = 1;
       auto texture = m_alloc.createTexture(image, ivInfo, sampler);
       texture.descriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
       m_tColors.emplace_back(texture);
+      // All layers for the ray generation shader
+      ivInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+      ivInfo.subresourceRange.layerCount = colorCreateInfo.arrayLayers;
+      VkImageView arrayView;
+      vkCreateImageView(m_device, &ivInfo, nullptr, &arrayView);
+      m_colorArrayViews.push_back(arrayView);
+    }
+  }
+
+  // Creating the reference view cache
+  {
+    bool refCache = m_pContext->getRefCacheMode();
+    auto gbufferCreateInfo = nvvk::makeImage2DCreateInfo(
+        refCache ? m_size : VkExtent2D{1, 1}, gbufferFormat,
+        VK_IMAGE_USAGE_STORAGE_BIT);
+    gbufferCreateInfo.arrayLayers = refCache ? m_pContext->getBatchSize() : 1;
+    for (uint gbufferId = 0; gbufferId < GbufferNum; gbufferId++) {
+      nvvk::Image image = m_alloc.createImage(gbufferCreateInfo);
+      NAME2_VK(image.image, "Reference View Cache");
+      VkImageViewCreateInfo ivInfo =
+          nvvk::makeImageViewCreateInfo(image.image, gbufferCreateInfo);
+      ivInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+      ivInfo.subresourceRange.layerCount = gbufferCreateInfo.arrayLayers;
+      auto texture = m_alloc.createTexture(image, ivInfo);
+      texture.descriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+      m_tGbuffers.emplace_back(texture);
     }
   }
 
+  // Creating the visibility mask, one plane per flag of the output images.
+  // A single word keeps the binding valid when the output is not compact.
+  {
+    VkDeviceSize maskSize = m_pContext->getMaskPlanesNum() *
+                            m_pContext->getBatchSize() *
+                            m_pContext->getMaskLayerSize();
+    m_bMask = m_alloc.createBuffer(
+        std::max(maskSize, VkDeviceSize(sizeof(uint32_t))),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+            VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+            VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    m_debug.setObjectName(m_bMask.buffer, "Visibility Mask");
+  }
+
+  // Offline mode only reads the color images back, the depth buffer, render
+  // pass and framebuffer are for rasterizing online
+  bool offline = m_pContext->getOfflineMode();
+
   // Creating the depth buffer
   auto depthCreateInfo = nvvk::makeImage2DCreateInfo(
       m_size, depthFormat, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
-  {
+  if (!offline) {
     nvvk::Image image = m_alloc.createImage(depthCreateInfo);
     NAME2_VK(image.image, "Offscreen Depth");
 
@@ -155,7 +185,7 @@ void PipelineGraphics::createOffscreenResources() {
     m_tDepth = m_alloc.createTexture(image, depthStencilView);
   }
 
-  // Setting the image layout for both color and depth
+  // Setting the image layout of all images
   {
     auto& qGCT1 = m_pContext->getParallelQueues()[0];
     nvvk::CommandPool cmdBufGet(m_pContext->getDevice(), qGCT1.familyIndex,
@@ -166,13 +196,19 @@ void PipelineGraphics::createOffscreenResources() {
       nvvk::cmdBarrierImageLayout(cmdBuf, m_tColor.image,
                                   VK_IMAGE_LAYOUT_UNDEFINED,
                                   VK_IMAGE_LAYOUT_GENERAL);
-    nvvk::cmdBarrierImageLayout(
-        cmdBuf, m_tDepth.image, VK_IMAGE_LAYOUT_UNDEFINED,
-        VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-        VK_IMAGE_ASPECT_DEPTH_BIT);
+    for (auto& m_tGbuffer : m_tGbuffers)
+      nvvk::cmdBarrierImageLayout(cmdBuf, m_tGbuffer.image,
+                                  VK_IMAGE_LAYOUT_UNDEFINED,
+                                  VK_IMAGE_LAYOUT_GENERAL);
+    if (!offline)
+      nvvk::cmdBarrierImageLayout(
+          cmdBuf, m_tDepth.image, VK_IMAGE_LAYOUT_UNDEFINED,
+          VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+          VK_IMAGE_ASPECT_DEPTH_BIT);
 
     cmdBufGet.submitAndWait(cmdBuf);
   }
+  if (offline) return;
 
   // Creating a renderpass for the offscreen
   m_offscreenRenderPass = nvvk::createRenderPass(
@@ -208,6 +244,16 @@ void PipelineGraphics::createGraphicsDescriptorSetLayout() {
   outBind.addBinding(OutputBindings::OutputStore,
                      VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, NUM_OUTPUT_IMAGES,
                      VK_SHADER_STAGE_ALL);
+  outBind.addBinding(OutputBindings::OutputGbuffer,
+                     VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, GbufferNum,
+                     VK_SHADER_STAGE_RAYGEN_BIT_KHR);
+  outBind.addBinding(OutputBindings::OutputMask,
+                     VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                     VK_SHADER_STAGE_RAYGEN_BIT_KHR);
+  // Sampled images, read whatever their format
+  outBind.addBinding(OutputBindings::OutputFlows,
+                     VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                     NUM_OUTPUT_IMAGES, VK_SHADER_STAGE_RAYGEN_BIT_KHR);
   // Creation
   outLayout = outBind.createLayout(m_device);
   outPool = outBind.createPool(m_device, 1);
@@ -219,11 +265,15 @@ void PipelineGraphics::createGraphicsDescriptorSetLayout() {
   auto& scenePool = sceneWrap.getDescriptorPool();
   auto& sceneSet = sceneWrap.getDescriptorSet();
   auto& sceneLayout = sceneWrap.getDescriptorSetLayout();
-  // Camera matrices
+  // Camera matrices of all shots
   sceneBind.addBinding(
-      SceneBindings::SceneCamera, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1,
+      SceneBindings::SceneCamera, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
       VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_RAYGEN_BIT_KHR |
           VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR);
+  // Shots of all pairs
+  sceneBind.addBinding(SceneBindings::ScenePairs,
+                       VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+                       VK_SHADER_STAGE_RAYGEN_BIT_KHR);
   // Instance description
   sceneBind.addBinding(
       SceneBindings::SceneInstances, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
@@ -239,11 +289,20 @@ void PipelineGraphics::createCameraBuffer() {
   auto& m_alloc = m_pContext->getAlloc();
   auto& m_debug = m_pContext->getDebug();
 
-  m_bCamera = m_alloc.createBuffer(
-      sizeof(GpuCameraPair),
-      VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-  m_debug.setObjectName(m_bCamera.buffer, "Camera");
+  // Built once on the host, no batch touches them afterwards
+  auto& qGCT1 = m_pContext->getParallelQueues()[0];
+  nvvk::CommandPool cmdBufGet(m_pContext->getDevice(), qGCT1.familyIndex,
+                              VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+                              qGCT1.queue);
+  auto cmdBuf = cmdBufGet.createCommandBuffer();
+  m_bCameras = m_alloc.createBuffer(cmdBuf, m_pScene->getGpuCameras(),
+                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  m_bPairs = m_alloc.createBuffer(cmdBuf, m_pScene->getGpuPairs(),
+                                  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  cmdBufGet.submitAndWait(cmdBuf);
+  m_alloc.finalizeAndReleaseStaging();
+  m_debug.setObjectName(m_bCameras.buffer, "Cameras");
+  m_debug.setObjectName(m_bPairs.buffer, "Pairs");
 }
 
 void PipelineGraphics::updateGraphicsDescriptorSet() {
@@ -257,9 +316,12 @@ void PipelineGraphics::updateGraphicsDescriptorSet() {
   auto& sceneLayout = sceneWrap.getDescriptorSetLayout();
   vector<VkWriteDescriptorSet> writesScene;
   // Camera matrices and scene description
-  VkDescriptorBufferInfo dbiCamera{m_bCamera.buffer, 0, VK_WHOLE_SIZE};
+  VkDescriptorBufferInfo dbiCamera{m_bCameras.buffer, 0, VK_WHOLE_SIZE};
   writesScene.emplace_back(
       sceneBind.makeWrite(sceneSet, SceneBindings::SceneCamera, &dbiCamera));
+  VkDescriptorBufferInfo dbiPairs{m_bPairs.buffer, 0, VK_WHOLE_SIZE};
+  writesScene.emplace_back(
+      sceneBind.makeWrite(sceneSet, SceneBindings::ScenePairs, &dbiPairs));
   // Instance description
   VkDescriptorBufferInfo dbiSceneDesc{m_pScene->getInstancesDescriptor(), 0,
                                       VK_WHOLE_SIZE};
@@ -278,12 +340,27 @@ void PipelineGraphics::updateGraphicsDescriptorSet() {
   vector<VkWriteDescriptorSet> writesOut;
   array<VkDescriptorImageInfo, NUM_OUTPUT_IMAGES> imageInfos{};
   for (uint channelId = 0; channelId < NUM_OUTPUT_IMAGES; channelId++) {
-    VkDescriptorImageInfo imageInfo{
-        {}, m_tColors[channelId].descriptor.imageView, VK_IMAGE_LAYOUT_GENERAL};
+    VkDescriptorImageInfo imageInfo{{}, m_colorArrayViews[channelId],
+                                    VK_IMAGE_LAYOUT_GENERAL};
     imageInfos[channelId] = imageInfo;
   }
   writesOut.push_back(outBind.makeWriteArray(
       outSet, OutputBindings::OutputStore, imageInfos.data()));
+  array<VkDescriptorImageInfo, NUM_OUTPUT_IMAGES> flowInfos{};
+  for (uint channelId = 0; channelId < NUM_OUTPUT_IMAGES; channelId++)
+    flowInfos[channelId] = {m_tColors[channelId].descriptor.sampler,
+                            m_colorArrayViews[channelId],
+                            VK_IMAGE_LAYOUT_GENERAL};
+  writesOut.push_back(outBind.makeWriteArray(
+      outSet, OutputBindings::OutputFlows, flowInfos.data()));
+  array<VkDescriptorImageInfo, GbufferNum> gbufferInfos{};
+  for (uint gbufferId = 0; gbufferId < GbufferNum; gbufferId++)
+    gbufferInfos[gbufferId] = m_tGbuffers[gbufferId].descriptor;
+  writesOut.push_back(outBind.makeWriteArray(
+      outSet, OutputBindings::OutputGbuffer, gbufferInfos.data()));
+  VkDescriptorBufferInfo dbiMask{m_bMask.buffer, 0, VK_WHOLE_SIZE};
+  writesOut.push_back(
+      outBind.makeWrite(outSet, OutputBindings::OutputMask, &dbiMask));
   vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(writesOut.size()),
                          writesOut.data(), 0, nullptr);
 }
@@ -17,7 +17,6 @@ public:
   virtual void init(ContextAware* pContext, Scene* pScene);
   virtual void run(const VkCommandBuffer& cmdBuf);
   virtual void deinit();
-  void updateCameraBuffer(const VkCommandBuffer& cmdBuf);
   VkDescriptorImageInfo& getHdrOutImageInfo() {
     return m_tColors[0].descriptor;
   }
@@ -30,21 +29,33 @@ public:
   nvvk::Texture& getColorTexture(uint textureId) {
     return m_tColors[textureId];
   }
+  nvvk::Buffer& getMaskBuffer() { return m_bMask; }
 
 private:
-  vector<nvvk::Texture> m_tColors{};  // Canvas we draw things on
-  nvvk::Texture m_tDepth;             // Depth buffer
+  // Canvas we draw things on, one layer per pair of a batch for the images
+  // read back offline. The textures view the first layer, the array views
+  // all of them for storage.
+  vector<nvvk::Texture> m_tColors{};
+  vector<VkImageView> m_colorArrayViews{};
+  // Reference view cache, one layer per slot. A single texel keeps the
+  // bindings valid when the cache is off.
+  vector<nvvk::Texture> m_tGbuffers{};
+  // Visibility mask of the compact output formats, planes of layers of
+  // bits, see MaskPlanes
+  nvvk::Buffer m_bMask;
+  nvvk::Texture m_tDepth;  // Depth buffer
   VkRenderPass m_offscreenRenderPass{VK_NULL_HANDLE};
   VkFramebuffer m_offscreenFramebuffer{VK_NULL_HANDLE};
-  nvvk::Buffer m_bCamera;
+  nvvk::Buffer m_bCameras;  // cameras of all shots
+  nvvk::Buffer m_bPairs;    // shots of all pairs
 
 private:
   void createOffscreenResources();  // Creating an offscreen frame buffer and
                                     // the associated render pass
   void createGraphicsDescriptorSetLayout();  // Describing the layout pushed
                                              // when rendering
-  void createCameraBuffer();  // Creating the uniform buffer holding the camera
-                              // matrices
+  void createCameraBuffer();  // Uploading the cameras of all shots and the
+                              // shots of all pairs
   void updateGraphicsDescriptorSet();  // Setting up the buffers in the
                                        // descriptor set
 };
\ No newline at end of file
@@ -52,22 +52,69 @@ void PipelineRaytrace::run(const VkCommandBuffer& cmdBuf) {
   vkCmdBindDescriptorSets(cmdBuf, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR,
                           m_pipelineLayout, 0, (uint32_t)m_bindSets.size(),
                           m_bindSets.data(), 0, nullptr);
+  // Pairs of the batch, one per layer of the launch, and of fan-out loops
   static GpuPushConstantRaytrace rtsState = {};
+  rtsState.firstPairId = uint(m_pScene->getCurrentPairId());
+  rtsState.pairsNum = uint(m_pScene->getCurrentPairsNum());
   vkCmdPushConstants(cmdBuf, m_pipelineLayout, VK_SHADER_STAGE_ALL, 0,
                      sizeof(GpuPushConstantRaytrace), &rtsState);
 
-  const auto& regions = m_sbt.getRegions();
   const auto size = m_pContext->getSize();
+  // One layer per pair of the batch
+  const auto depth = uint32_t(m_pScene->getCurrentPairsNum());
+  auto traceRays = [&](RayGenGroup rayGen, uint32_t depth) {
+    // Regions of the ray generation group, miss, hit and callable groups
+    const auto regions = m_sbt.getRegions(uint32_t(rayGen));
+    // Run the ray tracing pipeline and trace rays
+    vkCmdTraceRaysKHR(cmdBuf, &regions[0], &regions[1], &regions[2],
+                      &regions[3], size.width, size.height, depth);
+  };
+  VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER};
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask =
+      VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  auto rtStage = VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+  // Both flows first, then the consistency of each direction from the two
+  // images. A direction writes the w of its image while the other reads it,
+  // hence one pass after the other.
+  if (m_pContext->getBidirectionalMode()) {
+    traceRays(RayGenGroup::Bidirectional, depth);
+    for (uint imageId = 0; imageId < 2; imageId++) {
+      vkCmdPipelineBarrier(cmdBuf, rtStage, rtStage, 0, 1, &barrier, 0,
+                           nullptr, 0, nullptr);
+      rtsState.flowImageId = imageId;
+      vkCmdPushConstants(cmdBuf, m_pipelineLayout, VK_SHADER_STAGE_ALL, 0,
+                         sizeof(GpuPushConstantRaytrace), &rtsState);
+      traceRays(RayGenGroup::Consistency, depth);
+    }
+    return;
+  }
+  // The batch is one reference view against its source views, one launch
+  // layer does them all
+  if (m_pContext->getFanOutMode()) {
+    traceRays(RayGenGroup::FanOut, 1);
+    return;
+  }
+  if (!m_pContext->getRefCacheMode()) {
+    traceRays(RayGenGroup::Correspondence, depth);
+    return;
+  }
 
-  // Run the ray tracing pipeline and trace rays
-  vkCmdTraceRaysKHR(cmdBuf,       // Command buffer
-                    &regions[0],  // Region of memory with ray generation groups
-                    &regions[1],  // Region of memory with miss groups
-                    &regions[2],  // Region of memory with hit groups
-                    &regions[3],  // Region of memory with callable groups
-                    size.width,   // Width of dispatch
-                    size.height,  // Height of dispatch
-                    1);           // Depth of dispatch
+  // Reference views not cached yet are traced into their slots by the first
+  // pair using them, the other layers of that pass return at once. Passes
+  // of consecutive batches share the cache, hence the barriers on both sides.
+  uint32_t gbufferDepth = 0;
+  for (uint32_t layerId = 0; layerId < depth; layerId++)
+    if (m_pScene->getCurrentRefTraced(layerId)) gbufferDepth = layerId + 1;
+  if (gbufferDepth > 0) {
+    vkCmdPipelineBarrier(cmdBuf, rtStage, rtStage, 0, 1, &barrier, 0, nullptr,
+                         0, nullptr);
+    traceRays(RayGenGroup::Gbuffer, gbufferDepth);
+    vkCmdPipelineBarrier(cmdBuf, rtStage, rtStage, 0, 1, &barrier, 0, nullptr,
+                         0, nullptr);
+  }
+  // Then only shadow rays and reprojection for every pair
+  traceRays(RayGenGroup::Reproject, depth);
 }
 
 void PipelineRaytrace::initRayTracing() {
@@ -145,19 +192,62 @@ void PipelineRaytrace::createRtPipeline() {
   auto& m_debug = m_pContext->getDebug();
   auto m_device = m_pContext->getDevice();
 
-  // Creating all shaders
-  enum StageIndices { RayGen, RayMiss, ShadowMiss, NumStages };
+  // Creating all shaders, ray generation in the order of RayGenGroup
+  enum StageIndices {
+    RayGen,
+    RayGenGbuffer,
+    RayGenReproject,
+    RayGenFanOut,
+    RayGenBidirectional,
+    RayGenConsistency,
+    RayMiss,
+    ShadowMiss,
+    NumStages
+  };
   array<VkPipelineShaderStageCreateInfo, NumStages + 1> stages{};
   // Raygen
   auto root = m_pContext->getRoot();
+  // Shaders writing the output images, in their variant of compact formats
+  std::string outputDir = m_pContext->getCompactOutputMode()
+                              ? "../shaders/compact/"
+                              : "../shaders/";
   auto stage = nvvk::make<VkPipelineShaderStageCreateInfo>();
   stage.pName = "main";  // All the same entry point
   stage.module = nvvk::createShaderModule(
-      m_device, nvh::loadFile("../shaders/raytrace.correspondence.rgen.spv",
+      m_device, nvh::loadFile(outputDir + "raytrace.correspondence.rgen.spv",
                               true, {root}));
   stage.stage = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
   stages[RayGen] = stage;
   NAME2_VK(stage.module, "RayGen");
+  // Raygen of the reference view cache
+  stage.module = nvvk::createShaderModule(
+      m_device,
+      nvh::loadFile("../shaders/raytrace.gbuffer.rgen.spv", true, {root}));
+  stages[RayGenGbuffer] = stage;
+  NAME2_VK(stage.module, "RayGen:Gbuffer");
+  stage.module = nvvk::createShaderModule(
+      m_device,
+      nvh::loadFile(outputDir + "raytrace.reproject.rgen.spv", true, {root}));
+  stages[RayGenReproject] = stage;
+  NAME2_VK(stage.module, "RayGen:Reproject");
+  // Raygen of fan-out batches
+  stage.module = nvvk::createShaderModule(
+      m_device,
+      nvh::loadFile(outputDir + "raytrace.fanout.rgen.spv", true, {root}));
+  stages[RayGenFanOut] = stage;
+  NAME2_VK(stage.module, "RayGen:FanOut");
+  // Raygen of bidirectional pairs
+  stage.module = nvvk::createShaderModule(
+      m_device, nvh::loadFile(outputDir + "raytrace.bidirectional.rgen.spv",
+                              true, {root}));
+  stages[RayGenBidirectional] = stage;
+  NAME2_VK(stage.module, "RayGen:Bidirectional");
+  // Consistency pass of bidirectional pairs, no ray traced
+  stage.module = nvvk::createShaderModule(
+      m_device, nvh::loadFile(outputDir + "raytrace.consistency.rgen.spv",
+                              true, {root}));
+  stages[RayGenConsistency] = stage;
+  NAME2_VK(stage.module, "RayGen:Consistency");
   // Miss
   stage.module = nvvk::createShaderModule(
       m_device,
@@ -191,8 +281,11 @@ void PipelineRaytrace::createRtPipeline() {
 
   // Raygen
   group.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
-  group.generalShader = RayGen;
-  shaderGroups.push_back(group);
+  for (uint rayGenId : {RayGen, RayGenGbuffer, RayGenReproject, RayGenFanOut,
+                        RayGenBidirectional, RayGenConsistency}) {
+    group.generalShader = rayGenId;
+    shaderGroups.push_back(group);
+  }
 
   // Miss
   group.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
@@ -25,6 +25,15 @@ public:
   virtual void run(const VkCommandBuffer& cmdBuf);
 
 private:
+  // Ray generation groups of the shader binding table
+  enum class RayGenGroup {
+    Correspondence = 0,  // primary, shadow ray and reprojection per pair
+    Gbuffer = 1,         // primary hits of a reference view into the cache
+    Reproject = 2,       // shadow ray and reprojection of cached hits
+    FanOut = 3,          // primary once, then every source view of a batch
+    Bidirectional = 4,   // flows of both directions
+    Consistency = 5,     // consistency of the flows, reading both directions
+  };
   void initRayTracing();       // Request ray tracing pipeline properties
   void createBottomLevelAS();  // Create bottom level acceleration structures
   void createTopLevelAS();     // Create top level acceleration structures
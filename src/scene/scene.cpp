@@ -5,12 +5,46 @@
 #include <nvh/timesampler.hpp>
 #include <nvvk/buffers_vk.hpp>
 #include <nvvk/commands_vk.hpp>
+#include <core/worker_pool.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <filesystem>
 #include <fstream>
+#include <mutex>
+#include <thread>
+
+// Queue family ownership transfer of buffers written on another queue
+// family. The source queue releases them, then the destination one acquires
+// them before any use.
+static void cmdTransferOwnership(VkCommandBuffer cmdBuf,
+                                 const vector<VkBuffer>& buffers,
+                                 uint32_t srcFamilyIndex,
+                                 uint32_t dstFamilyIndex, bool release) {
+  vector<VkBufferMemoryBarrier> barriers;
+  for (VkBuffer buffer : buffers) {
+    VkBufferMemoryBarrier barrier{VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
+    barrier.srcAccessMask = release ? VK_ACCESS_TRANSFER_WRITE_BIT : 0;
+    barrier.dstAccessMask = release ? 0 : VK_ACCESS_MEMORY_READ_BIT;
+    barrier.srcQueueFamilyIndex = srcFamilyIndex;
+    barrier.dstQueueFamilyIndex = dstFamilyIndex;
+    barrier.buffer = buffer;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+    barriers.push_back(barrier);
+  }
+  VkPipelineStageFlags srcStage = release ? VK_PIPELINE_STAGE_TRANSFER_BIT
+                                          : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+  VkPipelineStageFlags dstStage = release
+                                      ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT
+                                      : VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+  vkCmdPipelineBarrier(cmdBuf, srcStage, dstStage, 0, 0, nullptr,
+                       uint32_t(barriers.size()), barriers.data(), 0, nullptr);
+}
 
-void Scene::init(ContextAware* pContext) {
+void Scene::init(ContextAware* pContext, bool hostOnly) {
   m_pContext = pContext;
+  m_hostOnly = hostOnly;
   reset();
 }
 
@@ -24,20 +58,113 @@ void Scene::deinit() {
 }
 
 void Scene::submit() {
-  LOG_INFO("{}: submitting resources to gpu", "Scene");
+  loadMeshes();
+  if (!m_hostOnly) {
+    LOG_INFO("{}: submitting resources to gpu", "Scene");
+    submitToGpu();
+  }
 
-  auto& qGCT1 = m_pContext->getParallelQueues()[0];
+  // autofit
+  if (m_shots.empty()) {
+    computeSceneDimensions();
+    fitCamera();
+  }
+  setShot(0);
+
+  m_hasScene = true;
+}
+
+void Scene::loadMeshes() {
+  nvh::Stopwatch sw;
+  uint meshesNum = uint(m_meshJobs.size());
+  vector<Mesh*> pMeshes(meshesNum, nullptr);
+
+  // Parsing threads hand finished meshes over in completion order. The
+  // hardware threads left over by few meshes weld the shapes of each mesh,
+  // so that a scene never runs more threads than the hardware has.
+  std::mutex mutex;
+  std::condition_variable parsedCv;
+  vector<uint> parsed;
+  uint hardwareThreadsNum = std::max(1u, std::thread::hardware_concurrency());
+  uint threadsNum = std::max(1u, std::min(meshesNum, hardwareThreadsNum));
+  uint weldThreadsNum = std::max(1u, hardwareThreadsNum / threadsNum);
+  WorkerPool parsers;
+  parsers.init(threadsNum);
+  for (uint meshId = 0; meshId < meshesNum; meshId++)
+    parsers.submit([&, meshId]() {
+      MeshJob& job = m_meshJobs[meshId];
+      Mesh* pMesh = job.path.empty()
+                        ? new Mesh(std::move(job.data))
+                        : new Mesh(job.path, job.recomputeNormal, job.uvScale,
+                                   weldThreadsNum);
+      std::lock_guard<std::mutex> lock(mutex);
+      pMeshes[meshId] = pMesh;
+      parsed.push_back(meshId);
+      parsedCv.notify_one();
+    });
+
+  // Meanwhile this thread uploads the parsed meshes through the transfer
+  // queue, or the second gct queue when there is no transfer queue
+  nvvk::CommandPool cmdPool;
+  uint32_t uploadFamilyIndex = 0;
+  if (!m_hostOnly) {
+    auto& queues = m_pContext->getParallelQueues();
+    auto& qUpload = queues[2].queue != VK_NULL_HANDLE ? queues[2] : queues[0];
+    uploadFamilyIndex = qUpload.familyIndex;
+    cmdPool.init(m_pContext->getDevice(), qUpload.familyIndex,
+                 VK_COMMAND_POOL_CREATE_TRANSIENT_BIT, qUpload.queue);
+    m_pMeshesAlloc.assign(meshesNum, nullptr);
+  }
+  vector<uint> ready;
+  for (uint doneNum = 0; doneNum < meshesNum; doneNum += uint(ready.size())) {
+    ready.clear();
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      parsedCv.wait(lock, [&]() { return !parsed.empty(); });
+      ready.swap(parsed);
+    }
+    for (uint meshId : ready)
+      m_pMeshes[m_meshJobs[meshId].name].first = pMeshes[meshId];
+    if (!m_hostOnly) uploadMeshes(ready, cmdPool, uploadFamilyIndex);
+  }
+  parsers.deinit();
+  if (!m_hostOnly) cmdPool.deinit();
+
+  LOG_INFO("{}: loaded {} meshes on {} threads in {:.2f} ms", "Scene",
+           meshesNum, threadsNum, sw.elapsed());
+  m_meshJobs.clear();
+}
+
+void Scene::uploadMeshes(const vector<uint>& meshIds,
+                         nvvk::CommandPool& cmdPool, uint32_t familyIndex) {
+  VkCommandBuffer cmdBuf = cmdPool.createCommandBuffer();
+  uint32_t gctFamilyIndex = m_pContext->getParallelQueues()[0].familyIndex;
+  for (uint meshId : meshIds) {
+    const auto& meshName = m_meshJobs[meshId].name;
+    allocMesh(m_pContext, meshId, meshName, m_pMeshes[meshName].first, cmdBuf);
+    if (familyIndex != gctFamilyIndex)
+      cmdTransferOwnership(cmdBuf, m_pMeshesAlloc[meshId]->getBuffers(),
+                           familyIndex, gctFamilyIndex, true);
+  }
+  // Staging memory is released batch by batch, not at the end
+  cmdPool.submitAndWait(cmdBuf);
+  m_pContext->getAlloc().finalizeAndReleaseStaging();
+}
+
+void Scene::submitToGpu() {
+  auto& queues = m_pContext->getParallelQueues();
+  auto& qGCT1 = queues[0];
   nvvk::CommandPool cmdBufGet(m_pContext->getDevice(), qGCT1.familyIndex,
                               VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
                               qGCT1.queue);
   VkCommandBuffer cmdBuf = cmdBufGet.createCommandBuffer();
 
-  m_pMeshesAlloc.resize(getMeshesNum());
-  for (auto& record : m_pMeshes) {
-    const auto& meshName = record.first;
-    auto pMesh = record.second.first;
-    auto meshId = record.second.second;
-    allocMesh(m_pContext, meshId, meshName, pMesh, cmdBuf);
+  // Meshes were uploaded by loadMeshes(), acquire them on this family
+  auto& qUpload = queues[2].queue != VK_NULL_HANDLE ? queues[2] : queues[0];
+  if (qUpload.familyIndex != qGCT1.familyIndex) {
+    for (auto pMeshAlloc : m_pMeshesAlloc)
+      cmdTransferOwnership(cmdBuf, pMeshAlloc->getBuffers(),
+                           qUpload.familyIndex, qGCT1.familyIndex, false);
   }
 
   // Keeping the mesh description at host and device
@@ -45,15 +172,6 @@ void Scene::submit() {
 
   cmdBufGet.submitAndWait(cmdBuf);
   m_pContext->getAlloc().finalizeAndReleaseStaging();
-
-  // autofit
-  if (m_shots.empty()) {
-    computeSceneDimensions();
-    fitCamera();
-  }
-  setShot(0);
-
-  m_hasScene = true;
 }
 
 void Scene::reset() {
@@ -63,6 +181,8 @@ void Scene::reset() {
 }
 
 void Scene::freeAllocData() {
+  if (m_hostOnly) return;
+
   // free meshes alloc data
   for (auto& pMeshAlloc : m_pMeshesAlloc) {
     pMeshAlloc->deinit(m_pContext);
@@ -89,6 +209,7 @@ void Scene::freeRawData() {
     delete pMesh;
   }
   m_pMeshes.clear();
+  m_meshJobs.clear();
 }
 
 void Scene::addCamera(VkExtent2D filmResolution, float fov, float focalDist,
@@ -104,8 +225,22 @@ void Scene::addCamera(VkExtent2D filmResolution, vec4 fxfycxcy) {
 
 void Scene::addMesh(const std::string& meshName, const std::string& meshPath,
                     bool recomputeNormal, vec2 uvScale) {
-  Mesh* pMesh = new Mesh(meshPath, recomputeNormal, uvScale);
-  m_pMeshes[meshName] = std::make_pair(pMesh, m_pMeshes.size());
+  addMeshJob({meshName, meshPath, recomputeNormal, uvScale});
+}
+
+void Scene::addMesh(const std::string& meshName, MeshData&& data) {
+  addMeshJob({meshName, "", false, {1.f, 1.f}, std::move(data)});
+}
+
+void Scene::addMeshJob(MeshJob&& job) {
+  if (m_pMeshes.count(job.name)) {
+    LOG_WARN("{}: mesh [\"{}\"] is defined twice, keeping the last one",
+             "Scene", job.name);
+    m_meshJobs[m_pMeshes[job.name].second] = std::move(job);
+    return;
+  }
+  m_pMeshes[job.name] = std::make_pair(nullptr, uint(m_meshJobs.size()));
+  m_meshJobs.push_back(std::move(job));
 }
 
 void Scene::addInstance(const nvmath::mat4f& transform,
@@ -125,6 +260,14 @@ int Scene::getMeshId(const std::string& meshName) {
   return 0;
 }
 
+Mesh* Scene::getMesh(int meshId) {
+  for (auto& record : m_pMeshes)
+    if (record.second.second == meshId) return record.second.first;
+  LOG_ERROR("{}: mesh id [{}] does not exist\n", "Scene", meshId);
+  exit(1);
+  return nullptr;
+}
+
 int Scene::getMeshesNum() { return m_pMeshes.size(); }
 
 int Scene::getInstancesNum() { return m_instances.size(); }
@@ -137,6 +280,11 @@ Camera& Scene::getCamera() { return *m_pCamera; }
 
 CameraType Scene::getCameraType() { return m_pCamera->getType(); }
 
+GpuCamera Scene::getGpuCamera(int shotId) {
+  setShot(shotId);
+  return m_pCamera->toGpuStruct();
+}
+
 nvvk::RaytracingBuilderKHR::BlasInput Scene::getBlas(VkDevice device,
                                                      int meshId) {
   return MeshBufferToBlas(device, *m_pMeshesAlloc[meshId]);
@@ -157,6 +305,100 @@ VkBuffer Scene::getSunskyDescriptor() { return m_bSunAndSky.buffer; }
 
 void Scene::setShot(int shotId) { m_pCamera->setToWorld(m_shots[shotId]); }
 
+void Scene::splitBatches(int batchSize, bool byRef, int slotsNum) {
+  if (byRef)
+    std::stable_sort(m_pairViews.begin(), m_pairViews.end(),
+                     [](const std::pair<int, int>& a,
+                        const std::pair<int, int>& b) {
+                       return a.first < b.first;
+                     });
+  int pairsNum = int(m_pairViews.size());
+  m_batches.clear();
+  for (int pairId = 0; pairId < pairsNum;) {
+    int batchPairsNum = 1;
+    while (batchPairsNum < batchSize && pairId + batchPairsNum < pairsNum &&
+           (!byRef || m_pairViews[pairId + batchPairsNum].first ==
+                          m_pairViews[pairId].first))
+      batchPairsNum++;
+    m_batches.emplace_back(pairId, batchPairsNum);
+    pairId += batchPairsNum;
+  }
+
+  // Slots follow the batches in the order they are traced
+  m_pairRefSlots.assign(pairsNum, 0);
+  m_pairRefTraces.assign(pairsNum, false);
+  m_refTracesNum = 0;
+  if (slotsNum > 0) {
+    vector<int> slotRefs(slotsNum, -1);  // reference view of each slot
+    for (int batchId = 0; batchId < getBatchesNum(); batchId++) {
+      setCurrentBatch(batchId);
+      assignRefSlots(slotRefs);
+    }
+  }
+  if (!m_batches.empty()) setCurrentBatch(0);
+}
+
+int Scene::getMaxRefPairsNum() {
+  std::map<int, int> refPairsNum;
+  int maxPairsNum = 0;
+  for (auto& pairView : m_pairViews)
+    maxPairsNum = std::max(maxPairsNum, ++refPairsNum[pairView.first]);
+  return maxPairsNum;
+}
+
+void Scene::assignRefSlots(vector<int>& slotRefs) {
+  // A batch has at most as many reference views as slots
+  int slotsNum = int(slotRefs.size());
+  vector<bool> slotsUsed(slotsNum, false);
+  vector<int> refSlots(m_curPairsNum, -1);
+  auto findSlot = [&](int ref) {
+    auto it = std::find(slotRefs.begin(), slotRefs.end(), ref);
+    return it == slotRefs.end() ? -1 : int(it - slotRefs.begin());
+  };
+  // Slots of reference views cached by the previous batches are kept
+  for (int layerId = 0; layerId < m_curPairsNum; layerId++) {
+    int slotId = findSlot(getPair(m_curPairId + layerId).first);
+    if (slotId < 0) continue;
+    refSlots[layerId] = slotId;
+    slotsUsed[slotId] = true;
+  }
+  // The others take over slots of reference views this batch does not need
+  for (int layerId = 0; layerId < m_curPairsNum; layerId++) {
+    if (refSlots[layerId] >= 0) continue;
+    int ref = getPair(m_curPairId + layerId).first;
+    int slotId = findSlot(ref);
+    if (slotId < 0) {
+      slotId = int(std::find(slotsUsed.begin(), slotsUsed.end(), false) -
+                   slotsUsed.begin());
+      slotRefs[slotId] = ref;
+      slotsUsed[slotId] = true;
+      m_pairRefTraces[m_curPairId + layerId] = true;
+      m_refTracesNum++;
+    }
+    refSlots[layerId] = slotId;
+  }
+  for (int layerId = 0; layerId < m_curPairsNum; layerId++)
+    m_pairRefSlots[m_curPairId + layerId] = refSlots[layerId];
+}
+
+vector<GpuCamera> Scene::getGpuCameras() {
+  vector<GpuCamera> cameras(m_shots.size());
+  for (int shotId = 0; shotId < getShotsNum(); shotId++)
+    cameras[shotId] = getGpuCamera(shotId);
+  return cameras;
+}
+
+vector<GpuPair> Scene::getGpuPairs() {
+  vector<GpuPair> pairs(m_pairViews.size());
+  for (size_t pairId = 0; pairId < m_pairViews.size(); pairId++) {
+    pairs[pairId].ref = uint(m_pairViews[pairId].first);
+    pairs[pairId].src = uint(m_pairViews[pairId].second);
+    pairs[pairId].refSlot = uint(m_pairRefSlots[pairId]);
+    pairs[pairId].refTraced = m_pairRefTraces[pairId] ? 1 : 0;
+  }
+  return pairs;
+}
+
 void Scene::allocMesh(ContextAware* pContext, uint32_t meshId,
                       const std::string& meshName, Mesh* pMesh,
                       const VkCommandBuffer& cmdBuf) {
@@ -166,8 +408,11 @@ void Scene::allocMesh(ContextAware* pContext, uint32_t meshId,
   MeshAlloc* pMeshAlloc = new MeshAlloc(pContext, pMesh, cmdBuf);
   m_pMeshesAlloc[meshId] = pMeshAlloc;
 
-  NAME2_VK(pMeshAlloc->getVerticesBuffer(),
-           std::string(meshName + "_vertexBuffer"));
+  NAME2_VK(pMeshAlloc->getPositionsBuffer(),
+           std::string(meshName + "_positionBuffer"));
+  if (pMeshAlloc->getNormalsBuffer() != VK_NULL_HANDLE)
+    NAME2_VK(pMeshAlloc->getNormalsBuffer(),
+             std::string(meshName + "_normalBuffer"));
   NAME2_VK(pMeshAlloc->getIndicesBuffer(),
            std::string(meshName + "_indexBuffer"));
 }
@@ -183,8 +428,8 @@ void Scene::computeSceneDimensions() {
   Bbox scnBbox;
 
   for (auto& inst : m_instances) {
-    auto pMeshAlloc = m_pMeshesAlloc[inst.getMeshIndex()];
-    Bbox bbox(pMeshAlloc->getPosMin(), pMeshAlloc->getPosMax());
+    auto pMesh = getMesh(inst.getMeshIndex());
+    Bbox bbox(pMesh->getPosMin(), pMesh->getPosMax());
     bbox.transform(inst.getTransform());
     scnBbox.insert(bbox);
   }
@@ -15,7 +15,9 @@
 
 class Scene {
 public:
-  void init(ContextAware* pContext);
+  // Host-only scenes keep meshes and shots on the cpu and never touch vulkan,
+  // which is what the cpu backend needs
+  void init(ContextAware* pContext, bool hostOnly = false);
   void deinit();
   void submit();
   void reset();
@@ -26,19 +28,24 @@ public:
   void addCamera(VkExtent2D filmResolution, float fov, float focalDist,
                  float aperture);                            // perspective
   void addCamera(VkExtent2D filmResolution, vec4 fxfycxcy);  // opencv
+  // Meshes are only parsed in submit(), all at once on a thread pool
   void addMesh(const std::string& meshName, const std::string& meshPath,
                bool recomputeNormal, vec2 uvScale);
+  // Mesh already in memory, e.g. from a gltf file
+  void addMesh(const std::string& meshName, MeshData&& data);
   void addInstance(const nvmath::mat4f& transform, const std::string& meshName);
   void addShot(const CameraShot& shot);
 
 public:
   int getMeshId(const std::string& meshName);
+  Mesh* getMesh(int meshId);
   int getMeshesNum();
   int getInstancesNum();
   int getShotsNum();
   CameraShot& getShot(int shotId);
   Camera& getCamera();
   CameraType getCameraType();
+  GpuCamera getGpuCamera(int shotId);
   nvvk::RaytracingBuilderKHR::BlasInput getBlas(VkDevice device, int meshId);
   vector<Instance>& getInstances();
   VkExtent2D getSize();
@@ -53,6 +60,7 @@ private:
   std::string m_sceneFileDir = "";
   ContextAware* m_pContext = nullptr;
   bool m_hasScene = false;
+  bool m_hostOnly = false;
   // ---------------- CPU resources ----------------
   // Integrator         m_integrator   = {};
   Camera* m_pCamera = nullptr;
@@ -60,6 +68,14 @@ private:
   vector<Instance> m_instances = {};
   vector<CameraShot> m_shots = {};
   MeshPropTable m_mesh2light = {};
+  struct MeshJob {
+    std::string name;
+    std::string path;
+    bool recomputeNormal;
+    vec2 uvScale;
+    MeshData data;  // streams of meshes without a path
+  };
+  vector<MeshJob> m_meshJobs = {};  // indexed by mesh id, until submit()
   // ---------------- GPU resources ----------------
   vector<MeshAlloc*> m_pMeshesAlloc = {};
   InstancesAlloc* m_pInstancesAlloc = nullptr;
@@ -68,6 +84,11 @@ private:
   Dimensions m_dimensions;
 
 private:
+  void addMeshJob(MeshJob&& job);
+  void loadMeshes();
+  void uploadMeshes(const vector<uint>& meshIds, nvvk::CommandPool& cmdPool,
+                    uint32_t familyIndex);
+  void submitToGpu();
   void allocMesh(ContextAware* pContext, uint32_t meshId,
                  const std::string& meshName, Mesh* pMesh,
                  const VkCommandBuffer& cmdBuf);
@@ -78,7 +99,10 @@ private:
   // Multiview correspondence
 public:
   vector<std::pair<int, int>> m_pairViews = {};
+  // Pairs traced together, first pair and pairs num of each batch
+  vector<std::pair<int, int>> m_batches = {};
   int m_curPairId = 0;
+  int m_curPairsNum = 1;  // pairs of the current batch, from m_curPairId
 
   void addPair(int ref, int src) {
     m_pairViews.emplace_back(std::make_pair(ref, src));
@@ -87,6 +111,42 @@ public:
     if (pairId < 0) return m_pairViews[m_curPairId];
     return m_pairViews[pairId];
   }
-  void setCurrentPair(int pairId) { m_curPairId = pairId; }
+  // Once all pairs are loaded, splits them into batches of at most batchSize
+  // pairs. Grouped by reference view, pairs are stably sorted by it and
+  // batches end with their reference view. With slotsNum reference view cache
+  // slots, the slots of all batches are assigned at once too.
+  void splitBatches(int batchSize, bool byRef, int slotsNum);
+  // Most pairs sharing a reference view
+  int getMaxRefPairsNum();
+  int getBatchesNum() { return int(m_batches.size()); }
+  void setCurrentBatch(int batchId) {
+    m_curPairId = m_batches[batchId].first;
+    m_curPairsNum = m_batches[batchId].second;
+  }
+  int getCurrentPairId() { return m_curPairId; }
+  int getCurrentPairsNum() { return m_curPairsNum; }
   uint getPairsNum() { return m_pairViews.size(); }
+
+  // Reference view cache: primary hits of reference views are kept in the
+  // slots of a G-buffer. Each pair of a batch reads the slot of its reference
+  // view, and the first pair of a reference not cached yet traces it into a
+  // slot that no pair of the batch needs.
+  vector<int> m_pairRefSlots = {};
+  vector<bool> m_pairRefTraces = {};
+  int m_refTracesNum = 0;  // reference views traced by all batches
+
+  int getCurrentRefSlot(int layerId) {
+    return m_pairRefSlots[m_curPairId + layerId];
+  }
+  bool getCurrentRefTraced(int layerId) {
+    return m_pairRefTraces[m_curPairId + layerId];
+  }
+  int getRefTracesNum() { return m_refTracesNum; }
+
+  // Cameras of all shots and shots of all pairs, resident on the gpu
+  vector<GpuCamera> getGpuCameras();
+  vector<GpuPair> getGpuPairs();
+
+private:
+  void assignRefSlots(vector<int>& slotRefs);
 };
\ No newline at end of file
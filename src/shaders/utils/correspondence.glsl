@@ -0,0 +1,95 @@
+#ifndef CORRESPONDENCE_GLSL
+#define CORRESPONDENCE_GLSL
+
+// Steps of a correspondence shared by the ray generation shaders. Including
+// shaders declare tlas, the payload at location 0 and isShadowed at
+// location 1.
+
+// Ray through a pixel of the reference view
+Ray refViewRay(GpuCamera camRef, vec2 pixelRefView) {
+  // Set camera origin in world space
+  vec3 rayOrigin, rayDir;
+  vec3 camRefOrigin = transformPoint(camRef.cameraToWorld, vec3(0.f));
+
+  if (camRef.type == CameraTypePerspective) {
+    rayOrigin = camRefOrigin;
+
+    // Compute raster and camera sample positions
+    vec3 pFilm = vec3(pixelRefView, 0.f);
+    vec3 pCamera = transformPoint(camRef.rasterToCamera, pFilm);
+
+    // Treat point as direction since camera origin is at (0,0,0)
+    vec3 r = makeNormal(pCamera);
+
+    // Transform ray to world space
+    rayDir = transformDirection(camRef.cameraToWorld, r);
+  } else if (camRef.type == CameraTypeOpencv) {
+    rayOrigin = camRefOrigin;
+
+    vec4 fxfycxcy = camRef.fxfycxcy;
+    vec2 pRaster;
+    pRaster.x = (pixelRefView.x - fxfycxcy.z) / fxfycxcy.x;
+    pRaster.y = (pixelRefView.y - fxfycxcy.w) / fxfycxcy.y;
+
+    vec3 r = vec3(pRaster, 1.f);
+
+    // Transform ray to world space
+    rayDir = transformDirection(camRef.cameraToWorld, r);
+  }
+  return Ray(rayOrigin, rayDir);
+}
+
+// Closest hit of a ray, in payload.hitPos and payload.ffnormal
+bool tracePrimary(Ray r) {
+  uint rayFlags = gl_RayFlagsCullBackFacingTrianglesEXT;
+  payload.r = r;
+  payload.hitSomething = false;
+
+  // Check hit and call closest hit shader
+  traceRayEXT(tlas, rayFlags, 0xFF, 0, 0, 0, payload.r.o, MINIMUM, payload.r.d,
+              INFINITY, 0);
+  return payload.hitSomething;
+}
+
+// Whether nothing lies between a hit of the reference view and the source
+// camera
+bool visibleFromSrc(GpuCamera camSrc, vec3 refHit, vec3 ffnormal) {
+  vec3 camSrcOrigin = transformPoint(camSrc.cameraToWorld, vec3(0.f));
+  vec3 o = offsetPositionAlongNormal(refHit, ffnormal);
+  float dist = length(camSrcOrigin - o);
+  vec3 d = makeNormal(camSrcOrigin - o);
+
+  const uint shadowRayFlags =
+      gl_RayFlagsTerminateOnFirstHitEXT | gl_RayFlagsSkipClosestHitShaderEXT;
+  float maxDist = dist - EPS;
+  isShadowed = true;
+  traceRayEXT(tlas, shadowRayFlags, 0xFF, 0, 0, 1, o, 0.0, d, maxDist, 1);
+  return !isShadowed;
+}
+
+// Pixel of a hit of the reference view in the source view
+vec2 srcViewPixel(GpuCamera camSrc, vec3 refHit) {
+  vec3 pixelSrcView;
+
+  if (camSrc.type == CameraTypePerspective) {
+    pixelSrcView = transformPoint(camSrc.worldToRaster, refHit);
+  } else if (camSrc.type == CameraTypeOpencv) {
+    vec4 fxfycxcy = camSrc.fxfycxcy;
+    vec3 hitInCameraSpace = transformPoint(camSrc.worldToCamera, refHit);
+    hitInCameraSpace.xy /= hitInCameraSpace.z;
+    pixelSrcView.x = fxfycxcy.z + fxfycxcy.x * hitInCameraSpace.x;
+    pixelSrcView.y = fxfycxcy.w + fxfycxcy.y * hitInCameraSpace.y;
+    pixelSrcView.z = 1.0;
+  }
+  return pixelSrcView.xy;
+}
+
+// Flow of a pixel of view a into view b, z whether b sees the hit
+vec4 traceFlow(GpuCamera camA, GpuCamera camB, vec2 pixelA) {
+  if (!tracePrimary(refViewRay(camA, pixelA))) return vec4(0.f);
+  vec3 hitA = payload.hitPos;
+  if (!visibleFromSrc(camB, hitA, payload.ffnormal)) return vec4(0.f);
+  return vec4(srcViewPixel(camB, hitA) - pixelA, 1.f, 0.f);
+}
+
+#endif
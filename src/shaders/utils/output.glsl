@@ -0,0 +1,57 @@
+#ifndef OUTPUT_GLSL
+#define OUTPUT_GLSL
+
+// Output images of the ray generation shaders and stores into them. The
+// shaders are also compiled with OUTPUT_COMPACT for the compact output
+// formats, whose images are written without a format so that rg32f and
+// rg16f share them. Only that variant needs the format-less write feature.
+
+// clang-format off
+#ifdef OUTPUT_COMPACT
+layout(set = RtOut, binding = OutputStore)          writeonly uniform image2DArray images[NUM_OUTPUT_IMAGES];
+layout(set = RtOut, binding = OutputMask)           buffer _Mask { uint masks[]; };
+#else
+layout(set = RtOut, binding = OutputStore, rgba32f) uniform image2DArray images[NUM_OUTPUT_IMAGES];
+#endif
+// clang-format on
+
+#ifdef OUTPUT_COMPACT
+// Word of the visibility mask with the bit of a texel, flag 0 is the
+// visibility of the output image and flag 1 its consistency
+uint maskWord(uint imageId, ivec3 texel, uint flagId, out uint bit) {
+  uint layerWords = (gl_LaunchSizeEXT.x * gl_LaunchSizeEXT.y + 31) / 32;
+  uint layersNum = imageSize(images[imageId]).z;
+  uint texelId = texel.y * gl_LaunchSizeEXT.x + texel.x;
+  uint plane = 2 * imageId + flagId;
+  bit = 1u << (texelId % 32);
+  return (plane * layersNum + texel.z) * layerWords + texelId / 32;
+}
+
+void storeFlag(uint imageId, ivec3 texel, uint flagId) {
+  uint bit;
+  uint word = maskWord(imageId, texel, flagId, bit);
+  atomicOr(masks[word], bit);
+}
+
+bool loadFlag(uint imageId, ivec3 texel, uint flagId) {
+  uint bit;
+  uint word = maskWord(imageId, texel, flagId, bit);
+  return (masks[word] & bit) != 0;
+}
+#endif
+
+// Flow in xy, visibility in z and, for flagsNum 2, consistency in w.
+// Compact output formats keep only the flow in the image, and set the bits
+// of the flags in their planes of the visibility mask, which is cleared
+// before each batch.
+void storeOutput(uint imageId, ivec3 texel, vec4 value, uint flagsNum) {
+#ifndef OUTPUT_COMPACT
+  imageStore(images[imageId], texel, value);
+#else
+  imageStore(images[imageId], texel, vec4(value.xy, 0.f, 0.f));
+  for (uint flagId = 0; flagId < flagsNum; flagId++)
+    if (value[2 + flagId] >= 0.5f) storeFlag(imageId, texel, flagId);
+#endif
+}
+
+#endif
\ No newline at end of file
@@ -45,13 +45,34 @@ END_ENUM();
 
 // Output image - Set 1
 START_ENUM(OutputBindings)
-  OutputStore   = 0  // As storage
+  OutputStore   = 0,  // As storage
+  OutputGbuffer = 1,  // Reference view cache, as storage
+  OutputMask    = 2,  // Visibility mask of compact output formats
+  OutputFlows   = 3   // Output images, sampled by the consistency pass
+END_ENUM();
+
+// Planes of the visibility mask, each a bit per pixel of every layer. Plane
+// 2i + 0 holds the visibility of output image i, 2i + 1 its consistency.
+START_ENUM(MaskPlanes)
+  MaskForwardVisible     = 0,
+  MaskForwardConsistent  = 1,
+  MaskBackwardVisible    = 2,
+  MaskBackwardConsistent = 3,
+  MaskNum                = 4
+END_ENUM();
+
+// Reference view cache images
+START_ENUM(GbufferImages)
+  GbufferPosition = 0,  // hit position, w is 1 on a hit
+  GbufferNormal   = 1,  // face forward normal
+  GbufferNum      = 2
 END_ENUM();
 
 // Scene Data - Set 2
 START_ENUM(SceneBindings)
-  SceneCamera    = 0, 
-  SceneInstances = 1
+  SceneCamera    = 0,  // cameras of all shots
+  SceneInstances = 1,
+  ScenePairs     = 2   // shots of all pairs
 END_ENUM();
 
 START_ENUM(InputBindings)
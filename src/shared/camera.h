@@ -22,9 +22,14 @@ struct GpuCamera {
   uint type;      // camera type
 };
 
-struct GpuCameraPair {
-  GpuCamera ref;
-  GpuCamera src;
+// Pair of shots, indices into the cameras of all shots
+struct GpuPair {
+  uint ref;
+  uint src;
+  // Reference view cache: G-buffer slot of ref, and whether this pair traces
+  // ref into it
+  uint refSlot;
+  uint refTraced;
 };
 
 #endif
\ No newline at end of file
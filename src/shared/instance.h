@@ -5,10 +5,13 @@
 
 // Information of a obj model when referenced in a shader
 struct GpuInstance {
-  // Address of the Vertex buffer
+  // Address of the position buffer, tightly packed vec3
   uint64_t vertexAddress;
   // Address of the index buffer
   uint64_t indexAddress;
+  // Address of the normal buffer, tightly packed vec3. 0 when the mesh has
+  // no vertex normals, the face normal is used instead.
+  uint64_t normalAddress;
 };
 
 // SceneDesc = GPUMeshDesc[] + GPUMaterialDesc[]
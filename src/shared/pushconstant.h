@@ -19,6 +19,9 @@ struct GpuPushConstantRaytrace {
   vec2 envMapResolution;
   float envMapIntensity;
   float envRotateAngle;
+  uint firstPairId;  // pairs of the launch, in the pairs of the scene
+  uint pairsNum;
+  uint flowImageId;  // output image the consistency pass checks
 };
 
 // clang-format off
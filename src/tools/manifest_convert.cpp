@@ -0,0 +1,75 @@
+// Converts the shots and pairs of a scene file or of a csv manifest to the
+// binary manifest format, which a scene file references with "manifest":
+//
+//   manifest_convert <input.json|csv> <output.views>
+//
+// Only the shots and pairs arrays of a scene file are converted, shots of
+// its gltf files are not.
+
+#include <loader/manifest.h>
+#include <core/mapped_file.h>
+#include <context/context.h>
+
+#include <cstring>
+
+static void printUsage() {
+  LOG_INFO("usage: manifest_convert <input.json|csv> <output{}>",
+           MANIFEST_FILE_EXTENSION);
+}
+
+int main(int argc, char** argv) {
+  if (argc != 3 || !strcmp(argv[1], "--help")) {
+    printUsage();
+    return argc == 2 ? 0 : 1;
+  }
+  std::string inputPath = argv[1], outputPath = argv[2];
+  if (getManifestFormat(outputPath) != ManifestFormat::Binary)
+    LOG_WARN("{}: [{}] lacks the {} extension, scenes will not read it",
+             "ManifestConvert", outputPath, MANIFEST_FILE_EXTENSION);
+
+  vector<CameraShot> shots;
+  vector<std::pair<int, int>> pairs;
+  std::string error;
+  bool loaded;
+  if (getManifestFormat(inputPath) == ManifestFormat::Csv) {
+    loaded = readManifest(
+        inputPath, [&](const CameraShot& shot) { shots.push_back(shot); },
+        [&](int ref, int src) { pairs.emplace_back(ref, src); }, error);
+  } else {
+    MappedFile sceneFile;
+    if (!sceneFile.open(inputPath)) {
+      LOG_ERROR("{}: cannot read [{}]", "ManifestConvert", inputPath);
+      return 1;
+    }
+    nlohmann::json sceneJson;
+    SceneSax sax(
+        sceneJson,
+        [&](const ShotFields& fields) {
+          CameraShot shot;
+          std::string shotError;
+          if (!fieldsToShot(fields, shot, shotError) && error.empty())
+            error = "shot " + std::to_string(shots.size()) + " " + shotError;
+          shots.push_back(shot);
+        },
+        [&](int ref, int src) {
+          if ((ref < 0 || src < 0) && error.empty())
+            error = "pair " + std::to_string(pairs.size()) +
+                    " needs [\"ref\"] and [\"src\"]";
+          pairs.emplace_back(ref, src);
+        });
+    const char* pData = sceneFile.getData();
+    loaded =
+        nlohmann::json::sax_parse(pData, pData + sceneFile.getSize(), &sax);
+    if (!loaded) error = sax.getError();
+    loaded &= error.empty();
+  }
+  if (!loaded) {
+    LOG_ERROR("{}: [{}] --- {}", "ManifestConvert", inputPath, error);
+    return 1;
+  }
+  if (!writeManifestFile(outputPath, shots, pairs)) return 1;
+
+  LOG_INFO("{}: [{}] to [{}], {} shots, {} pairs", "ManifestConvert",
+           inputPath, outputPath, shots.size(), pairs.size());
+  return 0;
+}
@@ -0,0 +1,61 @@
+// Converts a mesh to the binary mesh format, which Scene::addMesh maps and
+// uploads with no parsing. The options match those of a scene mesh, and are
+// baked into the file:
+//
+//   mesh_convert <input.obj|ply> <output.bmesh> [--recompute_normal]
+//                [--uv_scale <u> <v>]
+
+#include <core/mesh_io.h>
+#include <context/context.h>
+
+#include <cstdlib>
+#include <cstring>
+
+static void printUsage() {
+  LOG_INFO(
+      "usage: mesh_convert <input.obj|ply> <output{}> [--recompute_normal] "
+      "[--uv_scale <u> <v>]",
+      MESH_FILE_EXTENSION);
+}
+
+int main(int argc, char** argv) {
+  vector<std::string> paths;
+  bool recomputeNormal = false;
+  vec2 uvScale = {1.f, 1.f};
+  for (int argId = 1; argId < argc; argId++) {
+    if (!strcmp(argv[argId], "--recompute_normal"))
+      recomputeNormal = true;
+    else if (!strcmp(argv[argId], "--uv_scale") && argId + 2 < argc) {
+      uvScale.x = float(atof(argv[++argId]));
+      uvScale.y = float(atof(argv[++argId]));
+    } else if (!strcmp(argv[argId], "--help")) {
+      printUsage();
+      return 0;
+    } else
+      paths.push_back(argv[argId]);
+  }
+  if (paths.size() != 2) {
+    printUsage();
+    return 1;
+  }
+  MeshFormat inputFormat = getMeshFormat(paths[0]);
+  if (inputFormat != MeshFormat::Obj && inputFormat != MeshFormat::Ply) {
+    LOG_ERROR("{}: [{}] is neither an obj nor a ply file", "MeshConvert",
+              paths[0]);
+    return 1;
+  }
+  if (getMeshFormat(paths[1]) != MeshFormat::Binary)
+    LOG_WARN("{}: [{}] lacks the {} extension, scenes will not map it",
+             "MeshConvert", paths[1], MESH_FILE_EXTENSION);
+
+  MeshData data;
+  loadMeshFile(paths[0], data, recomputeNormal);
+  for (auto& uv : data.uvs) uv = uvScale * uv;
+  if (!writeMeshFile(paths[1], data)) return 1;
+
+  LOG_INFO("{}: [{}] to [{}], {} vertices, {} triangles{}{}", "MeshConvert",
+           paths[0], paths[1], data.positions.size(), data.indices.size() / 3,
+           data.normals.empty() ? "" : ", normals",
+           data.uvs.empty() ? "" : ", uvs");
+  return 0;
+}
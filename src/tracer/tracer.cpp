@@ -7,7 +7,9 @@
 #include <nvvk/images_vk.hpp>
 #include <nvvk/structs_vk.hpp>
 #include <ext/tqdm.h>
+#include <core/worker_pool.h>
 
+#include <algorithm>
 #include <iostream>
 
 #include <filesystem/path.h>
@@ -18,11 +20,18 @@ void Tracer::init(TracerInitSettings tis) {
 
   // Get film size and set size for context
   auto filmResolution =
-      Loader().loadSizeFirst(m_tis.scenefile, ContextAware::getRoot());
+      m_loader.loadSizeFirst(m_tis.scenefile, ContextAware::getRoot());
   ContextAware::setSize(filmResolution);
 
   // Initialize context and set context pointer for scene
-  ContextAware::init({m_tis.offline});
+  ContextInitSetting cis;
+  cis.offline = m_tis.offline;
+  cis.batchSize = m_tis.batchSize;
+  cis.refCache = m_tis.refCache;
+  cis.fanOut = m_tis.fanOut;
+  cis.bidirectional = m_tis.bidirectional;
+  cis.outputFormat = m_tis.outputFormat;
+  ContextAware::init(cis);
   m_scene.init(reinterpret_cast<ContextAware*>(this));
 
   parallelLoading();
@@ -68,9 +77,6 @@ void Tracer::runOnline() {
     {
       vkBeginCommandBuffer(cmdBuf, &beginInfo);
 
-      // Update camera pairs
-      m_pipelineGraphics.run(cmdBuf);
-
       // Ray tracing
       m_pipelineRaytrace.run(cmdBuf);
 
@@ -109,76 +115,199 @@ void Tracer::runOnline() {
 }
 
 void Tracer::runOffline() {
-  std::array<VkClearValue, 2> clearValues{};
-  clearValues[0].color = {0.0f, 0.0f, 0.0f, 0.0f};
-  clearValues[1].depthStencil = {1.0f, 0};
-
   // Vulkan allocator and image size
   auto& m_alloc = ContextAware::getAlloc();
   auto m_size = ContextAware::getSize();
+  auto m_device = ContextAware::getDevice();
+
+  // Pairs of a batch are traced in one submission, into the layers of the
+  // output images. Bidirectional mode reads back the first two, backward
+  // flows after all forward flows of the batch. Compact output formats read
+  // back the whole visibility mask after the images.
+  int batchSize = int(ContextAware::getBatchSize());
+  size_t layerSize = size_t(ContextAware::getOutputTexelSize()) *
+                     m_size.width * m_size.height;
+  bool bidirectional = ContextAware::getBidirectionalMode();
+  int imagesNum = int(ContextAware::getBatchImagesNum());
+  bool compact = ContextAware::getCompactOutputMode();
+  bool halfFloat = ContextAware::getOutputFormat() == OutputFormat::Rg16f;
+  ExrCompression compression = m_tis.exrCompression;
+  uint32_t maskPlanesNum = ContextAware::getMaskPlanesNum();
+  size_t maskLayerSize = size_t(ContextAware::getMaskLayerSize());
+  size_t maskOffset = layerSize * batchSize * imagesNum;
+  size_t maskSize = maskLayerSize * batchSize * maskPlanesNum;
+
+  // Batches rotate over frames in flight. While the gpu traces a batch and
+  // copies it to the readback buffer of its frame, workers encode the images
+  // of the previous batches from the buffers of their frames.
+  struct OfflineFrame {
+    nvvk::Buffer pixelBuffer;
+    char* pPixels{nullptr};  // persistently mapped pixelBuffer
+    VkFence fence{VK_NULL_HANDLE};
+    VkCommandBuffer cmdBuf{VK_NULL_HANDLE};  // while in flight
+    vector<std::string> outputPaths{};  // without extension
+    vector<std::future<void>> writes{};
+  };
+  array<OfflineFrame, FRAMES_IN_FLIGHT> frames;
+  for (auto& frame : frames) {
+    frame.pixelBuffer = m_alloc.createBuffer(
+        maskOffset + maskSize,
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    frame.pPixels = reinterpret_cast<char*>(m_alloc.map(frame.pixelBuffer));
+    VkFenceCreateInfo fenceInfo{VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+    vkCreateFence(m_device, &fenceInfo, nullptr, &frame.fence);
+  }
 
-  // Create a temporary buffer to hold the output pixels of the image
-  VkBufferUsageFlags usage{VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
-                           VK_BUFFER_USAGE_TRANSFER_DST_BIT};
-  VkDeviceSize bufferSize = 4 * sizeof(float) * m_size.width * m_size.height;
-  nvvk::Buffer pixelBuffer = m_alloc.createBuffer(
-      bufferSize, usage, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+  nvvk::CommandPool genCmdBuf(m_device, ContextAware::getQueueFamily());
+  VkQueue queue;
+  vkGetDeviceQueue(m_device, ContextAware::getQueueFamily(), 0, &queue);
+
+  WorkerPool writers;
+  writers.init(m_tis.threads);
+
+  // Once the gpu is done with a frame, its images are queued for encoding
+  auto writeFrame = [&](OfflineFrame& frame) {
+    if (frame.cmdBuf == VK_NULL_HANDLE) return;
+    vkWaitForFences(m_device, 1, &frame.fence, VK_TRUE, UINT64_MAX);
+    vkResetFences(m_device, 1, &frame.fence);
+    genCmdBuf.destroy(frame.cmdBuf);
+    frame.cmdBuf = VK_NULL_HANDLE;
+    size_t layersNum = frame.outputPaths.size();
+    for (size_t layerId = 0; layerId < layersNum; layerId++) {
+      vector<const void*> images;
+      for (int imageId = 0; imageId < imagesNum; imageId++)
+        images.push_back(frame.pPixels +
+                         layerSize * (imageId * layersNum + layerId));
+      vector<const uint32_t*> planes;
+      for (uint32_t planeId = 0; planeId < maskPlanesNum; planeId++)
+        planes.push_back(reinterpret_cast<const uint32_t*>(
+            frame.pPixels + maskOffset +
+            maskLayerSize * (planeId * batchSize + layerId)));
+      std::string outputPath = frame.outputPaths[layerId];
+      frame.writes.push_back(writers.submit([=]() {
+        // Full precision channels straight from the mapped buffer
+        if (compact) {
+          writeImageLayers(outputPath + ".exr", m_size.width, m_size.height,
+                           images,
+                           bidirectional ? BIDIRECTIONAL_COMPACT_CHANNELS
+                                         : COMPACT_CHANNELS,
+                           2, halfFloat, compression);
+          writeMask(outputPath + ".mask", planes, maskLayerSize);
+        } else {
+          writeImageLayers(
+              outputPath + ".exr", m_size.width, m_size.height, images,
+              bidirectional ? BIDIRECTIONAL_CHANNELS : FLOW_CHANNELS, 4,
+              false, compression);
+        }
+      }));
+    }
+  };
 
-  nvvk::CommandPool genCmdBuf(ContextAware::getDevice(),
-                              ContextAware::getQueueFamily());
+  int pairsNum = int(m_scene.getPairsNum());
+  LOG_INFO("{}: tracing {} pairs in batches of {}, {} writer threads",
+           "Tracer", pairsNum, batchSize, writers.getThreadsNum());
+  nvh::Stopwatch sw;
 
-  auto pairsNum = m_scene.getPairsNum();
-  
   tqdm bar;
   bar.set_theme_arrow();
 
-  for (int pairId = 0; pairId < pairsNum; pairId++) {
-    m_scene.setCurrentPair(pairId);
+  int batchId = 0;
+  for (; batchId < m_scene.getBatchesNum(); batchId++) {
+    auto& frame = frames[batchId % FRAMES_IN_FLIGHT];
+    // The readback buffer is free again once its images are written
+    for (auto& write : frame.writes) write.get();
+    frame.writes.clear();
+
+    // Cameras and pairs are on the gpu already, the batch is only selected
+    m_scene.setCurrentBatch(batchId);
+    int pairId = m_scene.getCurrentPairId();
+    int batchPairsNum = m_scene.getCurrentPairsNum();
     bar.progress(pairId, pairsNum);
 
-    const VkCommandBuffer& cmdBuf = genCmdBuf.createCommandBuffer();
+    VkCommandBuffer cmdBuf = genCmdBuf.createCommandBuffer();
 
-    // Update camera and sunsky
+    // Clearing the visibility mask, ray tracing and do not render gui
     m_pipelineGraphics.run(cmdBuf);
-
-    // Ray tracing and do not render gui
     m_pipelineRaytrace.run(cmdBuf);
 
-    // Only post-processing in the last pass since
-    // we do not care the intermediate result in offline mode
-    VkRenderPassBeginInfo postRenderPassBeginInfo{
-        VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO};
-    postRenderPassBeginInfo.clearValueCount = 2;
-    postRenderPassBeginInfo.pClearValues = clearValues.data();
-    postRenderPassBeginInfo.renderPass = ContextAware::getRenderPass();
-    postRenderPassBeginInfo.framebuffer = ContextAware::getFramebuffer();
-    postRenderPassBeginInfo.renderArea = {{0, 0}, ContextAware::getSize()};
-    vkCmdBeginRenderPass(cmdBuf, &postRenderPassBeginInfo,
-                         VK_SUBPASS_CONTENTS_INLINE);
-    m_pipelinePost.run(cmdBuf);
-    vkCmdEndRenderPass(cmdBuf);
-    genCmdBuf.submitAndWait(cmdBuf);
-    vkDeviceWaitIdle(ContextAware::getDevice());
-
-    // Save image
+    // No post processing offline, the hdr output of the whole batch is read
+    // back as is in the same submission
+    for (int imageId = 0; imageId < imagesNum; imageId++)
+      vkTextureToBuffer(cmdBuf, m_pipelineGraphics.getColorTexture(imageId),
+                        frame.pixelBuffer.buffer, batchPairsNum,
+                        imageId * batchPairsNum * layerSize);
+    if (compact)
+      vkBufferToBuffer(cmdBuf, m_pipelineGraphics.getMaskBuffer().buffer,
+                       maskSize, frame.pixelBuffer.buffer, maskOffset);
+    vkEndCommandBuffer(cmdBuf);
+    VkSubmitInfo submitInfo{VK_STRUCTURE_TYPE_SUBMIT_INFO};
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &cmdBuf;
+    vkQueueSubmit(queue, 1, &submitInfo, frame.fence);
+    frame.cmdBuf = cmdBuf;
+
+    // Images to save, one per pair of the batch
     static char outputName[200];
-    auto pairRefSrc = m_scene.getPair(pairId);
-    auto ref = pairRefSrc.first;
-    auto src = pairRefSrc.second;
-    sprintf(outputName, "%s_ref_%04d_src_%04d.exr", m_tis.outputname.c_str(), ref, src);
-    saveBufferToImage(pixelBuffer, outputName, 0);
+    frame.outputPaths.clear();
+    for (int layerId = 0; layerId < batchPairsNum; layerId++) {
+      auto pairRefSrc = m_scene.getPair(pairId + layerId);
+      auto ref = pairRefSrc.first;
+      auto src = pairRefSrc.second;
+      sprintf(outputName, "%s_ref_%04d_src_%04d", m_tis.outputname.c_str(),
+              ref, src);
+      std::string outputPath = outputName;
+      if (!path(outputPath).is_absolute())
+        outputPath = NVPSystem::exePath() + outputPath;
+      frame.outputPaths.push_back(outputPath);
+    }
+
+    // Meanwhile the previous batch is encoded
+    writeFrame(frames[(batchId + FRAMES_IN_FLIGHT - 1) % FRAMES_IN_FLIGHT]);
   }
+  writeFrame(frames[(batchId + FRAMES_IN_FLIGHT - 1) % FRAMES_IN_FLIGHT]);
+  for (auto& frame : frames)
+    for (auto& write : frame.writes) write.get();
 
   bar.finish();
-
-  // Destroy temporary buffer
-  m_alloc.destroy(pixelBuffer);
+  LOG_INFO("{}: traced and wrote {} pairs in {:.2f} ms", "Tracer", pairsNum,
+           sw.elapsed());
+  if (ContextAware::getRefCacheMode())
+    LOG_INFO("{}: traced {} reference views for {} pairs", "Tracer",
+             m_scene.getRefTracesNum(), pairsNum);
+  if (ContextAware::getFanOutMode())
+    LOG_INFO("{}: traced {} pairs in {} fan-out launches", "Tracer",
+             pairsNum, m_scene.getBatchesNum());
+
+  // Destroy readback buffers
+  writers.deinit();
+  for (auto& frame : frames) {
+    m_alloc.unmap(frame.pixelBuffer);
+    m_alloc.destroy(frame.pixelBuffer);
+    vkDestroyFence(m_device, frame.fence, nullptr);
+  }
 }
 
 void Tracer::parallelLoading() {
   // Load resources into scene
-  Loader().loadSceneFromJson(m_tis.scenefile, ContextAware::getRoot(),
+  m_loader.loadSceneFromJson(m_tis.scenefile, ContextAware::getRoot(),
                              &m_scene);
+  // Fan-out batches hold the largest reference group by default, so that
+  // each reference view takes a single launch
+  if (ContextAware::getFanOutMode()) {
+    int maxRefPairsNum = m_scene.getMaxRefPairsNum();
+    ContextAware::setDefaultBatchSize(maxRefPairsNum);
+    if (maxRefPairsNum > int(ContextAware::getBatchSize()))
+      LOG_WARN("{}: reference views of up to {} pairs take several fan-out "
+               "launches of {}",
+               "Tracer", maxRefPairsNum, ContextAware::getBatchSize());
+  }
+  // Output names carry ref and src, so fan-out may trace pairs in any order.
+  // A batch needs at most one reference view cache slot per pair.
+  int batchSize = int(ContextAware::getBatchSize());
+  m_scene.splitBatches(batchSize, ContextAware::getFanOutMode(),
+                       ContextAware::getRefCacheMode() ? batchSize : 0);
 
   // Create graphics pipeline
   m_pipelineGraphics.init(reinterpret_cast<ContextAware*>(this), &m_scene);
@@ -189,62 +318,91 @@ void Tracer::parallelLoading() {
   pis.pDswScene = &m_pipelineGraphics.getSceneDescriptorSet();
   m_pipelineRaytrace.init(reinterpret_cast<ContextAware*>(this), &m_scene, pis);
 
-  // Post pipeline processes hdr output
-  m_pipelinePost.init(reinterpret_cast<ContextAware*>(this), &m_scene,
-                      &m_pipelineGraphics.getHdrOutImageInfo());
+  // Post pipeline processes hdr output for the swap chain only
+  if (!ContextAware::getOfflineMode())
+    m_pipelinePost.init(reinterpret_cast<ContextAware*>(this), &m_scene,
+                        &m_pipelineGraphics.getHdrOutImageInfo());
 }
 
-void Tracer::vkTextureToBuffer(const nvvk::Texture& imgIn,
-                               const VkBuffer& pixelBufferOut) {
-  nvvk::CommandPool genCmdBuf(ContextAware::getDevice(),
-                              ContextAware::getQueueFamily());
-  VkCommandBuffer cmdBuf = genCmdBuf.createCommandBuffer();
-
-  // Make the image layout eTransferSrcOptimal to copy to buffer
-  nvvk::cmdBarrierImageLayout(cmdBuf, imgIn.image, VK_IMAGE_LAYOUT_GENERAL,
-                              VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                              VK_IMAGE_ASPECT_COLOR_BIT);
-
-  // Copy the image to the buffer
+void Tracer::vkTextureToBuffer(const VkCommandBuffer& cmdBuf,
+                               const nvvk::Texture& imgIn,
+                               const VkBuffer& pixelBufferOut,
+                               uint layersNum, VkDeviceSize bufferOffset) {
+  // Wait for the shaders writing and sampling the image, then make its
+  // layout eTransferSrcOptimal to copy to buffer
+  VkImageMemoryBarrier imageBarrier{VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER};
+  imageBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  imageBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  imageBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+  imageBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  imageBarrier.image = imgIn.image;
+  imageBarrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0,
+                                   layersNum};
+  auto shaderStages = VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR |
+                      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+  vkCmdPipelineBarrier(cmdBuf, shaderStages, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       0, 0, nullptr, 0, nullptr, 1, &imageBarrier);
+
+  // Copy the layers to the buffer, which packs them one after the other
   VkBufferImageCopy copyRegion;
-  copyRegion.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+  copyRegion.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, layersNum};
   copyRegion.imageExtent = {ContextAware::getSize().width,
                             ContextAware::getSize().height, 1};
   copyRegion.imageOffset = {0};
-  copyRegion.bufferOffset = 0;
+  copyRegion.bufferOffset = bufferOffset;
   copyRegion.bufferImageHeight = ContextAware::getSize().height;
   copyRegion.bufferRowLength = ContextAware::getSize().width;
   vkCmdCopyImageToBuffer(cmdBuf, imgIn.image,
                          VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, pixelBufferOut,
                          1, &copyRegion);
 
-  // Put back the image as it was
-  nvvk::cmdBarrierImageLayout(
-      cmdBuf, imgIn.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-      VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_ASPECT_COLOR_BIT);
-  genCmdBuf.submitAndWait(cmdBuf);
+  // Put back the image as it was for the next batch, and make the copy
+  // visible to the host
+  std::swap(imageBarrier.oldLayout, imageBarrier.newLayout);
+  imageBarrier.srcAccessMask = 0;
+  imageBarrier.dstAccessMask =
+      VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  VkBufferMemoryBarrier bufferBarrier{VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
+  bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  bufferBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  bufferBarrier.buffer = pixelBufferOut;
+  bufferBarrier.offset = 0;
+  bufferBarrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       shaderStages | VK_PIPELINE_STAGE_HOST_BIT, 0, 0,
+                       nullptr, 1, &bufferBarrier, 1, &imageBarrier);
 }
 
-void Tracer::saveBufferToImage(nvvk::Buffer pixelBuffer, std::string outputpath,
-                               int channelId) {
-  auto fp = path(outputpath);
-  bool isRelativePath = !fp.is_absolute();
-  if (isRelativePath) outputpath = NVPSystem::exePath() + outputpath;
-
-  auto& m_alloc = ContextAware::getAlloc();
-  auto m_size = ContextAware::getSize();
-
-  // Default framebuffer color after post processing
-  if (channelId == -1)
-    vkTextureToBuffer(ContextAware::getOfflineColor(), pixelBuffer.buffer);
-  // Hdr channel before post processing
-  else
-    vkTextureToBuffer(m_pipelineGraphics.getColorTexture(channelId),
-                      pixelBuffer.buffer);
-
-  // Write the image to disk
-  void* data = m_alloc.map(pixelBuffer);
-  writeImage(outputpath.c_str(), m_size.width, m_size.height,
-             reinterpret_cast<float*>(data));
-  m_alloc.unmap(pixelBuffer);
+void Tracer::vkBufferToBuffer(const VkCommandBuffer& cmdBuf,
+                              const VkBuffer& bufferIn, VkDeviceSize size,
+                              const VkBuffer& pixelBufferOut,
+                              VkDeviceSize bufferOffset) {
+  // Wait for the shaders writing the buffer
+  VkBufferMemoryBarrier bufferBarrier{VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER};
+  bufferBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  bufferBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  bufferBarrier.buffer = bufferIn;
+  bufferBarrier.offset = 0;
+  bufferBarrier.size = size;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1,
+                       &bufferBarrier, 0, nullptr);
+
+  VkBufferCopy copyRegion{0, bufferOffset, size};
+  vkCmdCopyBuffer(cmdBuf, bufferIn, pixelBufferOut, 1, &copyRegion);
+
+  // Make the copy visible to the host
+  bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  bufferBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  bufferBarrier.buffer = pixelBufferOut;
+  bufferBarrier.offset = bufferOffset;
+  vkCmdPipelineBarrier(cmdBuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1,
+                       &bufferBarrier, 0, nullptr);
 }
@@ -1,16 +1,45 @@
 #pragma once
 
 #include "context/context.h"
+#include "loader/loader.h"
 #include "pipeline/pipeline_graphics.h"
 #include "pipeline/pipeline_post.h"
 #include "pipeline/pipeline_raytrace.h"
 #include "scene/scene.h"
 
+// Channels of the images of the flow of a pair, with whether the source
+// view sees the hit
+const vector<string> FLOW_CHANNELS = {"flow.x", "flow.y", "visible"};
+// Channels of the images of bidirectional mode: the forward flow on the
+// reference view grid and the backward flow on the source view grid, each
+// with whether the other view sees the hit and whether the flows agree
+const vector<string> BIDIRECTIONAL_CHANNELS = {
+    "forward.x",  "forward.y",  "forward.visible",  "forward.consistent",
+    "backward.x", "backward.y", "backward.visible", "backward.consistent"};
+// Channels of the images of compact output formats, which leave the flags to
+// the planes of a mask file next to the image, in the order of MaskPlanes
+const vector<string> COMPACT_CHANNELS = {"flow.x", "flow.y"};
+const vector<string> BIDIRECTIONAL_COMPACT_CHANNELS = {
+    "forward.x", "forward.y", "backward.x", "backward.y"};
+
 struct TracerInitSettings {
   bool offline = false;
   string scenefile = "";
   string outputname = "";
+  string backend = "gpu";  // gpu or cpu
+  bool benchmark = false;  // cpu: compare packet and single ray traversal
+  int threads = 0;         // cpu: tracing threads, gpu offline: image
+                           // writer threads, 0 for all hardware threads
+  int tileSize = 32;       // cpu: scheduler tile size in pixels
+  string asCache = "";     // cpu: directory of cached acceleration structures
+  int batchSize = 0;       // gpu offline: pairs traced per submission, 1 or
+                           // the largest reference group with fanOut
+  bool refCache = false;   // gpu offline: trace each reference view once
+  bool fanOut = false;     // gpu offline: one launch per reference view
   int gpuId = 0;
+  bool bidirectional = false;  // offline: both flows and their consistency
+  OutputFormat outputFormat = OutputFormat::Rgba32f;  // offline
+  ExrCompression exrCompression = ExrCompression::Zip;  // of output images
 };
 
 class Tracer : public ContextAware {
@@ -21,6 +50,7 @@ public:
 
 private:
   TracerInitSettings m_tis;
+  Loader m_loader;  // keeps the scene file parsed by init() for loading
   Scene m_scene;
   PipelineGraphics m_pipelineGraphics;
   PipelineRaytrace m_pipelineRaytrace;
@@ -30,13 +60,16 @@ private:
   void runOnline();
   void runOffline();
   void parallelLoading();
-  void vkTextureToBuffer(const nvvk::Texture& imgIn,
-                         const VkBuffer& pixelBufferOut);
-
-  // Transfer color data to pixelBuffer, and write it to disk as an image.
-  // channelId controls which color data will be copied to pixelBuffer:
-  // (1) channelId = -1, copy ldr output after post processing
-  // (2) channelId > 0, copy corresponding hdr channel before post processing
-  void saveBufferToImage(nvvk::Buffer pixelBuffer, std::string outputpath,
-                         int channelId = -1);
+  // Record the copy of the first layersNum layers of imgIn to
+  // pixelBufferOut from bufferOffset on, one after the other, once the
+  // shaders are done with imgIn
+  void vkTextureToBuffer(const VkCommandBuffer& cmdBuf,
+                         const nvvk::Texture& imgIn,
+                         const VkBuffer& pixelBufferOut, uint layersNum = 1,
+                         VkDeviceSize bufferOffset = 0);
+  // Record the copy of the first size bytes of bufferIn to pixelBufferOut
+  // from bufferOffset on, once the shaders are done with bufferIn
+  void vkBufferToBuffer(const VkCommandBuffer& cmdBuf, const VkBuffer& bufferIn,
+                        VkDeviceSize size, const VkBuffer& pixelBufferOut,
+                        VkDeviceSize bufferOffset);
 };
\ No newline at end of file
@@ -0,0 +1,459 @@
+#include "tracer_cpu.h"
+#include <loader/loader.h>
+
+#include <nvh/timesampler.hpp>
+#include <ext/tqdm.h>
+
+#include <half.h>
+
+#include <atomic>
+#include <cstring>
+
+#include <filesystem/path.h>
+using namespace filesystem;
+
+void TracerCpu::init(TracerInitSettings tis) {
+  m_tis = tis;
+  if (!m_tis.offline)
+    LOG_WARN("{}: cpu backend only supports offline mode", "TracerCpu");
+
+  // Get film size, the context is only used to hold it
+  auto filmResolution =
+      m_loader.loadSizeFirst(m_tis.scenefile, NVPSystem::exePath());
+  ContextAware::setSize(filmResolution);
+
+  // Keep the scene on host, then build the cpu acceleration structure
+  m_scene.init(reinterpret_cast<ContextAware*>(this), true);
+  m_loader.loadSceneFromJson(m_tis.scenefile, NVPSystem::exePath(), &m_scene);
+  m_accel.build(&m_scene, m_tis.asCache, uint(std::max(m_tis.threads, 0)));
+
+  // Scheduler tiles are whole packet tiles
+  m_tileSize = uint(std::max(m_tis.tileSize, 1));
+  m_tileSize = (m_tileSize + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE * CPU_TILE_SIZE;
+  m_scheduler.init(uint(std::max(m_tis.threads, 0)));
+  LOG_INFO("{}: {} threads, {}x{} tiles", "TracerCpu",
+           m_scheduler.getThreadsNum(), m_tileSize, m_tileSize);
+}
+
+// Flow of the pixels as the texels of a compact output format, and their
+// visibility and consistency as bits of mask planes, like storeOutput() in
+// utils/output.glsl
+static void packCompact(const vector<vec4>& pixels, bool halfFloat,
+                        vector<char>& texels, uint32_t* pVisible,
+                        uint32_t* pConsistent) {
+  size_t texelSize = halfFloat ? 2 * sizeof(half) : 2 * sizeof(float);
+  texels.resize(pixels.size() * texelSize);
+  for (size_t i = 0; i < pixels.size(); i++) {
+    char* pTexel = texels.data() + i * texelSize;
+    if (halfFloat) {
+      half flow[2] = {pixels[i].x, pixels[i].y};
+      memcpy(pTexel, flow, texelSize);
+    } else {
+      memcpy(pTexel, &pixels[i].x, texelSize);
+    }
+    uint32_t bit = 1u << (i % 32);
+    if (pixels[i].z >= 0.5f) pVisible[i / 32] |= bit;
+    if (pConsistent && pixels[i].w >= 0.5f) pConsistent[i / 32] |= bit;
+  }
+}
+
+// Keep in w whether each flow F(p) cancels out the backward flow B(q) of the
+// pixel q it lands in, like raytrace.consistency.rgen. B(q) is read from the
+// other image rather than traced again.
+static void checkConsistency(vector<vec4>& pixels,
+                             const vector<vec4>& backPixels, uint width,
+                             uint height) {
+  for (size_t p = 0; p < pixels.size(); p++) {
+    vec4& flow = pixels[p];
+    vec2 pixelQ = vec2(float(p % width), float(p / width)) +
+                  vec2(0.5f) + vec2(flow.x, flow.y);
+    flow.w = 0.f;
+    if (flow.z == 0.f || pixelQ.x < 0.f || pixelQ.y < 0.f ||
+        pixelQ.x >= float(width) || pixelQ.y >= float(height))
+      continue;
+    const vec4& backward = backPixels[size_t(pixelQ.y) * width +
+                                      size_t(pixelQ.x)];
+    if (backward.z > 0.f &&
+        nvmath::length(vec2(flow.x, flow.y) + vec2(backward.x, backward.y)) <
+            CPU_CONSISTENCY_THRESHOLD)
+      flow.w = 1.f;
+  }
+}
+
+void TracerCpu::run() {
+  if (m_tis.benchmark) {
+    runBenchmark();
+    return;
+  }
+
+  auto size = ContextAware::getSize();
+  vector<vec4> pixels(size.width * size.height);
+  // Bidirectional mode: backward flows, written with the forward flows
+  vector<vec4> backPixels(m_tis.bidirectional ? pixels.size() : 0);
+  // Compact output formats: texels of both flows and the visibility mask
+  bool compact = m_tis.outputFormat != OutputFormat::Rgba32f;
+  bool halfFloat = m_tis.outputFormat == OutputFormat::Rg16f;
+  vector<char> texels, backTexels;
+  size_t maskLayerWords = (pixels.size() + 31) / 32;
+  vector<uint32_t> mask(maskLayerWords * (m_tis.bidirectional ? MaskNum : 1));
+
+  auto pairsNum = m_scene.getPairsNum();
+  // Bidirectional mode: how many visible flows pass the consistency check
+  size_t visibleNum = 0, consistentNum = 0;
+
+  tqdm bar;
+  bar.set_theme_arrow();
+
+  for (int pairId = 0; pairId < pairsNum; pairId++) {
+    bar.progress(pairId, pairsNum);
+    renderPair(pairId, pixels);
+    if (m_tis.bidirectional) {
+      renderPair(pairId, backPixels, true);
+      checkConsistency(backPixels, pixels, size.width, size.height);
+      checkConsistency(pixels, backPixels, size.width, size.height);
+      for (auto pFlows : {&pixels, &backPixels})
+        for (const vec4& flow : *pFlows) {
+          visibleNum += flow.z > 0.f;
+          consistentNum += flow.z > 0.f && flow.w > 0.f;
+        }
+    }
+
+    // Save image, same naming and layout as Tracer::runOffline
+    static char outputName[200];
+    auto pairRefSrc = m_scene.getPair(pairId);
+    auto ref = pairRefSrc.first;
+    auto src = pairRefSrc.second;
+    sprintf(outputName, "%s_ref_%04d_src_%04d", m_tis.outputname.c_str(),
+            ref, src);
+    std::string outputpath = outputName;
+    if (!path(outputpath).is_absolute())
+      outputpath = NVPSystem::exePath() + outputpath;
+    if (compact) {
+      std::fill(mask.begin(), mask.end(), 0);
+      auto getPlane = [&](uint planeId) {
+        return mask.data() + planeId * maskLayerWords;
+      };
+      if (m_tis.bidirectional) {
+        packCompact(pixels, halfFloat, texels, getPlane(MaskForwardVisible),
+                    getPlane(MaskForwardConsistent));
+        packCompact(backPixels, halfFloat, backTexels,
+                    getPlane(MaskBackwardVisible),
+                    getPlane(MaskBackwardConsistent));
+        writeImageLayers(outputpath + ".exr", size.width, size.height,
+                         {texels.data(), backTexels.data()},
+                         BIDIRECTIONAL_COMPACT_CHANNELS, 2, halfFloat,
+                         m_tis.exrCompression);
+      } else {
+        packCompact(pixels, halfFloat, texels, getPlane(MaskForwardVisible),
+                    nullptr);
+        writeImageLayers(outputpath + ".exr", size.width, size.height,
+                         {texels.data()}, COMPACT_CHANNELS, 2, halfFloat,
+                         m_tis.exrCompression);
+      }
+      vector<const uint32_t*> planes;
+      for (size_t wordId = 0; wordId < mask.size(); wordId += maskLayerWords)
+        planes.push_back(mask.data() + wordId);
+      writeMask(outputpath + ".mask", planes,
+                maskLayerWords * sizeof(uint32_t));
+    } else if (m_tis.bidirectional) {
+      writeImageLayers(outputpath + ".exr", size.width, size.height,
+                       {pixels.data(), backPixels.data()},
+                       BIDIRECTIONAL_CHANNELS, 4, false, m_tis.exrCompression);
+    } else {
+      writeImageLayers(outputpath + ".exr", size.width, size.height,
+                       {pixels.data()}, FLOW_CHANNELS, 4, false,
+                       m_tis.exrCompression);
+    }
+  }
+
+  bar.finish();
+  if (m_tis.bidirectional)
+    LOG_INFO("{}: {} of {} visible flows are forward-backward consistent",
+             "TracerCpu", consistentNum, visibleNum);
+  m_scheduler.logStats();
+}
+
+void TracerCpu::deinit() {
+  m_scheduler.deinit();
+  m_accel.deinit();
+  m_scene.deinit();
+}
+
+template <typename TileFn>
+void TracerCpu::forEachTile(TileFn tileFn) {
+  auto size = ContextAware::getSize();
+  uint packetsX = (size.width + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+  uint packetsY = (size.height + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+  uint packetsPerTile = m_tileSize / CPU_TILE_SIZE;
+  uint tilesX = (packetsX + packetsPerTile - 1) / packetsPerTile;
+  uint tilesY = (packetsY + packetsPerTile - 1) / packetsPerTile;
+
+  // Row major tiles, so the ranges of the threads are bands of the film
+  m_scheduler.run(tilesX * tilesY, [&](uint32_t tileId) {
+    uint beginX = tileId % tilesX * packetsPerTile;
+    uint beginY = tileId / tilesX * packetsPerTile;
+    uint endX = std::min(beginX + packetsPerTile, packetsX);
+    uint endY = std::min(beginY + packetsPerTile, packetsY);
+    for (uint tileY = beginY; tileY < endY; tileY++)
+      for (uint tileX = beginX; tileX < endX; tileX++) tileFn(tileX, tileY);
+  });
+}
+
+void TracerCpu::renderPair(int pairId, vector<vec4>& pixels, bool backward) {
+  auto pairRefSrc = m_scene.getPair(pairId);
+  if (backward) std::swap(pairRefSrc.first, pairRefSrc.second);
+  GpuCamera camRef = m_scene.getGpuCamera(pairRefSrc.first);
+  GpuCamera camSrc = m_scene.getGpuCamera(pairRefSrc.second);
+  forEachTile([&](uint tileX, uint tileY) {
+    traceTile(camRef, camSrc, tileX, tileY, pixels);
+  });
+}
+
+void TracerCpu::runBenchmark() {
+  auto size = ContextAware::getSize();
+  auto pairsNum = m_scene.getPairsNum();
+  size_t raysNum = size_t(size.width) * size.height;
+  double singleTotal = 0.0, packetTotal = 0.0, shadowTotal = 0.0;
+  size_t shadowRaysTotal = 0;
+
+  // Shadow rays of the pair, built outside of the timed passes
+  vector<CpuRay> shadowRays(raysNum);
+  vector<float> shadowTmax(raysNum);
+  vector<char> shadowMask(raysNum);
+
+  for (int pairId = 0; pairId < pairsNum; pairId++) {
+    auto pairRefSrc = m_scene.getPair(pairId);
+    GpuCamera camRef = m_scene.getGpuCamera(pairRefSrc.first);
+    GpuCamera camSrc = m_scene.getGpuCamera(pairRefSrc.second);
+    vec3 camSrcOrigin = transformPoint(camSrc.cameraToWorld, vec3(0.f));
+    std::atomic<size_t> singleHits{0}, packetHits{0}, occludedNum{0};
+
+    nvh::Stopwatch sw;
+    forEachTile([&](uint tileX, uint tileY) {
+      CpuRayPacket packet = generatePacket(camRef, tileX, tileY);
+      size_t hitsNum = 0;
+      for (uint64_t m = packet.mask; m; m &= m - 1) {
+        CpuRay ray{packet.o, packet.d[getFirstRay(m)]};
+        CpuHit hit;
+        hitsNum += m_accel.intersect(ray, CPU_MINIMUM, CPU_INFINITY, hit);
+      }
+      singleHits += hitsNum;
+    });
+    double singleTime = sw.elapsed();
+
+    sw.reset();
+    forEachTile([&](uint tileX, uint tileY) {
+      CpuRayPacket packet = generatePacket(camRef, tileX, tileY);
+      CpuHit hits[CPU_PACKET_SIZE];
+      uint64_t hitMask =
+          m_accel.intersectPacket(packet, CPU_MINIMUM, CPU_INFINITY, hits);
+      packetHits += getRaysNum(hitMask);
+    });
+    double packetTime = sw.elapsed();
+
+    forEachTile([&](uint tileX, uint tileY) {
+      CpuRayPacket packet = generatePacket(camRef, tileX, tileY);
+      CpuHit hits[CPU_PACKET_SIZE];
+      uint64_t hitMask =
+          m_accel.intersectPacket(packet, CPU_MINIMUM, CPU_INFINITY, hits);
+      for (uint64_t m = packet.mask; m; m &= m - 1) {
+        int i = getFirstRay(m);
+        uint x = tileX * CPU_TILE_SIZE + i % CPU_TILE_SIZE;
+        uint y = tileY * CPU_TILE_SIZE + i / CPU_TILE_SIZE;
+        uint pixelId = y * size.width + x;
+        shadowMask[pixelId] = (hitMask >> i) & 1;
+        if (!shadowMask[pixelId]) continue;
+        vec3 refHit;
+        shadowRays[pixelId] =
+            generateShadowRay(camSrcOrigin, {packet.o, packet.d[i]}, hits[i],
+                              refHit, shadowTmax[pixelId]);
+      }
+    });
+
+    sw.reset();
+    forEachTile([&](uint tileX, uint tileY) {
+      CpuOccluderCache cache;
+      size_t occluded = 0;
+      for (uint i = 0; i < CPU_PACKET_SIZE; i++) {
+        uint x = tileX * CPU_TILE_SIZE + i % CPU_TILE_SIZE;
+        uint y = tileY * CPU_TILE_SIZE + i / CPU_TILE_SIZE;
+        uint pixelId = y * size.width + x;
+        if (x >= size.width || y >= size.height || !shadowMask[pixelId])
+          continue;
+        occluded += m_accel.occluded(shadowRays[pixelId], 0.f,
+                                     shadowTmax[pixelId], &cache);
+      }
+      occludedNum += occluded;
+    });
+    double shadowTime = sw.elapsed();
+    size_t shadowRaysNum = packetHits;
+
+    singleTotal += singleTime;
+    packetTotal += packetTime;
+    shadowTotal += shadowTime;
+    shadowRaysTotal += shadowRaysNum;
+    LOG_INFO(
+        "{}: pair {}, primary rays: single {:.2f} Mrays/s, {}x{} packets "
+        "{:.2f} Mrays/s ({:.2f}x), {} / {} hits",
+        "TracerCpu", pairId, raysNum / (singleTime * 1000.0), CPU_TILE_SIZE,
+        CPU_TILE_SIZE, raysNum / (packetTime * 1000.0),
+        singleTime / packetTime, size_t(singleHits), size_t(packetHits));
+    if (shadowRaysNum > 0)
+      LOG_INFO(
+          "{}: pair {}, shadow rays: {:.2f} Mrays/s, {:.0f}% of a packet "
+          "primary ray, {} / {} occluded",
+          "TracerCpu", pairId, shadowRaysNum / (shadowTime * 1000.0),
+          100.0 * (shadowTime / shadowRaysNum) / (packetTime / raysNum),
+          size_t(occludedNum), shadowRaysNum);
+  }
+
+  if (pairsNum == 0) return;
+  LOG_INFO(
+      "{}: {} pairs, primary rays: single {:.2f} Mrays/s, {}x{} packets "
+      "{:.2f} Mrays/s ({:.2f}x), shadow rays {:.2f} Mrays/s",
+      "TracerCpu", pairsNum, raysNum * pairsNum / (singleTotal * 1000.0),
+      CPU_TILE_SIZE, CPU_TILE_SIZE,
+      raysNum * pairsNum / (packetTotal * 1000.0), singleTotal / packetTotal,
+      shadowRaysTotal / (shadowTotal * 1000.0));
+  m_scheduler.logStats();
+}
+
+void TracerCpu::traceTile(const GpuCamera& camRef, const GpuCamera& camSrc,
+                          uint tileX, uint tileY, vector<vec4>& pixels) {
+  auto size = ContextAware::getSize();
+  CpuRayPacket packet = generatePacket(camRef, tileX, tileY);
+  CpuHit hits[CPU_PACKET_SIZE];
+  uint64_t hitMask =
+      m_accel.intersectPacket(packet, CPU_MINIMUM, CPU_INFINITY, hits);
+
+  // Shadow rays of a tile are coherent too, they often share their occluder
+  CpuOccluderCache cache;
+  for (uint64_t m = packet.mask; m; m &= m - 1) {
+    int i = getFirstRay(m);
+    uint x = tileX * CPU_TILE_SIZE + i % CPU_TILE_SIZE;
+    uint y = tileY * CPU_TILE_SIZE + i / CPU_TILE_SIZE;
+    vec2 pixelRefView = vec2(float(x), float(y)) + vec2(0.5f);
+
+    // z denotes whether this texel stores information of correspondence flow
+    vec4 radiance = vec4(0.f, 0.f, 0.f, 1.f);
+    if (hitMask & (1ull << i))
+      radiance = shadePixel(camSrc, {packet.o, packet.d[i]}, hits[i],
+                            pixelRefView, cache);
+    pixels[y * size.width + x] = radiance;
+  }
+}
+
+CpuRay TracerCpu::generateRay(const GpuCamera& camRef, vec2 pixel) {
+  // Set camera origin in world space
+  CpuRay ray{transformPoint(camRef.cameraToWorld, vec3(0.f)), vec3(0.f)};
+  if (camRef.type == CameraTypePerspective) {
+    // Compute raster and camera sample positions
+    vec3 pFilm = vec3(pixel.x, pixel.y, 0.f);
+    vec3 pCamera = transformPoint(camRef.rasterToCamera, pFilm);
+    // Treat point as direction since camera origin is at (0,0,0)
+    vec3 r = makeNormal(pCamera);
+    // Transform ray to world space
+    ray.d = transformDirection(camRef.cameraToWorld, r);
+  } else if (camRef.type == CameraTypeOpencv) {
+    vec4 fxfycxcy = camRef.fxfycxcy;
+    vec3 r = vec3((pixel.x - fxfycxcy.z) / fxfycxcy.x,
+                  (pixel.y - fxfycxcy.w) / fxfycxcy.y, 1.f);
+    ray.d = transformDirection(camRef.cameraToWorld, r);
+  }
+  return ray;
+}
+
+CpuRayPacket TracerCpu::generatePacket(const GpuCamera& camRef, uint tileX,
+                                       uint tileY) {
+  auto size = ContextAware::getSize();
+  CpuRayPacket packet;
+  packet.o = transformPoint(camRef.cameraToWorld, vec3(0.f));
+  for (uint i = 0; i < CPU_PACKET_SIZE; i++) {
+    uint x = tileX * CPU_TILE_SIZE + i % CPU_TILE_SIZE;
+    uint y = tileY * CPU_TILE_SIZE + i / CPU_TILE_SIZE;
+    packet.d[i] = vec3(0.f);
+    if (x >= size.width || y >= size.height) continue;
+    // Pixel center
+    packet.d[i] = generateRay(camRef, vec2(float(x), float(y)) + vec2(0.5f)).d;
+    packet.mask |= 1ull << i;
+  }
+
+  // Rays through the film corners of the tile, pixel centers are half a
+  // pixel inside the frustum they span
+  vec2 tileMin = vec2(float(tileX), float(tileY)) * float(CPU_TILE_SIZE);
+  float tileSize = float(CPU_TILE_SIZE);
+  packet.corners[0] = generateRay(camRef, tileMin).d;
+  packet.corners[1] = generateRay(camRef, tileMin + vec2(tileSize, 0.f)).d;
+  packet.corners[2] = generateRay(camRef, tileMin + vec2(tileSize)).d;
+  packet.corners[3] = generateRay(camRef, tileMin + vec2(0.f, tileSize)).d;
+  return packet;
+}
+
+CpuRay TracerCpu::generateShadowRay(const vec3& camSrcOrigin,
+                                    const CpuRay& ray, const CpuHit& hit,
+                                    vec3& refHit, float& tmax) {
+  vec3 ffnormal;
+  getHitState(ray, hit, refHit, ffnormal);
+
+  vec3 o = offsetPositionAlongNormal(refHit, ffnormal);
+  float dist = nvmath::length(camSrcOrigin - o);
+  tmax = dist - CPU_EPS;
+  return {o, makeNormal(camSrcOrigin - o)};
+}
+
+vec4 TracerCpu::shadePixel(const GpuCamera& camSrc, const CpuRay& ray,
+                           const CpuHit& hit, vec2 pixelRefView,
+                           CpuOccluderCache& cache) {
+  vec3 camSrcOrigin = transformPoint(camSrc.cameraToWorld, vec3(0.f));
+  vec3 refHit;
+  float tmax;
+  CpuRay shadowRay = generateShadowRay(camSrcOrigin, ray, hit, refHit, tmax);
+  if (m_accel.occluded(shadowRay, 0.f, tmax, &cache))
+    return vec4(0.f, 0.f, 0.f, 1.f);
+
+  vec2 flow = projectToView(camSrc, refHit) - pixelRefView;
+  return vec4(flow.x, flow.y, 1.f, 1.f);
+}
+
+vec2 TracerCpu::projectToView(const GpuCamera& cam, const vec3& pos) {
+  vec2 pixel;
+  if (cam.type == CameraTypePerspective) {
+    vec3 p = transformPoint(cam.worldToRaster, pos);
+    pixel = vec2(p.x, p.y);
+  } else if (cam.type == CameraTypeOpencv) {
+    vec4 fxfycxcy = cam.fxfycxcy;
+    vec3 hitInCameraSpace = transformPoint(cam.worldToCamera, pos);
+    hitInCameraSpace.x /= hitInCameraSpace.z;
+    hitInCameraSpace.y /= hitInCameraSpace.z;
+    pixel.x = fxfycxcy.z + fxfycxcy.x * hitInCameraSpace.x;
+    pixel.y = fxfycxcy.w + fxfycxcy.y * hitInCameraSpace.y;
+  }
+  return pixel;
+}
+
+void TracerCpu::getHitState(const CpuRay& ray, const CpuHit& hit, vec3& pos,
+                            vec3& ffnormal) {
+  const CpuInstance& inst = m_accel.getInstance(hit.instanceId);
+  const vec3* positions = inst.pMesh->getPositions();
+  const vec3* normals = inst.pMesh->getNormals();
+  const uint* indices = inst.pMesh->getIndices();
+
+  uint i0 = indices[3 * hit.primId + 0];
+  uint i1 = indices[3 * hit.primId + 1];
+  uint i2 = indices[3 * hit.primId + 2];
+  const vec3& p0 = positions[i0];
+  const vec3& p1 = positions[i1];
+  const vec3& p2 = positions[i2];
+  vec3 ba = vec3(1.f - hit.bary.x - hit.bary.y, hit.bary.x, hit.bary.y);
+
+  pos = transformPoint(inst.objectToWorld, p0 * ba.x + p1 * ba.y + p2 * ba.z);
+  // Face normal when the mesh has no vertex normals, like the shader
+  vec3 N = normals ? normals[i0] * ba.x + normals[i1] * ba.y +
+                         normals[i2] * ba.z
+                   : nvmath::cross(p1 - p0, p2 - p0);
+  N = makeNormal(transformNormal(inst.worldToObject, N));
+  vec3 V = makeNormal(-ray.d);
+
+  // Face forward shading normal, see configureShadingFrame()
+  ffnormal = nvmath::dot(N, V) > 0.f ? N : -N;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "tracer.h"
+#include <cpu/accel.h>
+#include <cpu/scheduler.h>
+
+// Cpu backend of the correspondence tracer. It runs the logic of
+// raytrace.correspondence.rgen and raytrace.intersect.rchit on host threads,
+// so correspondence jobs can run on machines without a ray tracing gpu.
+// Vulkan is never initialized, only the film size of the context is used.
+class TracerCpu : public ContextAware {
+public:
+  void init(TracerInitSettings tis);
+  void run();
+  void deinit();
+
+private:
+  TracerInitSettings m_tis;
+  Loader m_loader;
+  Scene m_scene;
+  CpuAccel m_accel;
+  TileScheduler m_scheduler;
+  uint m_tileSize{32};  // pixels, a multiple of CPU_TILE_SIZE
+
+private:
+  // Trace the primary rays of a tile as one packet, then store what the
+  // raygen shader stores for each pixel: vec4(flow, visibility, 1)
+  void traceTile(const GpuCamera& camRef, const GpuCamera& camSrc, uint tileX,
+                 uint tileY, vector<vec4>& pixels);
+  // Primary ray through a film position of the reference view
+  CpuRay generateRay(const GpuCamera& camRef, vec2 pixel);
+  CpuRayPacket generatePacket(const GpuCamera& camRef, uint tileX, uint tileY);
+  // Shadow ray from a primary hit toward the source camera origin, refHit
+  // gets the world position of the hit
+  CpuRay generateShadowRay(const vec3& camSrcOrigin, const CpuRay& ray,
+                           const CpuHit& hit, vec3& refHit, float& tmax);
+  // Visibility test and reprojection of a primary hit into the source view
+  vec4 shadePixel(const GpuCamera& camSrc, const CpuRay& ray,
+                  const CpuHit& hit, vec2 pixelRefView,
+                  CpuOccluderCache& cache);
+  // Film position of a world position in a view
+  vec2 projectToView(const GpuCamera& cam, const vec3& pos);
+  // Counterpart of getHitState() in the closest hit shader
+  void getHitState(const CpuRay& ray, const CpuHit& hit, vec3& pos,
+                   vec3& ffnormal);
+  // Flow of a pair from its reference view, or backward from its source view
+  void renderPair(int pairId, vector<vec4>& pixels, bool backward = false);
+  // Run tileFn(tileX, tileY) on all packet tiles of the film, spread over the
+  // threads of the scheduler by tiles of m_tileSize pixels
+  template <typename TileFn>
+  void forEachTile(TileFn tileFn);
+  // Rays per second of single ray and packet traversal for primary rays, and
+  // of the shadow rays
+  void runBenchmark();
+};